@@ -0,0 +1,967 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "configure.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "query.h"
+#include "histogram.h"
+#include "endianness.h"
+
+// opcodes of the request mix, in --ratio order
+#define GB_BENCH_SET  0
+#define GB_BENCH_GET  1
+#define GB_BENCH_MGET 2
+#define GB_BENCH_MDEL 3
+#define GB_BENCH_INC  4
+#define GB_BENCH_OPS  5
+
+#define GB_BENCH_DIST_UNIFORM     0
+#define GB_BENCH_DIST_ZIPF        1
+#define GB_BENCH_DIST_EXPONENTIAL 2
+
+// request header, uint32 size + short opcode
+#define GB_BENCH_REQ_HEADER ( sizeof(uint32_t) + sizeof(short) )
+// reply header, short code + byte encoding + uint32 size
+#define GB_BENCH_REPL_HEADER ( sizeof(short) + sizeof(char) + sizeof(uint32_t) )
+#define GB_BENCH_MAX_KEY     0xFF
+// requests per round trip while prefilling the keyspace
+#define GB_BENCH_PREFILL_BATCH 256
+
+typedef struct
+{
+    char    *unix_socket;
+    char    *address;
+    int      port;
+    int      clients;
+    int      threads;
+    int      pipeline;
+    long     requests;
+    double   duration;
+    uint64_t keyspace;
+    int      distribution;
+    double   theta;
+    int      levels;
+    uint64_t fanout;
+    size_t   value_min;
+    size_t   value_max;
+    int      value_distribution;
+    int      ratio[GB_BENCH_OPS];
+    int      ttl;
+    int      prefill;
+    uint64_t seed;
+}
+gbBenchConfig;
+
+typedef struct
+{
+    int      fd;
+    // requests of the batch being sent
+    char    *obuf;
+    size_t   osize;
+    size_t   olen;
+    size_t   osent;
+    // replies being received
+    char    *ibuf;
+    size_t   isize;
+    size_t   ilen;
+    // mix index of every request of the batch and the next one to be answered
+    int     *batch;
+    int      nbatch;
+    int      next;
+    // when the first byte of the batch was sent
+    uint64_t sent;
+}
+gbBenchClient;
+
+typedef struct
+{
+    pthread_t      thread;
+    int            id;
+    gbBenchClient *clients;
+    int            nclients;
+    uint64_t       rng;
+    // requests left to send, < 0 when the run is time limited
+    long           budget;
+    uint64_t       deadline;
+    gbHistogram    latency[GB_BENCH_OPS];
+    uint64_t       misses[GB_BENCH_OPS];
+    uint64_t       errors[GB_BENCH_OPS];
+}
+gbBenchThread;
+
+static const char *gbBenchOpNames[GB_BENCH_OPS] = { "set", "get", "mget", "mdel", "inc" };
+static const short gbBenchOpCodes[GB_BENCH_OPS] = { OP_SET, OP_GET, OP_MGET, OP_MDEL, OP_INC };
+
+static gbBenchConfig config;
+// zipf generator constants, see Gray et al. "Quickly Generating Billion-Record Synthetic Databases"
+static double zipf_zetan, zipf_alpha, zipf_eta;
+// values are slices of this buffer
+static char *values = NULL;
+
+static struct option long_options[] =
+{
+    { "help",               no_argument,       0, 'h' },
+    { "unix_socket",        required_argument, 0, 's' },
+    { "address",            required_argument, 0, 'a' },
+    { "port",               required_argument, 0, 'p' },
+    { "clients",            required_argument, 0, 'c' },
+    { "threads",            required_argument, 0, 't' },
+    { "pipeline",           required_argument, 0, 'P' },
+    { "requests",           required_argument, 0, 'n' },
+    { "duration",           required_argument, 0, 'd' },
+    { "keyspace",           required_argument, 0, 'k' },
+    { "distribution",       required_argument, 0, 'D' },
+    { "zipf_theta",         required_argument, 0, 'z' },
+    { "levels",             required_argument, 0, 'l' },
+    { "fanout",             required_argument, 0, 'f' },
+    { "value_size",         required_argument, 0, 'v' },
+    { "value_distribution", required_argument, 0, 'V' },
+    { "ratio",              required_argument, 0, 'r' },
+    { "ttl",                required_argument, 0, 'T' },
+    { "prefill",            no_argument,       0, 'w' },
+    { "seed",               required_argument, 0, 'S' },
+
+    {0, 0, 0, 0}
+};
+
+static char *descriptions[] = {
+    "Print this help menu and exit.",
+    "UNIX socket of the server, default " GB_DEFAULT_UNIX_SOCKET " unless --address is given.",
+    "Address of the TCP server.",
+    "Port of the TCP server.",
+    "Number of concurrent connections.",
+    "Number of threads the connections are spread on.",
+    "Number of requests each connection sends before waiting for their replies.",
+    "Total number of requests to send.",
+    "Run for this many seconds instead of a fixed number of requests.",
+    "Number of distinct keys.",
+    "How keys are picked, 'uniform' or 'zipf'.",
+    "Skew of the zipf distribution, between 0 and 1 excluded.",
+    "Number of levels of the key hierarchy, 1 for flat keys.",
+    "Children of every node of the key hierarchy, MGET and MDEL act on all the siblings of a key.",
+    "Value size in bytes, MIN or MIN:MAX.",
+    "How value sizes between MIN and MAX are picked, 'uniform' or 'exponential'.",
+    "Weights of the SET:GET:MGET:MDEL:INC requests.",
+    "TTL of the stored values, 0 for none.",
+    "Store every key before the run starts.",
+    "Random seed, runs with the same seed send the same requests."
+};
+
+static void gbBenchHelpMenu( char **argv, int exitcode )
+{
+    size_t i = 0;
+    struct option *popt = &long_options[0];
+    char s[0xFF];
+
+    printf( "Gibson benchmark v%s ( built %s )\n", VERSION, BUILD_DATETIME );
+    printf( "Released under %s\n\n", LICENSE );
+
+    printf( "Usage: %s [options]\n", argv[0] );
+    printf( "Options:\n" );
+
+    while( popt && popt->name )
+    {
+        memset( s, 0x00, 0xFF );
+
+        sprintf( s, "  -%c, --%s", popt->val, popt->name );
+
+        if( popt->has_arg == required_argument )
+            strcat( s, " VALUE" );
+
+        printf( "%-35s %s\n", s, descriptions[i] );
+
+        ++popt;
+        ++i;
+    }
+
+    printf("\n");
+
+    exit(exitcode);
+}
+
+static void gbBenchFatal( const char *msg )
+{
+    fprintf( stderr, "%s : %s\n", msg, errno ? strerror(errno) : "invalid value" );
+    exit(1);
+}
+
+// xorshift64*, every thread owns its state
+static uint64_t gbBenchRandom( uint64_t *state )
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double gbBenchRandomDouble( uint64_t *state )
+{
+    return ( gbBenchRandom( state ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+static void gbBenchZipfInit( uint64_t n, double theta )
+{
+    double zeta2 = 0.0;
+    uint64_t i;
+
+    zipf_zetan = 0.0;
+    for( i = 1; i <= n; ++i )
+    {
+        zipf_zetan += 1.0 / pow( i, theta );
+        if( i == 2 )
+            zeta2 = zipf_zetan;
+    }
+
+    zipf_alpha = 1.0 / ( 1.0 - theta );
+    zipf_eta   = ( 1.0 - pow( 2.0 / n, 1.0 - theta ) ) / ( 1.0 - zeta2 / zipf_zetan );
+}
+
+static uint64_t gbBenchPickKey( uint64_t *state )
+{
+    uint64_t rank;
+    double u, uz;
+
+    if( config.distribution == GB_BENCH_DIST_UNIFORM )
+        return gbBenchRandom( state ) % config.keyspace;
+
+    u  = gbBenchRandomDouble( state );
+    uz = u * zipf_zetan;
+
+    if( uz < 1.0 )
+        rank = 0;
+
+    else if( uz < 1.0 + pow( 0.5, config.theta ) )
+        rank = 1;
+
+    else
+        rank = (uint64_t)( config.keyspace * pow( zipf_eta * u - zipf_eta + 1.0, zipf_alpha ) );
+
+    // scatter the hot keys all over the keyspace ( and the server shards )
+    return ( rank * 0x9E3779B97F4A7C15ULL ) % config.keyspace;
+}
+
+static size_t gbBenchPickValueSize( uint64_t *state )
+{
+    size_t span = config.value_max - config.value_min,
+           size;
+
+    if( span == 0 )
+        return config.value_min;
+
+    else if( config.value_distribution == GB_BENCH_DIST_UNIFORM )
+        return config.value_min + gbBenchRandom( state ) % ( span + 1 );
+
+    // mostly small values with a long tail, the mean is a quarter of the span
+    size = config.value_min + (size_t)( -log( 1.0 - gbBenchRandomDouble( state ) ) * span / 4.0 );
+
+    return size > config.value_max ? config.value_max : size;
+}
+
+/*
+ * Flat keys are "key:<id>" with the id zero padded, so that the siblings of
+ * a key are the ones differing only by the last digit. Hierarchical keys are
+ * "key:<top>:<a>:<b>" with every level but the top one below 'fanout'. When
+ * 'parent' is set, only the prefix shared with the siblings is emitted.
+ */
+static size_t gbBenchFormatKey( char *buffer, const char *ns, uint64_t id, int parent )
+{
+    static int width = 0;
+    uint64_t digits[64], top = id;
+    size_t len;
+    int i;
+
+    if( config.levels <= 1 )
+    {
+        if( width == 0 )
+            width = snprintf( buffer, GB_BENCH_MAX_KEY, "%llu", (unsigned long long)( config.keyspace - 1 ) );
+
+        len = snprintf( buffer, GB_BENCH_MAX_KEY, "%s:%0*llu", ns, width, (unsigned long long)id );
+
+        return parent && len > strlen(ns) + 2 ? len - 1 : len;
+    }
+
+    for( i = 0; i < config.levels - 1; ++i )
+    {
+        digits[i] = top % config.fanout;
+        top      /= config.fanout;
+    }
+
+    len = snprintf( buffer, GB_BENCH_MAX_KEY, "%s:%llu", ns, (unsigned long long)top );
+
+    for( i = config.levels - 2; i >= ( parent ? 1 : 0 ); --i )
+        len += snprintf( buffer + len, GB_BENCH_MAX_KEY - len, ":%llu", (unsigned long long)digits[i] );
+
+    if( parent )
+        buffer[len++] = ':';
+
+    return len;
+}
+
+static int gbBenchConnect(void)
+{
+    int fd, one = 1;
+
+    if( config.address == NULL )
+    {
+        struct sockaddr_un sun;
+
+        memset( &sun, 0x00, sizeof(sun) );
+        sun.sun_family = AF_UNIX;
+        strncpy( sun.sun_path, config.unix_socket, sizeof(sun.sun_path) - 1 );
+
+        if( ( fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 || connect( fd, (struct sockaddr *)&sun, sizeof(sun) ) != 0 )
+            gbBenchFatal( config.unix_socket );
+    }
+    else
+    {
+        struct addrinfo hints, *res = NULL;
+        char port[16];
+
+        memset( &hints, 0x00, sizeof(hints) );
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        snprintf( port, sizeof(port), "%d", config.port );
+
+        if( getaddrinfo( config.address, port, &hints, &res ) != 0 )
+            gbBenchFatal( config.address );
+
+        if( ( fd = socket( res->ai_family, SOCK_STREAM, 0 ) ) == -1 || connect( fd, res->ai_addr, res->ai_addrlen ) != 0 )
+            gbBenchFatal( config.address );
+
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+        freeaddrinfo(res);
+    }
+
+    return fd;
+}
+
+static void gbBenchReserve( char **buffer, size_t *size, size_t needed )
+{
+    if( needed > *size )
+    {
+        *size   = needed * 2;
+        *buffer = realloc( *buffer, *size );
+        if( *buffer == NULL )
+            gbBenchFatal( "realloc" );
+    }
+}
+
+// append a request made of 'nparts' space separated parts
+static void gbBenchAppendRequest( gbBenchClient *client, short op, int nparts, const char **parts, size_t *lens )
+{
+    uint32_t size = sizeof(short);
+    char *p;
+    int i;
+
+    for( i = 0; i < nparts; ++i )
+        size += lens[i] + ( i > 0 );
+
+    gbBenchReserve( &client->obuf, &client->osize, client->olen + sizeof(uint32_t) + size );
+
+    p = client->obuf + client->olen;
+
+    memcpy( p, memrev32ifbe(&size), sizeof(uint32_t) ); p += sizeof(uint32_t);
+    memcpy( p, memrev16ifbe(&op), sizeof(short) );      p += sizeof(short);
+
+    for( i = 0; i < nparts; ++i )
+    {
+        if( i > 0 )
+            *p++ = ' ';
+
+        memcpy( p, parts[i], lens[i] );
+        p += lens[i];
+    }
+
+    client->olen = p - client->obuf;
+}
+
+static void gbBenchAppendSet( gbBenchClient *client, uint64_t *state, uint64_t id )
+{
+    char ttl[32], key[GB_BENCH_MAX_KEY];
+    const char *parts[3] = { ttl, key, values };
+    size_t lens[3];
+
+    lens[0] = snprintf( ttl, sizeof(ttl), "%d", config.ttl );
+    lens[1] = gbBenchFormatKey( key, "key", id, 0 );
+    lens[2] = gbBenchPickValueSize( state );
+
+    gbBenchAppendRequest( client, OP_SET, 3, parts, lens );
+}
+
+// queue a random request of the mix, returning its mix index
+static int gbBenchAppendRandom( gbBenchThread *thread, gbBenchClient *client )
+{
+    int pick = gbBenchRandom( &thread->rng ) % 100, op = 0;
+    uint64_t id = gbBenchPickKey( &thread->rng );
+    char key[GB_BENCH_MAX_KEY];
+    const char *parts[1] = { key };
+    size_t lens[1];
+
+    while( op < GB_BENCH_OPS - 1 && pick >= config.ratio[op] )
+        pick -= config.ratio[op++];
+
+    switch( op )
+    {
+        case GB_BENCH_SET:
+
+            gbBenchAppendSet( client, &thread->rng, id );
+
+        break;
+
+        case GB_BENCH_INC:
+
+            lens[0] = gbBenchFormatKey( key, "cnt", id, 0 );
+            gbBenchAppendRequest( client, OP_INC, 1, parts, lens );
+
+        break;
+
+        default:
+
+            lens[0] = gbBenchFormatKey( key, "key", id, op == GB_BENCH_MGET || op == GB_BENCH_MDEL );
+            gbBenchAppendRequest( client, gbBenchOpCodes[op], 1, parts, lens );
+    }
+
+    return op;
+}
+
+/*
+ * Consume the complete replies in the input buffer, returning how many there
+ * were. When 'thread' is not NULL their latency is recorded under the mix
+ * index of the request they answer.
+ */
+static int gbBenchParseReplies( gbBenchThread *thread, gbBenchClient *client, uint64_t now )
+{
+    size_t off = 0;
+    int n = 0;
+
+    while( client->ilen - off >= GB_BENCH_REPL_HEADER )
+    {
+        short code;
+        uint32_t size;
+        int op;
+
+        memcpy( &code, client->ibuf + off, sizeof(short) );
+        memcpy( &size, client->ibuf + off + sizeof(short) + sizeof(char), sizeof(uint32_t) );
+
+        (void)memrev16ifbe(&code);
+        (void)memrev32ifbe(&size);
+
+        if( client->ilen - off < GB_BENCH_REPL_HEADER + size )
+            break;
+
+        off += GB_BENCH_REPL_HEADER + size;
+        ++n;
+
+        if( thread != NULL && client->next < client->nbatch )
+        {
+            op = client->batch[ client->next++ ];
+
+            gbHistogramRecord( &thread->latency[op], now - client->sent );
+
+            if( code == REPL_ERR_NOT_FOUND )
+                ++thread->misses[op];
+
+            else if( code != REPL_OK && code != REPL_VAL && code != REPL_KVAL )
+                ++thread->errors[op];
+        }
+    }
+
+    if( off > 0 )
+    {
+        memmove( client->ibuf, client->ibuf + off, client->ilen - off );
+        client->ilen -= off;
+    }
+
+    return n;
+}
+
+// read whatever is available, 0 when the connection has been closed
+static int gbBenchRead( gbBenchClient *client )
+{
+    ssize_t r;
+
+    // make room for at least a whole socket buffer worth of replies
+    gbBenchReserve( &client->ibuf, &client->isize, client->ilen + GBNET_IO_CHUNK_SIZE );
+
+    r = read( client->fd, client->ibuf + client->ilen, client->isize - client->ilen );
+    if( r > 0 )
+        client->ilen += r;
+
+    return r != 0 && ( r > 0 || errno == EAGAIN || errno == EINTR );
+}
+
+static int gbBenchWrite( gbBenchClient *client )
+{
+    ssize_t w = write( client->fd, client->obuf + client->osent, client->olen - client->osent );
+
+    if( w > 0 )
+        client->osent += w;
+
+    return w > 0 || errno == EAGAIN || errno == EINTR;
+}
+
+static void gbBenchPrefill(void)
+{
+    gbBenchClient client;
+    uint64_t state = config.seed, id = 0;
+    int n, pending;
+
+    memset( &client, 0x00, sizeof(client) );
+
+    client.fd = gbBenchConnect();
+
+    while( id < config.keyspace )
+    {
+        client.olen = client.osent = 0;
+
+        for( pending = 0; pending < GB_BENCH_PREFILL_BATCH && id < config.keyspace; ++pending, ++id )
+            gbBenchAppendSet( &client, &state, id );
+
+        while( client.osent < client.olen )
+            if( gbBenchWrite( &client ) == 0 )
+                gbBenchFatal( "write" );
+
+        while( pending > 0 )
+        {
+            if( gbBenchRead( &client ) == 0 )
+                gbBenchFatal( "read" );
+
+            n = gbBenchParseReplies( NULL, &client, 0 );
+            pending -= n;
+        }
+    }
+
+    close( client.fd );
+    free( client.obuf );
+    free( client.ibuf );
+}
+
+// start a new batch on an idle client, 0 when there is nothing left to send
+static int gbBenchStartBatch( gbBenchThread *thread, gbBenchClient *client, uint64_t now )
+{
+    int i;
+
+    if( thread->budget == 0 || ( thread->deadline && now >= thread->deadline ) )
+        return 0;
+
+    client->olen = client->osent = 0;
+    client->nbatch = client->next = 0;
+
+    for( i = 0; i < config.pipeline && thread->budget != 0; ++i )
+    {
+        client->batch[ client->nbatch++ ] = gbBenchAppendRandom( thread, client );
+
+        if( thread->budget > 0 )
+            --thread->budget;
+    }
+
+    client->sent = gbTimeNs();
+
+    return 1;
+}
+
+static void *gbBenchThreadMain( void *arg )
+{
+    gbBenchThread *thread = arg;
+    struct pollfd *pfds = calloc( thread->nclients, sizeof(struct pollfd) );
+    gbBenchClient *client;
+    uint64_t now;
+    int i, active;
+
+    if( pfds == NULL )
+        gbBenchFatal( "calloc" );
+
+    do
+    {
+        now    = gbTimeNs();
+        active = 0;
+
+        for( i = 0; i < thread->nclients; ++i )
+        {
+            client = &thread->clients[i];
+
+            if( client->next == client->nbatch && client->osent == client->olen )
+                gbBenchStartBatch( thread, client, now );
+
+            pfds[i].fd      = client->fd;
+            pfds[i].events  = client->osent < client->olen ? POLLOUT : 0;
+            pfds[i].events |= client->next < client->nbatch ? POLLIN : 0;
+            pfds[i].revents = 0;
+
+            if( pfds[i].events )
+                ++active;
+        }
+
+        if( active == 0 )
+            break;
+
+        if( poll( pfds, thread->nclients, 1000 ) < 0 && errno != EINTR )
+            gbBenchFatal( "poll" );
+
+        for( i = 0; i < thread->nclients; ++i )
+        {
+            client = &thread->clients[i];
+
+            if( ( pfds[i].revents & POLLOUT ) && gbBenchWrite( client ) == 0 )
+                gbBenchFatal( "write" );
+
+            if( pfds[i].revents & ( POLLIN | POLLHUP | POLLERR ) )
+            {
+                if( gbBenchRead( client ) == 0 )
+                    gbBenchFatal( "read" );
+
+                gbBenchParseReplies( thread, client, gbTimeNs() );
+            }
+        }
+    }
+    while( 1 );
+
+    free( pfds );
+
+    return NULL;
+}
+
+static int gbBenchParseDistribution( const char *value )
+{
+    if( strcmp( value, "uniform" ) == 0 )
+        return GB_BENCH_DIST_UNIFORM;
+
+    else if( strcmp( value, "zipf" ) == 0 )
+        return GB_BENCH_DIST_ZIPF;
+
+    else if( strcmp( value, "exponential" ) == 0 )
+        return GB_BENCH_DIST_EXPONENTIAL;
+
+    errno = 0;
+    gbBenchFatal( value );
+
+    return -1;
+}
+
+static void gbBenchParseRatio( const char *value )
+{
+    int i, total = 0, n;
+
+    n = sscanf( value, "%d:%d:%d:%d:%d", &config.ratio[0], &config.ratio[1], &config.ratio[2], &config.ratio[3], &config.ratio[4] );
+
+    for( i = 0; i < GB_BENCH_OPS; ++i )
+    {
+        if( i >= n )
+            config.ratio[i] = 0;
+
+        if( config.ratio[i] < 0 )
+            break;
+
+        total += config.ratio[i];
+    }
+
+    errno = 0;
+    if( n < 1 || i < GB_BENCH_OPS || total <= 0 )
+        gbBenchFatal( value );
+
+    // scale the weights to percentages, rounding errors go to the first request type in use
+    for( i = 0, n = 100; i < GB_BENCH_OPS; ++i )
+    {
+        config.ratio[i] = config.ratio[i] * 100 / total;
+        n -= config.ratio[i];
+    }
+
+    for( i = 0; i < GB_BENCH_OPS; ++i )
+    {
+        if( config.ratio[i] || i == GB_BENCH_OPS - 1 )
+        {
+            config.ratio[i] += n;
+            break;
+        }
+    }
+}
+
+static void gbBenchReport( gbBenchThread *threads, double elapsed )
+{
+    gbHistogram *total = calloc( 1, sizeof(gbHistogram) ),
+                *h = calloc( 1, sizeof(gbHistogram) );
+    uint64_t misses, errors, tot_misses = 0, tot_errors = 0;
+    int i, op;
+
+    if( total == NULL || h == NULL )
+        gbBenchFatal( "calloc" );
+
+    printf( "\n%-6s %10s %12s %9s %9s %9s %9s %9s %9s %9s\n",
+            "op", "requests", "ops/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "missed", "errors" );
+
+#define PRINT_ROW( name, h, misses, errors ) \
+    printf( "%-6s %10llu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9llu %9llu\n", name, \
+            (unsigned long long)(h)->count, (h)->count / elapsed, \
+            gbHistogramPercentile( h, 50.0 ) / 1000.0, gbHistogramPercentile( h, 90.0 ) / 1000.0, \
+            gbHistogramPercentile( h, 99.0 ) / 1000.0, gbHistogramPercentile( h, 99.9 ) / 1000.0, \
+            (h)->max / 1000.0, (unsigned long long)(misses), (unsigned long long)(errors) )
+
+    for( op = 0; op < GB_BENCH_OPS; ++op )
+    {
+        if( config.ratio[op] == 0 )
+            continue;
+
+        memset( h, 0x00, sizeof(gbHistogram) );
+        misses = errors = 0;
+
+        for( i = 0; i < config.threads; ++i )
+        {
+            gbHistogramMerge( h, &threads[i].latency[op] );
+            gbHistogramMerge( total, &threads[i].latency[op] );
+
+            misses += threads[i].misses[op];
+            errors += threads[i].errors[op];
+        }
+
+        tot_misses += misses;
+        tot_errors += errors;
+
+        PRINT_ROW( gbBenchOpNames[op], h, misses, errors );
+    }
+
+    PRINT_ROW( "total", total, tot_misses, tot_errors );
+
+#undef PRINT_ROW
+
+    free( total );
+    free( h );
+}
+
+int main( int argc, char **argv )
+{
+    gbBenchThread *threads;
+    uint64_t start, deadline = 0;
+    double elapsed;
+    size_t size;
+    int c, i, option_index = 0, nclient = 0;
+    char *sep;
+
+    config.unix_socket  = GB_DEFAULT_UNIX_SOCKET;
+    config.address      = NULL;
+    config.port         = GB_DEFAULT_PORT;
+    config.clients      = 50;
+    config.threads      = 1;
+    config.pipeline     = 1;
+    config.requests     = 100000;
+    config.duration     = 0.0;
+    config.keyspace     = 100000;
+    config.distribution = GB_BENCH_DIST_UNIFORM;
+    config.theta        = 0.99;
+    config.levels       = 1;
+    config.fanout       = 10;
+    config.value_min    =
+    config.value_max    = 32;
+    config.value_distribution = GB_BENCH_DIST_UNIFORM;
+    config.ttl          = 0;
+    config.prefill      = 0;
+    config.seed         = 1;
+
+    gbBenchParseRatio( "10:80:5:1:4" );
+
+    while( ( c = getopt_long( argc, argv, "hs:a:p:c:t:P:n:d:k:D:z:l:f:v:V:r:T:wS:", long_options, &option_index ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 's': config.unix_socket = optarg; break;
+            case 'a': config.address = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'c': config.clients = atoi(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'P': config.pipeline = atoi(optarg); break;
+            case 'n': config.requests = atol(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'k': config.keyspace = strtoull( optarg, NULL, 10 ); break;
+            case 'D': config.distribution = gbBenchParseDistribution(optarg); break;
+            case 'z': config.theta = atof(optarg); break;
+            case 'l': config.levels = atoi(optarg); break;
+            case 'f': config.fanout = strtoull( optarg, NULL, 10 ); break;
+            case 'V': config.value_distribution = gbBenchParseDistribution(optarg); break;
+            case 'r': gbBenchParseRatio(optarg); break;
+            case 'T': config.ttl = atoi(optarg); break;
+            case 'w': config.prefill = 1; break;
+            case 'S': config.seed = strtoull( optarg, NULL, 10 ); break;
+
+            case 'v':
+
+                config.value_min = config.value_max = strtoul( optarg, &sep, 10 );
+                if( *sep == ':' )
+                    config.value_max = strtoul( sep + 1, NULL, 10 );
+
+            break;
+
+            default:
+
+                gbBenchHelpMenu( argv, c == 'h' ? 0 : 1 );
+        }
+    }
+
+    errno = 0;
+    if( config.clients <= 0 || config.threads <= 0 || config.pipeline <= 0 || config.keyspace == 0 || config.fanout < 2 ||
+        config.levels <= 0 || config.levels > 64 || config.value_min > config.value_max || config.threads > config.clients ||
+        ( config.duration <= 0.0 && config.requests <= 0 ) || config.distribution == GB_BENCH_DIST_EXPONENTIAL ||
+        config.value_distribution == GB_BENCH_DIST_ZIPF || ( config.distribution == GB_BENCH_DIST_ZIPF && ( config.theta <= 0.0 || config.theta >= 1.0 ) ) )
+    {
+        gbBenchFatal( "invalid configuration" );
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+
+    if( config.distribution == GB_BENCH_DIST_ZIPF )
+        gbBenchZipfInit( config.keyspace, config.theta );
+
+    values = malloc( config.value_max + 1 );
+    if( values == NULL )
+        gbBenchFatal( "malloc" );
+
+    for( size = 0; size < config.value_max; ++size )
+        values[size] = 'a' + size % 26;
+
+    printf( "Gibson benchmark v%s\n\n", VERSION );
+    if( config.address )
+        printf( "  target   : %s:%d\n", config.address, config.port );
+    else
+        printf( "  target   : %s\n", config.unix_socket );
+    printf( "  clients  : %d on %d thread(s), pipeline %d\n", config.clients, config.threads, config.pipeline );
+    printf( "  keys     : %llu %s", (unsigned long long)config.keyspace, config.distribution == GB_BENCH_DIST_ZIPF ? "zipf" : "uniform" );
+    if( config.distribution == GB_BENCH_DIST_ZIPF )
+        printf( " ( theta %.2f )", config.theta );
+    if( config.levels > 1 )
+        printf( ", %d levels of %llu", config.levels, (unsigned long long)config.fanout );
+    printf( "\n  values   : %zu", config.value_min );
+    if( config.value_max > config.value_min )
+        printf( " - %zu %s", config.value_max, config.value_distribution == GB_BENCH_DIST_UNIFORM ? "uniform" : "exponential" );
+    printf( " bytes%s\n", config.ttl ? "" : ", no ttl" );
+    printf( "  mix      :" );
+    for( i = 0; i < GB_BENCH_OPS; ++i )
+        printf( " %s %d%%", gbBenchOpNames[i], config.ratio[i] );
+    printf( "\n  seed     : %llu\n", (unsigned long long)config.seed );
+
+    if( config.prefill )
+    {
+        start = gbTimeNs();
+
+        gbBenchPrefill();
+
+        printf( "  prefill  : %llu keys in %.2f s\n", (unsigned long long)config.keyspace, ( gbTimeNs() - start ) / 1e9 );
+    }
+
+    fflush(stdout);
+
+    threads = calloc( config.threads, sizeof(gbBenchThread) );
+    if( threads == NULL )
+        gbBenchFatal( "calloc" );
+
+    start = gbTimeNs();
+    if( config.duration > 0.0 )
+        deadline = start + (uint64_t)( config.duration * 1e9 );
+
+    for( i = 0; i < config.threads; ++i )
+    {
+        gbBenchThread *thread = &threads[i];
+        int j;
+
+        thread->id       = i;
+        thread->nclients = config.clients / config.threads + ( i < config.clients % config.threads );
+        thread->clients  = calloc( thread->nclients, sizeof(gbBenchClient) );
+        thread->rng      = ( config.seed + i + 1 ) * 0x9E3779B97F4A7C15ULL;
+        thread->deadline = deadline;
+        thread->budget   = deadline ? -1 : config.requests / config.threads + ( i < config.requests % config.threads );
+
+        if( thread->clients == NULL )
+            gbBenchFatal( "calloc" );
+
+        for( j = 0; j < thread->nclients; ++j, ++nclient )
+        {
+            gbBenchClient *client = &thread->clients[j];
+
+            client->fd    = gbBenchConnect();
+            client->batch = calloc( config.pipeline, sizeof(int) );
+
+            if( client->batch == NULL )
+                gbBenchFatal( "calloc" );
+
+            fcntl( client->fd, F_SETFL, fcntl( client->fd, F_GETFL ) | O_NONBLOCK );
+        }
+    }
+
+    for( i = 0; i < config.threads; ++i )
+    {
+        if( pthread_create( &threads[i].thread, NULL, gbBenchThreadMain, &threads[i] ) != 0 )
+            gbBenchFatal( "pthread_create" );
+    }
+
+    for( i = 0; i < config.threads; ++i )
+        pthread_join( threads[i].thread, NULL );
+
+    elapsed = ( gbTimeNs() - start ) / 1e9;
+
+    gbBenchReport( threads, elapsed );
+
+    printf( "\n%d connections, %.2f seconds\n", nclient, elapsed );
+
+    for( i = 0; i < config.threads; ++i )
+    {
+        int j;
+
+        for( j = 0; j < threads[i].nclients; ++j )
+        {
+            close( threads[i].clients[j].fd );
+            free( threads[i].clients[j].obuf );
+            free( threads[i].clients[j].ibuf );
+            free( threads[i].clients[j].batch );
+        }
+
+        free( threads[i].clients );
+    }
+
+    free( threads );
+    free( values );
+
+    return 0;
+}
@@ -44,6 +44,9 @@
 #define GBNET_DEFAULT_MAX_CLIENTS			  1024
 #define GBNET_DEFAULT_MAX_REQUEST_BUFFER_SIZE 4096 * 1024
 #define GBNET_DEFAULT_MAX_IDLE_TIME			  1
+#define GBNET_IO_CHUNK_SIZE                   ( 1024 * 16 )
+#define GBNET_ZERO_COPY_MIN_SIZE              1024
+#define GBNET_MAX_IOVEC                       256
 
 #define GB_DEFAULT_MAX_ITEM_TTL 			  2592000
 
@@ -53,12 +56,23 @@
 #define GB_DEFAULT_MAX_RESPONSE_SIZE          40960000
 
 #define GB_DEFAULT_GC_RATIO                   900
+#define GB_DEFAULT_MAX_MEMORY_POLICY          "gc"
 #define GB_DEFAULT_COMPRESSION				  40960
 
+#define GB_DEFAULT_WORKER_THREADS             1
+#define GB_MAX_WORKER_THREADS                 256
+
 #define GB_DEFAULT_CRON_PERIOD 				  100
 
 #define GB_DEFAULT_MAX_MEM_CRON               15
 #define GB_DEFAULT_EXPIRED_CRON               5
+#define GB_DEFAULT_EXPIRED_CRON_LIMIT         10000
+#define GB_DEFAULT_CRON_BUDGET                2000
+// the cron reads the clock to check its budget once every this many items
+#define GB_CRON_BUDGET_CHECK                  32
+
+#define GB_DEFAULT_HASH_INDEX                 1
+#define GB_DEFAULT_SLAB_REBALANCE             1
 
 #define GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY  512
 #define GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE    ( 1024 * 128 )
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "expire.h"
+#include "net.h"
+#include <assert.h>
+
+#define GB_EXPIRE_INITIAL_CAPACITY 1024
+
+#define PARENT( i ) ( ( (i) - 1 ) / 2 )
+#define LEFT( i )   ( 2 * (i) + 1 )
+
+static void gbExpireMove( gbExpireIndex *index, gbExpireEntry *entry, size_t i )
+{
+    index->entries[i] = *entry;
+    index->entries[i].item->expire_slot = i + 1;
+}
+
+static void gbExpireSiftUp( gbExpireIndex *index, size_t i )
+{
+    gbExpireEntry entry = index->entries[i];
+
+    while( i > 0 && index->entries[ PARENT(i) ].when > entry.when )
+    {
+        gbExpireMove( index, &index->entries[ PARENT(i) ], i );
+
+        i = PARENT(i);
+    }
+
+    gbExpireMove( index, &entry, i );
+}
+
+static void gbExpireSiftDown( gbExpireIndex *index, size_t i )
+{
+    gbExpireEntry entry = index->entries[i];
+    size_t child;
+
+    while( ( child = LEFT(i) ) < index->size )
+    {
+        // pick the earliest of the two children
+        if( child + 1 < index->size && index->entries[ child + 1 ].when < index->entries[child].when )
+            ++child;
+
+        if( index->entries[child].when >= entry.when )
+            break;
+
+        gbExpireMove( index, &index->entries[child], i );
+
+        i = child;
+    }
+
+    gbExpireMove( index, &entry, i );
+}
+
+void gbExpireInit( gbExpireIndex *index )
+{
+    assert( index != NULL );
+
+    index->entries  = NULL;
+    index->size     = 0;
+    index->capacity = 0;
+}
+
+void gbExpireSet( gbExpireIndex *index, gbItem *item, unsigned char *key, size_t klen, time_t when )
+{
+    assert( index != NULL );
+    assert( item != NULL );
+    assert( key != NULL );
+    assert( klen > 0 );
+
+    size_t i;
+
+    // already indexed, just move it to its new position
+    if( item->expire_slot )
+    {
+        i = item->expire_slot - 1;
+
+        index->entries[i].when = when;
+
+        gbExpireSiftUp( index, i );
+        gbExpireSiftDown( index, item->expire_slot - 1 );
+
+        return;
+    }
+
+    if( index->size == index->capacity )
+    {
+        index->capacity = index->capacity ? index->capacity * 2 : GB_EXPIRE_INITIAL_CAPACITY;
+        index->entries  = zrealloc( index->entries, index->capacity * sizeof(gbExpireEntry) );
+
+        assert( index->entries != NULL );
+    }
+
+    i = index->size++;
+
+    index->entries[i].when = when;
+    index->entries[i].item = item;
+    index->entries[i].key  = zmemdup( key, klen );
+    index->entries[i].klen = klen;
+
+    gbExpireSiftUp( index, i );
+}
+
+void gbExpireRemove( gbExpireIndex *index, gbItem *item )
+{
+    assert( index != NULL );
+    assert( item != NULL );
+
+    size_t i = item->expire_slot - 1;
+
+    if( item->expire_slot == 0 )
+        return;
+
+    assert( i < index->size );
+    assert( index->entries[i].item == item );
+
+    zfree( index->entries[i].key );
+
+    item->expire_slot = 0;
+
+    // fill the hole with the last entry and restore the heap order
+    if( i != --index->size )
+    {
+        gbItem *moved = index->entries[ index->size ].item;
+
+        gbExpireMove( index, &index->entries[ index->size ], i );
+
+        gbExpireSiftUp( index, i );
+        gbExpireSiftDown( index, moved->expire_slot - 1 );
+    }
+}
+
+gbExpireEntry *gbExpireTop( gbExpireIndex *index )
+{
+    assert( index != NULL );
+
+    return index->size ? &index->entries[0] : NULL;
+}
+
+void gbExpireDestroy( gbExpireIndex *index )
+{
+    assert( index != NULL );
+
+    size_t i;
+
+    // items are owned by the tree, only the keys belong to the index
+    for( i = 0; i < index->size; ++i )
+    {
+        zfree( index->entries[i].key );
+    }
+
+    if( index->entries )
+        zfree( index->entries );
+
+    gbExpireInit( index );
+}
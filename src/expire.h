@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __EXPIRE_H__
+#define __EXPIRE_H__
+
+#include <time.h>
+#include "zmem.h"
+
+struct gbItem;
+
+typedef struct
+{
+    // time the item is going to expire
+    time_t          when;
+    // the item itself
+    struct gbItem  *item;
+    // copy of the item key, needed to remove it from the tree
+    unsigned char  *key;
+    // size of the key
+    size_t          klen;
+}
+gbExpireEntry;
+
+/*
+ * Binary min-heap of the items with a TTL, ordered by expiration time, so
+ * the cron only needs to look at the items that are actually expired.
+ * Every indexed item stores its heap position + 1 in 'expire_slot'.
+ */
+typedef struct
+{
+    gbExpireEntry *entries;
+    // number of entries in the heap
+    size_t         size;
+    // number of allocated entries
+    size_t         capacity;
+}
+gbExpireIndex;
+
+void           gbExpireInit( gbExpireIndex *index );
+void           gbExpireSet( gbExpireIndex *index, struct gbItem *item, unsigned char *key, size_t klen, time_t when );
+void           gbExpireRemove( gbExpireIndex *index, struct gbItem *item );
+gbExpireEntry *gbExpireTop( gbExpireIndex *index );
+void           gbExpireDestroy( gbExpireIndex *index );
+
+#endif
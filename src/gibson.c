@@ -55,6 +55,12 @@ static struct option long_options[] =
     { "gc_ratio", required_argument, 0, 0x00 },
     { "max_mem_cron", required_argument, 0, 0x00 },
     { "expired_cron", required_argument, 0, 0x00 },
+    { "expired_cron_limit", required_argument, 0, 0x00 },
+    { "max_memory_policy", required_argument, 0, 0x00 },
+    { "worker_threads", required_argument, 0, 0x00 },
+    { "cron_budget", required_argument, 0, 0x00 },
+    { "hash_index", required_argument, 0, 0x00 },
+    { "slab_rebalance", required_argument, 0, 0x00 },
 
     {0, 0, 0, 0}
 };
@@ -82,7 +88,13 @@ static char *descriptions[] = {
     "File to be used to save the current Gibson process id.",
     "If max_memory is reached, data that is not being accessed in this amount of time ( i.e. gc_ratio 1h = data that is not being accessed in the last hour ) get deleted to release memory for the server.",
     "Check if max memory usage is reached every 'max_mem_cron' seconds.",
-    "Check for expired items every 'expired_cron' seconds."
+    "Check for expired items every 'expired_cron' seconds.",
+    "Maximum number of expired items to free for each cron cycle, the remaining ones are freed during the next cycles.",
+    "What to do when max_memory is reached, 'gc' to free data not accessed in the last gc_ratio seconds, 'lru' to evict the least recently used data when new data is stored.",
+    "Number of event loop threads, each one with its own listener and a shard of the keyspace.",
+    "Microseconds each cron cycle can spend freeing expired items and memory, the work left goes on with the next cycles, 0 means no limit.",
+    "If 1 every key is indexed by a hash table too, so that single key operators don't walk the tree, 0 to save its memory.",
+    "If 1 the value allocator moves empty pages between size classes and gives them back to the system, 0 to keep them in their class."
 };
 
 // the global server instance
@@ -167,6 +179,18 @@ int main( int argc, char **argv)
 	  gbConfigReadInt( &server.config, "logflushrate", GB_DEFAULT_LOG_FLUSH_LEVEL )
 	);
 
+	server.nworkers  = gbConfigReadInt( &server.config, "worker_threads", GB_DEFAULT_WORKER_THREADS );
+	server.worker_id = 0;
+
+	if( server.nworkers < 1 || server.nworkers > GB_MAX_WORKER_THREADS ){
+		gbLog( WARNING, "Invalid worker_threads value %d, using %d.", server.nworkers, GB_DEFAULT_WORKER_THREADS );
+
+		server.nworkers = GB_DEFAULT_WORKER_THREADS;
+	}
+
+	server.workers    = zcalloc( server.nworkers * sizeof(gbServer *) );
+	server.workers[0] = &server;
+
 	const char *sock = gbConfigReadString( &server.config, "unix_socket", NULL );
 	if( sock != NULL ){
 		gbLog( INFO, "Creating unix server socket on %s ...", sock );
@@ -187,7 +211,11 @@ int main( int argc, char **argv)
 
 		server.type	= TCP;
 		server.port	= port;
-		server.fd   = gbNetTcpServer( server.error, server.port, server.address );
+		// every worker listens on its own socket bound to the same port
+		if( server.nworkers > 1 )
+			server.fd = gbNetTcpReusePortServer( server.error, server.port, server.address );
+		else
+			server.fd = gbNetTcpServer( server.error, server.port, server.address );
 	}
 
 	if( server.fd == GBNET_ERR ){
@@ -214,8 +242,13 @@ int main( int argc, char **argv)
 	server.stats.nclients    =
 	server.stats.nitems	     =
 	server.stats.ncompressed =
+	server.stats.ninlined    =
+	server.stats.inline_saved =
+	server.stats.nshared     =
+	server.stats.shared_saved =
     server.stats.requests    =
     server.stats.connections =
+    server.stats.nevicted    =
 	server.stats.sizeavg	 =
     server.stats.compravg    = 0;
     server.stats.mempeak     =
@@ -239,17 +272,48 @@ int main( int argc, char **argv)
     server.gc_ratio    = gbConfigReadTime( &server.config, "gc_ratio",       GB_DEFAULT_GC_RATIO );
     server.max_mem_cron = gbConfigReadTime( &server.config, "max_mem_cron",  GB_DEFAULT_MAX_MEM_CRON ) * 1000;
     server.expired_cron = gbConfigReadTime( &server.config, "expired_cron",  GB_DEFAULT_EXPIRED_CRON ) * 1000;
+    server.expired_cron_limit = gbConfigReadInt( &server.config, "expired_cron_limit", GB_DEFAULT_EXPIRED_CRON_LIMIT );
+    server.expired_pending = 0;
+
+    const char *policy = gbConfigReadString( &server.config, "max_memory_policy", GB_DEFAULT_MAX_MEMORY_POLICY );
+    if( strcmp( policy, "lru" ) == 0 )
+        server.evict_policy = GB_EVICT_LRU;
+
+    else
+    {
+        if( strcmp( policy, "gc" ) != 0 )
+            gbLog( WARNING, "Unknown max_memory_policy '%s', using 'gc'.", policy );
+
+        server.evict_policy = GB_EVICT_GC;
+    }
+
+    server.cron_budget  = gbConfigReadInt( &server.config, "cron_budget", GB_DEFAULT_CRON_BUDGET );
+    server.hash_index   = gbConfigReadInt( &server.config, "hash_index", GB_DEFAULT_HASH_INDEX );
+    server.slab_rebalance = gbConfigReadInt( &server.config, "slab_rebalance", GB_DEFAULT_SLAB_REBALANCE );
+    server.gc_pending   = 0;
+    server.lru_lap      = 0;
+
+    tr_iter_init( &server.lru_hand, server.limits.maxkeysize );
+    tr_iter_init( &server.gc_hand, server.limits.maxkeysize );
 	server.clients 	   = ll_prealloc( server.limits.maxclients );
 	server.m_keys	   = ll_prealloc( 255 );
 	server.m_values	   = ll_prealloc( 255 );
 	server.idlecron	   = server.limits.maxidletime * 1000;
 	server.lzf_buffer  = zcalloc( server.limits.maxrequestsize );
-	server.m_buffer	   = zcalloc( server.limits.maxresponsesize );
+	server.latency	   = zcalloc( sizeof(gbHistogram) * ( OP_LAST + 1 ) );
+	server.handling	   = zcalloc( sizeof(gbHistogram) * ( OP_LAST + 1 ) );
 	server.shutdown	   = 0;
 
     opool_create( &server.item_pool, sizeof(gbItem), GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+    slab_init( &server.slab, server.slab_rebalance );
+    ht_init( &server.orphans );
 
 	tr_init_tree( server.tree );
+	tr_set_weight( &server.tree, gbItemWeight );
+	tr_set_index( &server.tree, server.hash_index );
+	tr_set_leaf( &server.tree, GB_ITEM_SLOT_SIZE );
+
+	gbExpireInit( &server.expire );
 
 	char reqsize[0xFF] = {0},
 		 maxmem[0xFF] = {0},
@@ -279,12 +343,14 @@ int main( int argc, char **argv)
 	gbLog( INFO, "Max request size : %s", reqsize );
 	gbLog( INFO, "Max memory       : %s", maxmem );
     gbLog( INFO, "System memory    : %s", sysmem );
+    gbLog( INFO, "Memory policy    : %s", server.evict_policy == GB_EVICT_LRU ? "lru" : "gc" );
     gbLog( INFO, "GC Ratio         : %ds", server.gc_ratio );
 	gbLog( INFO, "Max key size     : %s", maxkey );
 	gbLog( INFO, "Max value size   : %s", maxvalue );
 	gbLog( INFO, "Max resp. size   : %s", maxrespsize );
 	gbLog( INFO, "Data LZF compr.  : %s", compr );
 	gbLog( INFO, "Cron period      : %dms", server.cronperiod );
+	gbLog( INFO, "Worker threads   : %d", server.nworkers );
 
 	gbProcessInit();
 
@@ -297,6 +363,8 @@ int main( int argc, char **argv)
 
 	gbCreateFileEvent( server.events, server.fd, GB_READABLE, gbAcceptHandler, &server );
 
+	gbServerStartWorkers( &server );
+
 	gbEventLoopMain( server.events );
 	gbDeleteEventLoop( server.events );
 
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "histogram.h"
+#include <assert.h>
+#include <time.h>
+
+uint64_t gbTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int gbHistogramIndex( uint64_t value )
+{
+    unsigned int msb, shift;
+
+    if( value < GB_HIST_SUB_BUCKETS )
+        return value;
+
+    if( value >> GB_HIST_MAX_BITS )
+        return GB_HIST_BUCKETS - 1;
+
+    msb   = 63 - __builtin_clzll( value );
+    shift = msb - GB_HIST_SUB_BITS;
+
+    return ( shift + 1 ) * GB_HIST_SUB_BUCKETS + ( ( value >> shift ) & ( GB_HIST_SUB_BUCKETS - 1 ) );
+}
+
+// highest value falling into the bucket
+static uint64_t gbHistogramBucketValue( unsigned int index )
+{
+    unsigned int shift;
+
+    if( index < GB_HIST_SUB_BUCKETS )
+        return index;
+
+    shift = index / GB_HIST_SUB_BUCKETS - 1;
+
+    return ( ( (uint64_t)( GB_HIST_SUB_BUCKETS + index % GB_HIST_SUB_BUCKETS ) + 1 ) << shift ) - 1;
+}
+
+void gbHistogramRecord( gbHistogram *h, uint64_t value )
+{
+    assert( h != NULL );
+
+    uint64_t max = __atomic_load_n( &h->max, __ATOMIC_RELAXED );
+
+    __atomic_fetch_add( &h->buckets[ gbHistogramIndex( value ) ], 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &h->count, 1, __ATOMIC_RELAXED );
+
+    while( value > max && !__atomic_compare_exchange_n( &h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
+
+void gbHistogramReset( gbHistogram *h )
+{
+    assert( h != NULL );
+
+    unsigned int i;
+
+    __atomic_store_n( &h->count, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &h->max, 0, __ATOMIC_RELAXED );
+
+    for( i = 0; i < GB_HIST_BUCKETS; ++i )
+    {
+        __atomic_store_n( &h->buckets[i], 0, __ATOMIC_RELAXED );
+    }
+}
+
+void gbHistogramMerge( gbHistogram *dst, gbHistogram *src )
+{
+    assert( dst != NULL );
+    assert( src != NULL );
+
+    uint64_t max = __atomic_load_n( &src->max, __ATOMIC_RELAXED );
+    unsigned int i;
+
+    // count is rebuilt from the buckets, so that it always matches them
+    // even if values are being recorded meanwhile
+    for( i = 0; i < GB_HIST_BUCKETS; ++i )
+    {
+        uint64_t n = __atomic_load_n( &src->buckets[i], __ATOMIC_RELAXED );
+
+        dst->buckets[i] += n;
+        dst->count      += n;
+    }
+
+    if( max > dst->max )
+        dst->max = max;
+}
+
+uint64_t gbHistogramPercentile( gbHistogram *h, double percentile )
+{
+    assert( h != NULL );
+
+    uint64_t rank, seen = 0, value;
+    unsigned int i;
+
+    if( h->count == 0 )
+        return 0;
+
+    rank = (uint64_t)( percentile / 100.0 * h->count + 0.5 );
+    if( rank < 1 )
+        rank = 1;
+
+    for( i = 0; i < GB_HIST_BUCKETS; ++i )
+    {
+        seen += h->buckets[i];
+        if( seen >= rank )
+            break;
+    }
+
+    value = gbHistogramBucketValue( i < GB_HIST_BUCKETS ? i : GB_HIST_BUCKETS - 1 );
+
+    return h->max && value > h->max ? h->max : value;
+}
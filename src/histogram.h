@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+// every power of two range is split into this many linear buckets, which
+// keeps the relative error of any recorded value under 1 / 2^GB_HIST_SUB_BITS
+#define GB_HIST_SUB_BITS    4
+#define GB_HIST_SUB_BUCKETS ( 1 << GB_HIST_SUB_BITS )
+// values are clamped to 2^GB_HIST_MAX_BITS - 1 ( ~18 minutes in nanoseconds )
+#define GB_HIST_MAX_BITS    40
+#define GB_HIST_BUCKETS     ( ( GB_HIST_MAX_BITS - GB_HIST_SUB_BITS + 1 ) * GB_HIST_SUB_BUCKETS )
+
+/*
+ * Log-linear ( HDR style ) histogram of nanosecond durations. Recording,
+ * reading and resetting only use relaxed atomic operations, so a worker can
+ * record into its own histograms while any other thread reads or resets them
+ * without locks.
+ */
+typedef struct
+{
+    // number of recorded values
+    uint64_t count;
+    // biggest recorded value
+    uint64_t max;
+    uint64_t buckets[GB_HIST_BUCKETS];
+}
+gbHistogram;
+
+uint64_t gbTimeNs(void);
+
+void     gbHistogramRecord( gbHistogram *h, uint64_t value );
+void     gbHistogramReset( gbHistogram *h );
+// add a snapshot of 'src' to 'dst', which is not shared with other threads
+void     gbHistogramMerge( gbHistogram *dst, gbHistogram *src );
+// value below which 'percentile' percent of the recorded values fall
+uint64_t gbHistogramPercentile( gbHistogram *h, double percentile );
+
+#endif
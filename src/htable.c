@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "htable.h"
+#include <string.h>
+#include <assert.h>
+
+// Number of slots of a new table.
+#define HT_INITIAL_SIZE 64
+// Slots of the old table moved by every write while growing.
+#define HT_REHASH_STEP  8
+
+// The table grows once 3/4 of its slots are used.
+#define ht_max_load( t ) ( ( (t)->mask + 1 ) / 4 * 3 )
+
+/*
+ * Word at a time multiplicative hash, keys are hashed on every lookup
+ * so it has to be way cheaper than a byte at a time one.
+ */
+static uint32_t ht_hash( unsigned char *key, uint32_t len )
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ len, w = 0;
+
+    for( ; len >= 8; key += 8, len -= 8 )
+    {
+        memcpy( &w, key, 8 );
+
+        h = ( h ^ w ) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+
+    if( len )
+    {
+        w = 0;
+        memcpy( &w, key, len );
+
+        h = ( h ^ w ) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
+static void ht_alloc_table( htable_t *ht, ht_table_t *t, size_t size )
+{
+    t->slots = zcalloc( size * sizeof(ht_slot_t) );
+    t->mask  = size - 1;
+    t->used  = 0;
+
+    assert( t->slots != NULL );
+
+    ht->mem += size * sizeof(ht_slot_t);
+}
+
+static void ht_free_table( htable_t *ht, ht_table_t *t )
+{
+    if( t->slots )
+    {
+        zfree( t->slots );
+
+        ht->mem -= ( t->mask + 1 ) * sizeof(ht_slot_t);
+    }
+
+    t->slots = NULL;
+    t->mask  = 0;
+    t->used  = 0;
+}
+
+// Return the slot of the key probing from the 'from' position, or NULL.
+static ht_slot_t *ht_lookup( ht_table_t *t, size_t from, unsigned char *key, uint32_t len, uint32_t hash )
+{
+    ht_slot_t *slot = NULL;
+    size_t i;
+
+    for( i = from; ( slot = &t->slots[i] )->key; i = ( i + 1 ) & t->mask )
+    {
+        if( slot->hash == hash && slot->len == len && memcmp( slot->key, key, len ) == 0 )
+            return slot;
+    }
+
+    return NULL;
+}
+
+// Return the first free slot for the hash and mark it as used.
+static ht_slot_t *ht_place( ht_table_t *t, uint32_t hash )
+{
+    size_t i;
+
+    for( i = hash & t->mask; t->slots[i].key; i = ( i + 1 ) & t->mask );
+
+    ++t->used;
+
+    return &t->slots[i];
+}
+
+/*
+ * Free the slot and shift back the following entries of its cluster that
+ * are allowed to take its place, so that no lookup ever stops too early.
+ */
+static void ht_delete( ht_table_t *t, ht_slot_t *slot )
+{
+    size_t hole = slot - t->slots, i, home;
+
+    for( i = ( hole + 1 ) & t->mask; t->slots[i].key; i = ( i + 1 ) & t->mask )
+    {
+        home = t->slots[i].hash & t->mask;
+
+        // the entry can move to the hole if its home doesn't come after it
+        if( ( ( i - home ) & t->mask ) >= ( ( i - hole ) & t->mask ) )
+        {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+
+    t->slots[hole].key = NULL;
+
+    --t->used;
+}
+
+/*
+ * Find the key inside the old table. Its slots before 'rehash' were moved a
+ * whole cluster at a time, the one wrapping past its end included, so the
+ * clusters left never cross them and are probed like in any other table.
+ */
+static ht_slot_t *ht_lookup_old( htable_t *ht, unsigned char *key, uint32_t len, uint32_t hash )
+{
+    if( ht->old.slots == NULL || ht->old.used == 0 )
+        return NULL;
+
+    return ht_lookup( &ht->old, hash & ht->old.mask, key, len, hash );
+}
+
+/*
+ * Move at least 'steps' slots of the old table to the new one, going on
+ * until the end of the cluster they stopped into.
+ */
+static void ht_rehash( htable_t *ht, size_t steps )
+{
+    ht_slot_t *slot = NULL;
+
+    while( ht->old.slots )
+    {
+        if( ht->old.used == 0 )
+        {
+            ht_free_table( ht, &ht->old );
+            ht->rehash = 0;
+            break;
+        }
+
+        slot = &ht->old.slots[ ht->rehash ];
+
+        if( steps )
+            --steps;
+        // stopping inside a cluster would cut the probes of its later keys
+        else if( slot->key == NULL )
+            break;
+
+        ++ht->rehash;
+
+        if( slot->key )
+        {
+            *ht_place( &ht->table, slot->hash ) = *slot;
+
+            slot->key = NULL;
+            --ht->old.used;
+        }
+    }
+}
+
+static void ht_grow( htable_t *ht )
+{
+    // a previous growth is still in progress, just finish it
+    if( ht->old.slots )
+        ht_rehash( ht, ht->old.mask + 2 );
+
+    ht->old    = ht->table;
+    ht->rehash = 0;
+
+    ht_alloc_table( ht, &ht->table, ( ht->old.mask + 1 ) * 2 );
+}
+
+// Store a key which is not in any of the tables.
+static void ht_insert( htable_t *ht, unsigned char *key, uint32_t len, uint32_t hash, void *value )
+{
+    ht_slot_t *slot = NULL;
+
+    if( ht->table.used + 1 > ht_max_load( &ht->table ) )
+        ht_grow( ht );
+
+    slot = ht_place( &ht->table, hash );
+
+    slot->key   = zmemdup( key, len );
+    slot->len   = len;
+    slot->hash  = hash;
+    slot->value = value;
+
+    ht->mem += len;
+}
+
+void ht_init( htable_t *ht )
+{
+    assert( ht != NULL );
+
+    memset( ht, 0x00, sizeof(htable_t) );
+}
+
+void *ht_find( htable_t *ht, unsigned char *key, uint32_t len )
+{
+    assert( ht != NULL );
+    assert( key != NULL );
+
+    uint32_t hash = ht_hash( key, len );
+    ht_slot_t *slot = NULL;
+
+    if( ht->table.slots == NULL )
+        return NULL;
+
+    if( ( slot = ht_lookup( &ht->table, hash & ht->table.mask, key, len, hash ) ) == NULL )
+        slot = ht_lookup_old( ht, key, len, hash );
+
+    return slot ? slot->value : NULL;
+}
+
+void *ht_set( htable_t *ht, unsigned char *key, uint32_t len, void *value )
+{
+    assert( ht != NULL );
+    assert( key != NULL );
+    assert( value != NULL );
+
+    uint32_t hash = ht_hash( key, len );
+    ht_slot_t *slot = NULL, moved;
+    void *old = NULL;
+
+    if( ht->table.slots == NULL )
+        ht_alloc_table( ht, &ht->table, HT_INITIAL_SIZE );
+
+    ht_rehash( ht, HT_REHASH_STEP );
+
+    if( ( slot = ht_lookup( &ht->table, hash & ht->table.mask, key, len, hash ) ) != NULL )
+    {
+        old = slot->value;
+        slot->value = value;
+
+        return old;
+    }
+    // not moved yet, move it right now along with its key copy
+    else if( ( slot = ht_lookup_old( ht, key, len, hash ) ) != NULL )
+    {
+        moved = *slot;
+        old   = moved.value;
+
+        ht_delete( &ht->old, slot );
+
+        moved.value = value;
+        *ht_place( &ht->table, hash ) = moved;
+
+        return old;
+    }
+
+    ht_insert( ht, key, len, hash, value );
+
+    return NULL;
+}
+
+void ht_add( htable_t *ht, unsigned char *key, uint32_t len, void *value )
+{
+    assert( ht != NULL );
+    assert( key != NULL );
+    assert( value != NULL );
+    assert( ht_find( ht, key, len ) == NULL );
+
+    if( ht->table.slots == NULL )
+        ht_alloc_table( ht, &ht->table, HT_INITIAL_SIZE );
+
+    ht_rehash( ht, HT_REHASH_STEP );
+
+    ht_insert( ht, key, len, ht_hash( key, len ), value );
+}
+
+void *ht_remove( htable_t *ht, unsigned char *key, uint32_t len )
+{
+    assert( ht != NULL );
+    assert( key != NULL );
+
+    uint32_t hash = ht_hash( key, len );
+    ht_slot_t *slot = NULL;
+    ht_table_t *t = &ht->table;
+    void *value = NULL;
+
+    if( ht->table.slots == NULL )
+        return NULL;
+
+    ht_rehash( ht, HT_REHASH_STEP );
+
+    if( ( slot = ht_lookup( t, hash & t->mask, key, len, hash ) ) == NULL )
+    {
+        t = &ht->old;
+
+        if( ( slot = ht_lookup_old( ht, key, len, hash ) ) == NULL )
+            return NULL;
+    }
+
+    value = slot->value;
+
+    zfree( slot->key );
+    ht->mem -= len;
+
+    ht_delete( t, slot );
+
+    return value;
+}
+
+size_t ht_size( htable_t *ht )
+{
+    assert( ht != NULL );
+
+    return ht->table.used + ht->old.used;
+}
+
+void ht_free( htable_t *ht )
+{
+    assert( ht != NULL );
+
+    ht_table_t *tables[2] = { &ht->table, &ht->old };
+    size_t i, t;
+
+    for( t = 0; t < 2; ++t )
+    {
+        for( i = 0; tables[t]->slots && i <= tables[t]->mask; ++i )
+        {
+            if( tables[t]->slots[i].key )
+                zfree( tables[t]->slots[i].key );
+        }
+
+        ht_free_table( ht, tables[t] );
+    }
+
+    ht_init( ht );
+}
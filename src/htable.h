@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __HTABLE_H__
+#define __HTABLE_H__
+
+#include "zmem.h"
+#include <stdint.h>
+
+typedef struct
+{
+    // copy of the key, NULL if the slot is free
+    unsigned char *key;
+    // size of the key
+    uint32_t       len;
+    // hash of the key
+    uint32_t       hash;
+    // object the key maps to
+    void          *value;
+}
+ht_slot_t;
+
+typedef struct
+{
+    ht_slot_t *slots;
+    // number of slots - 1, the number of slots is a power of two
+    size_t     mask;
+    // number of used slots
+    size_t     used;
+}
+ht_table_t;
+
+/*
+ * Open addressing hash table with linear probing and backward shift
+ * deletion, so there are no tombstones. When it grows, entries are
+ * moved to the new table a few slots at a time by every write instead
+ * of all at once, until then lookups look into both tables.
+ */
+typedef struct
+{
+    // table new keys are inserted into
+    ht_table_t table;
+    // table being emptied into 'table', no slots if not growing
+    ht_table_t old;
+    // slots of 'old' before this one were already moved
+    size_t     rehash;
+    // memory used by slots and keys in bytes
+    size_t     mem;
+}
+htable_t;
+
+void   ht_init( htable_t *ht );
+void  *ht_find( htable_t *ht, unsigned char *key, uint32_t len );
+// Map the key to the value, return the previous value or NULL.
+void  *ht_set( htable_t *ht, unsigned char *key, uint32_t len, void *value );
+// Same as ht_set for a key which is known not to be in the table.
+void   ht_add( htable_t *ht, unsigned char *key, uint32_t len, void *value );
+// Remove the key, return its value or NULL if it was not found.
+void  *ht_remove( htable_t *ht, unsigned char *key, uint32_t len );
+size_t ht_size( htable_t *ht );
+void   ht_free( htable_t *ht );
+
+#endif
@@ -68,6 +68,12 @@ llist_t;
  */
 #define ll_foreach_2( la, lb, aitem, bitem ) ll_item_t *aitem = NULL, *bitem = NULL; \
 		for( aitem = (la)->head, bitem = (lb)->head; aitem && bitem && aitem->data && bitem->data; aitem = aitem->next, bitem = bitem->next )
+/*
+ * Same as ll_foreach_2 but it only stops at the end of the first list,
+ * so the items of the second one are allowed to be NULL.
+ */
+#define ll_foreach_2_sparse( la, lb, aitem, bitem ) ll_item_t *aitem = NULL, *bitem = NULL; \
+		for( aitem = (la)->head, bitem = (lb)->head; aitem && bitem && aitem->data; aitem = aitem->next, bitem = bitem->next )
 /*
  * Macro to easily loop the list until a certain item.
  * NOTE: This macro has to be used only for read only loops,
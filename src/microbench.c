@@ -0,0 +1,1094 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "configure.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <getopt.h>
+
+#include "net.h"
+#include "trie.h"
+#include "lzf.h"
+
+// the fixed seed makes every run work on the same corpora
+#define GB_MICRO_SEED     0x5EED5EEDULL
+#define GB_MICRO_MAX_KEY  0xFF
+// number of prefix scans per repetition
+#define GB_MICRO_SCANS    1000
+// results of the limited scans, like a M* query with a LIMIT
+#define GB_MICRO_SEARCH_LIMIT 10
+#define GB_MICRO_MAX_REPEAT 64
+// elements of every list, about what a M* reply collects
+#define GB_MICRO_LIST_SIZE  1024
+
+typedef struct
+{
+    const char     *name;
+    unsigned char **keys;
+    int            *lens;
+    // the same keys in another order, so lookups do not follow insertion order
+    unsigned char **shuffled;
+    int            *shuffled_lens;
+    // keys that are not stored, sharing most of their bytes with stored ones
+    unsigned char **missing;
+    int            *missing_lens;
+    // prefixes of stored keys at a separator, as used by M* operators
+    unsigned char **prefixes;
+    int            *prefix_lens;
+    size_t          n;
+}
+gbMicroCorpus;
+
+typedef struct
+{
+    uint64_t samples[GB_MICRO_MAX_REPEAT];
+    int      nsamples;
+}
+gbMicroTimer;
+
+static size_t   nkeys  = 200000;
+static int      repeat = 5;
+static FILE    *output = NULL;
+static int      nresults = 0;
+static uint64_t rng = GB_MICRO_SEED;
+
+static struct option long_options[] =
+{
+    { "help",   no_argument,       0, 'h' },
+    { "keys",   required_argument, 0, 'n' },
+    { "repeat", required_argument, 0, 'r' },
+    { "output", required_argument, 0, 'o' },
+
+    {0, 0, 0, 0}
+};
+
+static char *descriptions[] = {
+    "Print this help menu and exit.",
+    "Number of keys of every corpus.",
+    "Number of repetitions of every benchmark, the fastest one is reported as ns_per_op.",
+    "Write the JSON results to this file instead of the standard output."
+};
+
+static void gbMicroHelpMenu( char **argv, int exitcode )
+{
+    size_t i = 0;
+    struct option *popt = &long_options[0];
+    char s[0xFF];
+
+    printf( "Gibson microbenchmarks v%s ( built %s )\n", VERSION, BUILD_DATETIME );
+    printf( "Released under %s\n\n", LICENSE );
+
+    printf( "Usage: %s [options]\n", argv[0] );
+    printf( "Options:\n" );
+
+    while( popt && popt->name )
+    {
+        memset( s, 0x00, 0xFF );
+
+        sprintf( s, "  -%c, --%s", popt->val, popt->name );
+
+        if( popt->has_arg == required_argument )
+            strcat( s, " VALUE" );
+
+        printf( "%-35s %s\n", s, descriptions[i] );
+
+        ++popt;
+        ++i;
+    }
+
+    printf("\n");
+
+    exit(exitcode);
+}
+
+static uint64_t gbMicroRandom(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+
+    return rng * 0x2545F4914F6CDD1DULL;
+}
+
+static void gbMicroStart( gbMicroTimer *timer, uint64_t *start )
+{
+    assert( timer->nsamples < GB_MICRO_MAX_REPEAT );
+
+    *start = gbTimeNs();
+}
+
+static void gbMicroStop( gbMicroTimer *timer, uint64_t start )
+{
+    timer->samples[ timer->nsamples++ ] = gbTimeNs() - start;
+}
+
+static int gbMicroCompareSamples( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *)a,
+             y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Emit one JSON result, 'extra' is either NULL or a string of additional
+ * "key": value members. The best repetition is what the benchmark can do,
+ * the median tells how noisy the machine was.
+ */
+static void gbMicroReport( const char *benchmark, const char *corpus, size_t ops, gbMicroTimer *timer, const char *extra )
+{
+    double best, median;
+
+    qsort( timer->samples, timer->nsamples, sizeof(uint64_t), gbMicroCompareSamples );
+
+    best   = (double)timer->samples[0] / ops;
+    median = (double)timer->samples[ timer->nsamples / 2 ] / ops;
+
+    fprintf( output, "%s\n    { \"benchmark\": \"%s\", \"corpus\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.2f, \"ns_per_op_median\": %.2f, \"ops_per_sec\": %.0f%s%s }",
+             nresults++ ? "," : "", benchmark, corpus, ops, best, median, 1e9 / best, extra ? ", " : "", extra ? extra : "" );
+
+    fprintf( stderr, "%-24s %-16s %10.1f ns/op %14.0f ops/s\n", benchmark, corpus, best, 1e9 / best );
+
+    timer->nsamples = 0;
+}
+
+static void gbMicroAddKey( unsigned char **keys, int *lens, size_t i, const char *key, int len )
+{
+    keys[i] = (unsigned char *)zmemdup( (void *)key, len + 1 );
+    lens[i] = len;
+}
+
+/*
+ * Key shapes seen in production: URL paths with a few hierarchical levels,
+ * colon namespaced identifiers and random hex digests, which share no
+ * meaningful prefix at all.
+ */
+static int gbMicroFormatKey( const char *corpus, char *key, uint64_t r )
+{
+    static const char *sections[] = { "news", "sport", "tech", "blog", "shop", "photos", "video", "users" };
+    unsigned int a = r % 100000, b = ( r >> 20 ) % 1000, c = ( r >> 40 ) % 8;
+
+    if( strcmp( corpus, "urls" ) == 0 )
+    {
+        switch( r % 3 )
+        {
+            case 0:  return snprintf( key, GB_MICRO_MAX_KEY, "/users/%u/photos/%u/comments", a % 50000, b );
+            case 1:  return snprintf( key, GB_MICRO_MAX_KEY, "/%s/2013/%02u/article-%u.html", sections[c], b % 12 + 1, a );
+            default: return snprintf( key, GB_MICRO_MAX_KEY, "/api/v1/%s/%u?page=%u", sections[c], a, b % 20 );
+        }
+    }
+    else if( strcmp( corpus, "namespaced" ) == 0 )
+    {
+        switch( r % 3 )
+        {
+            case 0:  return snprintf( key, GB_MICRO_MAX_KEY, "app:%s:item:%u:hits", sections[c], a );
+            case 1:  return snprintf( key, GB_MICRO_MAX_KEY, "user:%u:session:%u", a, b );
+            default: return snprintf( key, GB_MICRO_MAX_KEY, "cache:query:%s:%u:%u", sections[c], b, a );
+        }
+    }
+
+    return snprintf( key, GB_MICRO_MAX_KEY, "%016llx%08x", (unsigned long long)r, (unsigned int)( r >> 17 ) );
+}
+
+static void gbMicroCreateCorpus( gbMicroCorpus *corpus, const char *name, size_t n )
+{
+    trie_t unique;
+    char key[GB_MICRO_MAX_KEY];
+    size_t i, j, tries = 0;
+    int len;
+
+    memset( corpus, 0x00, sizeof(gbMicroCorpus) );
+
+    corpus->name          = name;
+    corpus->n             = n;
+    corpus->keys          = zmalloc( sizeof(unsigned char *) * n );
+    corpus->lens          = zmalloc( sizeof(int) * n );
+    corpus->shuffled      = zmalloc( sizeof(unsigned char *) * n );
+    corpus->shuffled_lens = zmalloc( sizeof(int) * n );
+    corpus->missing       = zmalloc( sizeof(unsigned char *) * n );
+    corpus->missing_lens  = zmalloc( sizeof(int) * n );
+    corpus->prefixes      = zmalloc( sizeof(unsigned char *) * GB_MICRO_SCANS );
+    corpus->prefix_lens   = zmalloc( sizeof(int) * GB_MICRO_SCANS );
+
+    // duplicates would make the insert and remove loops do less work than they report
+    tr_init( &unique );
+
+    for( i = 0; i < n; ++tries )
+    {
+        len = gbMicroFormatKey( name, key, gbMicroRandom() );
+
+        if( tries > n * 64 )
+        {
+            fprintf( stderr, "Not enough distinct '%s' keys, use a smaller --keys value.\n", name );
+            exit(1);
+        }
+
+        if( tr_find( &unique, (unsigned char *)key, len ) == NULL )
+        {
+            tr_insert( &unique, (unsigned char *)key, len, (void *)1 );
+            gbMicroAddKey( corpus->keys, corpus->lens, i++, key, len );
+        }
+    }
+
+    for( i = 0; i < n; ++i )
+    {
+        corpus->shuffled[i]      = corpus->keys[i];
+        corpus->shuffled_lens[i] = corpus->lens[i];
+    }
+
+    for( i = n - 1; i > 0; --i )
+    {
+        unsigned char *k;
+
+        j = gbMicroRandom() % ( i + 1 );
+        k = corpus->shuffled[i]; corpus->shuffled[i] = corpus->shuffled[j]; corpus->shuffled[j] = k;
+        len = corpus->shuffled_lens[i]; corpus->shuffled_lens[i] = corpus->shuffled_lens[j]; corpus->shuffled_lens[j] = len;
+    }
+
+    // misses diverge from a stored key only at the last byte or right after it
+    for( i = 0; i < n; ++i )
+    {
+        len = corpus->shuffled_lens[i];
+
+        memcpy( key, corpus->shuffled[i], len );
+
+        if( i % 2 )
+            key[len++] = '~';
+        else
+            key[len - 1] = '~';
+
+        key[len] = '\0';
+
+        gbMicroAddKey( corpus->missing, corpus->missing_lens, i, key, len );
+    }
+
+    // prefixes end after the last separator or, for hex keys, after a few digits
+    for( i = 0; i < GB_MICRO_SCANS; ++i )
+    {
+        j   = gbMicroRandom() % n;
+        len = corpus->lens[j] - 1;
+
+        while( len > 0 && corpus->keys[j][len - 1] != '/' && corpus->keys[j][len - 1] != ':' )
+            --len;
+
+        if( len <= 0 )
+            len = 4;
+
+        memcpy( key, corpus->keys[j], len );
+        key[len] = '\0';
+
+        gbMicroAddKey( corpus->prefixes, corpus->prefix_lens, i, key, len );
+    }
+
+    tr_free( &unique );
+}
+
+static void gbMicroFreeCorpus( gbMicroCorpus *corpus )
+{
+    size_t i;
+
+    for( i = 0; i < corpus->n; ++i )
+    {
+        zfree( corpus->keys[i] );
+        zfree( corpus->missing[i] );
+    }
+
+    for( i = 0; i < GB_MICRO_SCANS; ++i )
+        zfree( corpus->prefixes[i] );
+
+    zfree( corpus->keys );
+    zfree( corpus->lens );
+    zfree( corpus->shuffled );
+    zfree( corpus->shuffled_lens );
+    zfree( corpus->missing );
+    zfree( corpus->missing_lens );
+    zfree( corpus->prefixes );
+    zfree( corpus->prefix_lens );
+}
+
+/*
+ * Look up every key while the index grows, with a key out of four removed
+ * meanwhile. A cluster wrapping past the end of the old table is moved
+ * in more than one step, so make sure that some growths started with one.
+ */
+static void gbMicroCheckIndex(void)
+{
+    htable_t ht;
+    ht_slot_t *growing = NULL;
+    unsigned char key[0xFF];
+    size_t i, j, p, set, n = 1000, wrapped = 0;
+    void *value = NULL;
+    int len;
+
+    for( set = 0; set < 16; ++set )
+    {
+        ht_init( &ht );
+
+        for( i = 0; i < n; ++i )
+        {
+            len = sprintf( (char *)key, "%zu:key:%zu", set, i );
+            ht_add( &ht, key, len, (void *)( i + 1 ) );
+
+            for( p = 0; ht.old.slots && ht.old.slots != growing && p <= ht.old.mask; ++p )
+            {
+                if( ht.old.slots[p].key && ( ht.old.slots[p].hash & ht.old.mask ) > p )
+                {
+                    ++wrapped;
+                    break;
+                }
+            }
+
+            growing = ht.old.slots;
+
+            if( i % 4 == 3 )
+            {
+                len = sprintf( (char *)key, "%zu:key:%zu", set, i - 2 );
+                ht_remove( &ht, key, len );
+            }
+
+            for( j = 0; ht.old.slots && j <= i; ++j )
+            {
+                len   = sprintf( (char *)key, "%zu:key:%zu", set, j );
+                value = ht_find( &ht, key, len );
+
+                if( value != ( j % 4 == 1 && j + 2 <= i ? NULL : (void *)( j + 1 ) ) )
+                {
+                    fprintf( stderr, "Key %zu:%zu is %s while the index grows.\n", set, j, value ? "still there" : "missing" );
+                    exit(1);
+                }
+            }
+        }
+
+        if( ht_size( &ht ) != n - n / 4 )
+        {
+            fprintf( stderr, "The index lost keys while growing.\n" );
+            exit(1);
+        }
+
+        ht_free( &ht );
+    }
+
+    if( wrapped == 0 )
+    {
+        fprintf( stderr, "No cluster wrapped past the end of the index when it grew.\n" );
+        exit(1);
+    }
+}
+
+static int gbMicroSearchCallback( void *ctx, unsigned char *key, int len, void *data )
+{
+    // every key counts as one, like COUNT does
+    return 1;
+}
+
+static int gbMicroLongestKeyCallback( void *ctx, unsigned char *key, int len, void *data )
+{
+    int *longest = ctx;
+
+    if( len > *longest )
+        *longest = len;
+
+    return 1;
+}
+
+// A key of exactly the maximum size is emitted by a range search and counted.
+static void gbMicroCheckRange(void)
+{
+    trie_t tree;
+    unsigned char key[GB_MICRO_MAX_KEY];
+    size_t emitted, counted;
+    int longest = 0;
+
+    tr_init( &tree );
+
+    memset( key, 'x', sizeof(key) );
+
+    key[0] = 'a';
+    tr_insert( &tree, key, 1, key );
+    key[0] = 'b';
+    tr_insert( &tree, key, GB_MICRO_MAX_KEY, key );
+    key[0] = 'c';
+    tr_insert( &tree, key, 1, key );
+
+    emitted = tr_search_range( &tree, (unsigned char *)"a", 1, (unsigned char *)"c", 1, -1, GB_MICRO_MAX_KEY, gbMicroLongestKeyCallback, &longest );
+    counted = tr_count_range( &tree, (unsigned char *)"a", 1, (unsigned char *)"c", 1 );
+
+    if( emitted != 3 || counted != 3 || longest != GB_MICRO_MAX_KEY )
+    {
+        fprintf( stderr, "A range search emitted %zu keys up to %d bytes, %zu were counted.\n", emitted, longest, counted );
+        exit(1);
+    }
+
+    tr_free( &tree );
+}
+
+/*
+ * With 'indexed' the tree has its hash index enabled, prefix scans don't
+ * use it so only the single key operations are measured.
+ */
+static void gbMicroTrie( gbMicroCorpus *corpus, int indexed )
+{
+    gbMicroTimer insert, find, miss, replace, search, search_cb, search_limit, search_range, count, count_prefix, count_range, remove;
+    llist_t *keys = ll_prealloc( 255 );
+    size_t i, hits = 0, counted = 0, limited = 0, ranged = 0, found = 0, mem = 0, nodes = 0;
+    uint64_t start;
+    char extra[0xFF], name[0xFF];
+    unsigned char end[GB_MICRO_MAX_KEY + 1];
+    int r;
+
+    memset( &insert, 0x00, sizeof(gbMicroTimer) );
+    search = search_cb = search_limit = search_range = count = count_prefix = count_range = remove = find = miss = replace = insert;
+
+    snprintf( name, sizeof(name), "%s%s", corpus->name, indexed ? "+index" : "" );
+
+    for( r = 0; r < repeat; ++r )
+    {
+        trie_t tree;
+
+        tr_init( &tree );
+        tr_set_index( &tree, indexed );
+
+        gbMicroStart( &insert, &start );
+        for( i = 0; i < corpus->n; ++i )
+            tr_insert( &tree, corpus->keys[i], corpus->lens[i], corpus->keys[i] );
+        gbMicroStop( &insert, start );
+
+        mem   = tree.mem + ( tree.index ? tree.index->mem : 0 );
+        nodes = tree.n_nodes;
+
+        found = 0;
+        gbMicroStart( &find, &start );
+        for( i = 0; i < corpus->n; ++i )
+            found += tr_find( &tree, corpus->shuffled[i], corpus->shuffled_lens[i] ) != NULL;
+        gbMicroStop( &find, start );
+
+        assert( found == corpus->n );
+
+        gbMicroStart( &miss, &start );
+        for( i = 0; i < corpus->n; ++i )
+            found += tr_find( &tree, corpus->missing[i], corpus->missing_lens[i] ) != NULL;
+        gbMicroStop( &miss, start );
+
+        // what a SET of an existing key does
+        gbMicroStart( &replace, &start );
+        for( i = 0; i < corpus->n; ++i )
+            tr_insert( &tree, corpus->shuffled[i], corpus->shuffled_lens[i], corpus->shuffled[i] );
+        gbMicroStop( &replace, start );
+
+        if( indexed )
+            goto remove;
+
+        // the keys emitted by tr_search belong to the caller, like in the M* handlers
+        hits = 0;
+        gbMicroStart( &search, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+        {
+            hits += tr_search( &tree, corpus->prefixes[i], corpus->prefix_lens[i], -1, GB_MICRO_MAX_KEY, &keys, NULL );
+
+            ll_foreach( keys, item )
+            {
+                if( item->data )
+                    zfree( item->data );
+            }
+
+            ll_reset( keys );
+        }
+        gbMicroStop( &search, start );
+
+        gbMicroStart( &search_cb, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+            tr_search_callback( &tree, corpus->prefixes[i], corpus->prefix_lens[i], -1, GB_MICRO_MAX_KEY, gbMicroSearchCallback, NULL );
+        gbMicroStop( &search_cb, start );
+
+        // a limited scan should cost the keys it emits, not the whole subtree
+        limited = 0;
+        gbMicroStart( &search_limit, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+            limited += tr_search_callback( &tree, corpus->prefixes[i], corpus->prefix_lens[i], GB_MICRO_SEARCH_LIMIT, GB_MICRO_MAX_KEY, gbMicroSearchCallback, NULL );
+        gbMicroStop( &search_limit, start );
+
+        // the same keys as a range, from the prefix to the prefix followed by 0xFF
+        ranged = 0;
+        gbMicroStart( &search_range, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+        {
+            memcpy( end, corpus->prefixes[i], corpus->prefix_lens[i] );
+            end[ corpus->prefix_lens[i] ] = 0xFF;
+
+            ranged += tr_search_range( &tree, corpus->prefixes[i], corpus->prefix_lens[i], end, corpus->prefix_lens[i] + 1, GB_MICRO_SEARCH_LIMIT, GB_MICRO_MAX_KEY, gbMicroSearchCallback, NULL );
+        }
+        gbMicroStop( &search_range, start );
+
+        assert( ranged == limited );
+
+        gbMicroStart( &count, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+            tr_count( &tree, corpus->prefixes[i], corpus->prefix_lens[i], -1, GB_MICRO_MAX_KEY, gbMicroSearchCallback, NULL );
+        gbMicroStop( &count, start );
+
+        counted = 0;
+        gbMicroStart( &count_prefix, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+            counted += tr_count_prefix( &tree, corpus->prefixes[i], corpus->prefix_lens[i], NULL );
+        gbMicroStop( &count_prefix, start );
+
+        assert( counted == hits );
+
+        ranged = 0;
+        gbMicroStart( &count_range, &start );
+        for( i = 0; i < GB_MICRO_SCANS; ++i )
+        {
+            memcpy( end, corpus->prefixes[i], corpus->prefix_lens[i] );
+            end[ corpus->prefix_lens[i] ] = 0xFF;
+
+            ranged += tr_count_range( &tree, corpus->prefixes[i], corpus->prefix_lens[i], end, corpus->prefix_lens[i] + 1 );
+        }
+        gbMicroStop( &count_range, start );
+
+        assert( ranged == hits );
+
+remove:
+
+        gbMicroStart( &remove, &start );
+        for( i = 0; i < corpus->n; ++i )
+            tr_remove( &tree, corpus->shuffled[i], corpus->shuffled_lens[i] );
+        gbMicroStop( &remove, start );
+
+        assert( tree.n_nodes == 0 );
+        assert( tree.root.n_items == 0 );
+
+        tr_free( &tree );
+    }
+
+    snprintf( extra, sizeof(extra), "\"bytes_per_key\": %.2f, \"nodes_per_key\": %.3f", (double)mem / corpus->n, (double)nodes / corpus->n );
+    gbMicroReport( "tr_insert", name, corpus->n, &insert, extra );
+    gbMicroReport( "tr_find", name, corpus->n, &find, NULL );
+    gbMicroReport( "tr_find_miss", name, corpus->n, &miss, NULL );
+    gbMicroReport( "tr_replace", name, corpus->n, &replace, NULL );
+
+    if( !indexed )
+    {
+        // scans are reported per emitted key, the work grows with the result size
+        snprintf( extra, sizeof(extra), "\"scans\": %d, \"keys_per_scan\": %.2f", GB_MICRO_SCANS, (double)hits / GB_MICRO_SCANS );
+        gbMicroReport( "tr_search", name, hits, &search, extra );
+        gbMicroReport( "tr_search_callback", name, hits, &search_cb, extra );
+        snprintf( extra, sizeof(extra), "\"scans\": %d, \"limit\": %d, \"keys_per_scan\": %.2f", GB_MICRO_SCANS, GB_MICRO_SEARCH_LIMIT, (double)limited / GB_MICRO_SCANS );
+        gbMicroReport( "tr_search_limit", name, GB_MICRO_SCANS, &search_limit, extra );
+        gbMicroReport( "tr_search_range", name, GB_MICRO_SCANS, &search_range, extra );
+        snprintf( extra, sizeof(extra), "\"scans\": %d, \"keys_per_scan\": %.2f", GB_MICRO_SCANS, (double)hits / GB_MICRO_SCANS );
+        gbMicroReport( "tr_count", name, hits, &count, extra );
+        // the subtree counters don't depend on the result size, so report it per scan
+        gbMicroReport( "tr_count_prefix", name, GB_MICRO_SCANS, &count_prefix, extra );
+        gbMicroReport( "tr_count_range", name, GB_MICRO_SCANS, &count_range, extra );
+    }
+
+    gbMicroReport( "tr_remove", name, corpus->n, &remove, NULL );
+
+    ll_destroy( keys );
+}
+
+static size_t gbMicroItemWeight( void *item )
+{
+    return ((gbItem *)item)->size;
+}
+
+/*
+ * What a GET does once the key is found, reading the item header, with the
+ * items allocated from a pool like volatile ones or stored inside the tree
+ * leaves like the gibson ones.
+ */
+static void gbMicroTrieItems( gbMicroCorpus *corpus, int leaves )
+{
+    gbMicroTimer insert, lookup, twice, upsert;
+    opool_t pool;
+    tr_slot_t slot;
+    gbItem *item = NULL;
+    size_t i, sum = 0;
+    uint64_t start;
+    char name[0xFF];
+    int r, created;
+
+    memset( &insert, 0x00, sizeof(gbMicroTimer) );
+    lookup = twice = upsert = insert;
+
+    snprintf( name, sizeof(name), "%s%s", corpus->name, leaves ? "+leaf" : "+pool" );
+
+    for( r = 0; r < repeat; ++r )
+    {
+        trie_t tree;
+
+        tr_init( &tree );
+        opool_create( &pool, GB_ITEM_SLOT_SIZE, GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+
+        // leaf trees are weighted as the server one is
+        if( leaves )
+        {
+            tr_set_weight( &tree, gbMicroItemWeight );
+            tr_set_leaf( &tree, GB_ITEM_SLOT_SIZE );
+        }
+
+        gbMicroStart( &insert, &start );
+        for( i = 0; i < corpus->n; ++i )
+        {
+            if( leaves )
+            {
+                item = tr_insert_leaf( &tree, corpus->keys[i], corpus->lens[i], corpus->lens[i], &created );
+            }
+            else
+            {
+                item = opool_alloc_object( &pool );
+                tr_insert( &tree, corpus->keys[i], corpus->lens[i], item );
+            }
+
+            item->size = corpus->lens[i];
+        }
+        gbMicroStop( &insert, start );
+
+        gbMicroStart( &lookup, &start );
+        for( i = 0; i < corpus->n; ++i )
+            sum += ((gbItem *)tr_find( &tree, corpus->shuffled[i], corpus->shuffled_lens[i] ))->size;
+        gbMicroStop( &lookup, start );
+
+        // overwrites of existing keys, checking the old item first as SET does
+        if( leaves )
+        {
+            gbMicroStart( &twice, &start );
+            for( i = 0; i < corpus->n; ++i )
+            {
+                item = tr_find( &tree, corpus->shuffled[i], corpus->shuffled_lens[i] );
+                sum += item->size;
+                item = tr_insert_leaf( &tree, corpus->shuffled[i], corpus->shuffled_lens[i], item->size + 1, &created );
+                item->size++;
+            }
+            gbMicroStop( &twice, start );
+
+            gbMicroStart( &upsert, &start );
+            for( i = 0; i < corpus->n; ++i )
+            {
+                item = tr_upsert( &tree, corpus->shuffled[i], corpus->shuffled_lens[i], &slot, &created );
+                sum += item->size;
+                tr_resize_slot( &tree, &slot, 1 );
+                item->size++;
+            }
+            gbMicroStop( &upsert, start );
+        }
+
+        tr_free( &tree );
+        opool_destroy( &pool );
+    }
+
+    assert( sum > 0 );
+
+    gbMicroReport( "tr_insert_item", name, corpus->n, &insert, NULL );
+    gbMicroReport( "tr_find_item", name, corpus->n, &lookup, NULL );
+
+    if( leaves )
+    {
+        gbMicroReport( "tr_find_insert_item", name, corpus->n, &twice, NULL );
+        gbMicroReport( "tr_upsert_item", name, corpus->n, &upsert, NULL );
+    }
+}
+
+static void gbMicroObjectPool(void)
+{
+    gbMicroTimer alloc, release, reuse, churn, zalloc, zrelease;
+    void **objects = zmalloc( sizeof(void *) * nkeys );
+    uint64_t start;
+    size_t i, j;
+    int r;
+
+    memset( &alloc, 0x00, sizeof(gbMicroTimer) );
+    release = reuse = churn = zalloc = zrelease = alloc;
+
+    for( r = 0; r < repeat; ++r )
+    {
+        opool_t pool;
+
+        opool_create( &pool, sizeof(gbItem), GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+
+        // fresh pool, blocks are allocated as it grows
+        gbMicroStart( &alloc, &start );
+        for( i = 0; i < nkeys; ++i )
+            objects[i] = opool_alloc_object( &pool );
+        gbMicroStop( &alloc, start );
+
+        gbMicroStart( &release, &start );
+        for( i = 0; i < nkeys; ++i )
+            opool_free_object( &pool, objects[i] );
+        gbMicroStop( &release, start );
+
+        // every object now comes from the free stack
+        gbMicroStart( &reuse, &start );
+        for( i = 0; i < nkeys; ++i )
+            objects[i] = opool_alloc_object( &pool );
+        gbMicroStop( &reuse, start );
+
+        // steady state of a cache, a random object is replaced at every step
+        gbMicroStart( &churn, &start );
+        for( i = 0; i < nkeys; ++i )
+        {
+            j = gbMicroRandom() % nkeys;
+
+            opool_free_object( &pool, objects[j] );
+            objects[j] = opool_alloc_object( &pool );
+        }
+        gbMicroStop( &churn, start );
+
+        opool_destroy( &pool );
+
+        // the general purpose allocator the pool replaces
+        gbMicroStart( &zalloc, &start );
+        for( i = 0; i < nkeys; ++i )
+            objects[i] = zmalloc( sizeof(gbItem) );
+        gbMicroStop( &zalloc, start );
+
+        gbMicroStart( &zrelease, &start );
+        for( i = 0; i < nkeys; ++i )
+            zfree( objects[i] );
+        gbMicroStop( &zrelease, start );
+    }
+
+    gbMicroReport( "opool_alloc_object", "fresh", nkeys, &alloc, NULL );
+    gbMicroReport( "opool_free_object", "all", nkeys, &release, NULL );
+    gbMicroReport( "opool_alloc_object", "reuse", nkeys, &reuse, NULL );
+    gbMicroReport( "opool_free_alloc", "random", nkeys, &churn, NULL );
+    gbMicroReport( "zmalloc", "gbItem", nkeys, &zalloc, NULL );
+    gbMicroReport( "zfree", "gbItem", nkeys, &zrelease, NULL );
+
+    zfree( objects );
+}
+
+// Value buffers of random sizes filled like a SET does, then a SET churn
+// replaces a random one at every step.
+static void gbMicroSlab(void)
+{
+    gbMicroTimer alloc, churn, release, zalloc, zchurn, zrelease;
+    void **objects = zmalloc( sizeof(void *) * nkeys );
+    size_t *sizes = zmalloc( sizeof(size_t) * nkeys );
+    uint64_t start;
+    size_t i, j;
+    int r;
+
+    memset( &alloc, 0x00, sizeof(gbMicroTimer) );
+    churn = release = zalloc = zchurn = zrelease = alloc;
+
+    for( i = 0; i < nkeys; ++i )
+        sizes[i] = GB_ITEM_INLINE_SIZE + 1 + gbMicroRandom() % 1000;
+
+    for( r = 0; r < repeat; ++r )
+    {
+        slab_t slab;
+
+        slab_init( &slab, 1 );
+
+        gbMicroStart( &alloc, &start );
+        for( i = 0; i < nkeys; ++i )
+        {
+            objects[i] = slab_alloc( &slab, sizes[i] );
+            memset( objects[i], 'x', sizes[i] );
+        }
+        gbMicroStop( &alloc, start );
+
+        gbMicroStart( &churn, &start );
+        for( i = 0; i < nkeys; ++i )
+        {
+            j = gbMicroRandom() % nkeys;
+
+            slab_free( &slab, objects[j], sizes[j] );
+            sizes[j] = GB_ITEM_INLINE_SIZE + 1 + gbMicroRandom() % 1000;
+            objects[j] = slab_alloc( &slab, sizes[j] );
+            memset( objects[j], 'x', sizes[j] );
+        }
+        gbMicroStop( &churn, start );
+
+        gbMicroStart( &release, &start );
+        for( i = 0; i < nkeys; ++i )
+            slab_free( &slab, objects[i], sizes[i] );
+        gbMicroStop( &release, start );
+
+        slab_destroy( &slab );
+
+        // the general purpose allocator the slabs replace
+        gbMicroStart( &zalloc, &start );
+        for( i = 0; i < nkeys; ++i )
+        {
+            objects[i] = zmalloc( sizes[i] );
+            memset( objects[i], 'x', sizes[i] );
+        }
+        gbMicroStop( &zalloc, start );
+
+        gbMicroStart( &zchurn, &start );
+        for( i = 0; i < nkeys; ++i )
+        {
+            j = gbMicroRandom() % nkeys;
+
+            zfree( objects[j] );
+            sizes[j] = GB_ITEM_INLINE_SIZE + 1 + gbMicroRandom() % 1000;
+            objects[j] = zmalloc( sizes[j] );
+            memset( objects[j], 'x', sizes[j] );
+        }
+        gbMicroStop( &zchurn, start );
+
+        gbMicroStart( &zrelease, &start );
+        for( i = 0; i < nkeys; ++i )
+            zfree( objects[i] );
+        gbMicroStop( &zrelease, start );
+    }
+
+    gbMicroReport( "slab_alloc", "values", nkeys, &alloc, NULL );
+    gbMicroReport( "slab_free_alloc", "random", nkeys, &churn, NULL );
+    gbMicroReport( "slab_free", "all", nkeys, &release, NULL );
+    gbMicroReport( "zmalloc", "values", nkeys, &zalloc, NULL );
+    gbMicroReport( "zfree_zmalloc", "random", nkeys, &zchurn, NULL );
+    gbMicroReport( "zfree", "values", nkeys, &zrelease, NULL );
+
+    zfree( sizes );
+    zfree( objects );
+}
+
+static void gbMicroList(void)
+{
+    gbMicroTimer append, reset, reappend, clear;
+    size_t i, l, lists = nkeys / GB_MICRO_LIST_SIZE + 1;
+    uint64_t start;
+    int r;
+
+    memset( &append, 0x00, sizeof(gbMicroTimer) );
+    reset = reappend = clear = append;
+
+    for( r = 0; r < repeat; ++r )
+    {
+        llist_t **ll = zmalloc( sizeof(llist_t *) * lists );
+
+        for( l = 0; l < lists; ++l )
+            ll[l] = ll_create();
+
+        gbMicroStart( &append, &start );
+        for( l = 0; l < lists; ++l )
+            for( i = 0; i < GB_MICRO_LIST_SIZE; ++i )
+                ll_append( ll[l], (void *)( i + 1 ) );
+        gbMicroStop( &append, start );
+
+        gbMicroStart( &reset, &start );
+        for( l = 0; l < lists; ++l )
+            ll_reset( ll[l] );
+        gbMicroStop( &reset, start );
+
+        // the M* handlers reuse the same lists, appends then fill free slots
+        gbMicroStart( &reappend, &start );
+        for( l = 0; l < lists; ++l )
+            for( i = 0; i < GB_MICRO_LIST_SIZE; ++i )
+                ll_append( ll[l], (void *)( i + 1 ) );
+        gbMicroStop( &reappend, start );
+
+        gbMicroStart( &clear, &start );
+        for( l = 0; l < lists; ++l )
+            ll_clear( ll[l] );
+        gbMicroStop( &clear, start );
+
+        for( l = 0; l < lists; ++l )
+            zfree( ll[l] );
+
+        zfree( ll );
+    }
+
+    gbMicroReport( "ll_append", "new", lists * GB_MICRO_LIST_SIZE, &append, NULL );
+    gbMicroReport( "ll_reset", "all", lists * GB_MICRO_LIST_SIZE, &reset, NULL );
+    gbMicroReport( "ll_append", "reset", lists * GB_MICRO_LIST_SIZE, &reappend, NULL );
+    gbMicroReport( "ll_clear", "all", lists * GB_MICRO_LIST_SIZE, &clear, NULL );
+}
+
+/*
+ * Values like the ones applications cache, serialized records sharing their
+ * structure, plus random bytes that lzf can not shrink at all.
+ */
+static size_t gbMicroFormatValue( const char *corpus, char *buffer, size_t size )
+{
+    size_t len = 0;
+
+    if( strcmp( corpus, "random" ) == 0 )
+    {
+        for( len = 0; len < size; ++len )
+            buffer[len] = gbMicroRandom() & 0xFF;
+
+        return len;
+    }
+
+    while( len < size )
+    {
+        uint64_t r = gbMicroRandom();
+        char record[0xFF];
+        int n = snprintf( record, sizeof(record),
+                          "{\"id\":%u,\"name\":\"user%u\",\"email\":\"user%u@example.com\",\"score\":%u,\"active\":%s},",
+                          (unsigned int)( r % 1000000 ), (unsigned int)( r % 100000 ), (unsigned int)( r % 100000 ),
+                          (unsigned int)( ( r >> 32 ) % 1000 ), r & 1 ? "true" : "false" );
+
+        if( len + n > size )
+            n = size - len;
+
+        memcpy( buffer + len, record, n );
+        len += n;
+    }
+
+    return len;
+}
+
+static void gbMicroLzf( const char *corpus, size_t size )
+{
+    gbMicroTimer compress, decompress;
+    char *in = zmalloc( size ),
+         *out = zmalloc( size ),
+         *back = zmalloc( size ),
+          name[0xFF],
+          extra[0xFF];
+    unsigned int comprlen = 0, declen = 0;
+    size_t i, rounds = 0x1000000 / size + 1;
+    uint64_t start;
+    int r;
+
+    memset( &compress, 0x00, sizeof(gbMicroTimer) );
+    decompress = compress;
+
+    gbMicroFormatValue( corpus, in, size );
+
+    for( r = 0; r < repeat; ++r )
+    {
+        // 16MB of input per repetition, whatever the value size
+        gbMicroStart( &compress, &start );
+        for( i = 0; i < rounds; ++i )
+            comprlen = lzf_compress( in, size, out, size - 1 );
+        gbMicroStop( &compress, start );
+
+        // incompressible values are stored as they are
+        if( comprlen == 0 )
+            continue;
+
+        gbMicroStart( &decompress, &start );
+        for( i = 0; i < rounds; ++i )
+            declen = lzf_decompress( out, comprlen, back, size );
+        gbMicroStop( &decompress, start );
+
+        // checked in release builds too, a broken round trip must not be timed
+        if( declen != size || memcmp( in, back, size ) != 0 )
+        {
+            fprintf( stderr, "lzf round trip of a %s-%zu value failed.\n", corpus, size );
+            exit(1);
+        }
+    }
+
+    snprintf( name, sizeof(name), "%s-%zu", corpus, size );
+
+    qsort( compress.samples, compress.nsamples, sizeof(uint64_t), gbMicroCompareSamples );
+    snprintf( extra, sizeof(extra), "\"ratio\": %.3f, \"mb_per_sec\": %.1f", comprlen ? (double)comprlen / size : 1.0,
+              (double)size * rounds / compress.samples[0] * 1e9 / 1048576.0 );
+    gbMicroReport( "lzf_compress", name, rounds, &compress, extra );
+
+    if( decompress.nsamples )
+    {
+        qsort( decompress.samples, decompress.nsamples, sizeof(uint64_t), gbMicroCompareSamples );
+        snprintf( extra, sizeof(extra), "\"mb_per_sec\": %.1f", (double)size * rounds / decompress.samples[0] * 1e9 / 1048576.0 );
+        gbMicroReport( "lzf_decompress", name, rounds, &decompress, extra );
+    }
+
+    zfree( in );
+    zfree( out );
+    zfree( back );
+}
+
+int main( int argc, char **argv )
+{
+    static const char *corpora[] = { "urls", "namespaced", "hex" };
+    static const size_t value_sizes[] = { 256, 4096, 65536 };
+    gbMicroCorpus corpus;
+    int c, option_index = 0;
+    size_t i;
+
+    output = stdout;
+
+    while( ( c = getopt_long( argc, argv, "hn:r:o:", long_options, &option_index ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'n': nkeys = strtoul( optarg, NULL, 10 ); break;
+            case 'r': repeat = atoi(optarg); break;
+
+            case 'o':
+
+                if( ( output = fopen( optarg, "w" ) ) == NULL )
+                {
+                    fprintf( stderr, "%s : %s\n", optarg, strerror(errno) );
+                    exit(1);
+                }
+
+            break;
+
+            default:
+
+                gbMicroHelpMenu( argv, c == 'h' ? 0 : 1 );
+        }
+    }
+
+    if( nkeys < 2 || repeat <= 0 || repeat > GB_MICRO_MAX_REPEAT )
+        gbMicroHelpMenu( argv, 1 );
+
+    // correctness checks the benchmarks below rely on
+    gbMicroCheckIndex();
+    gbMicroCheckRange();
+
+    fprintf( output, "{\n  \"version\": \"%s\",\n  \"keys\": %zu,\n  \"repeat\": %d,\n  \"results\": [", VERSION, nkeys, repeat );
+
+    for( i = 0; i < sizeof(corpora) / sizeof(corpora[0]); ++i )
+    {
+        gbMicroCreateCorpus( &corpus, corpora[i], nkeys );
+        gbMicroTrie( &corpus, 0 );
+        gbMicroTrie( &corpus, 1 );
+        gbMicroTrieItems( &corpus, 0 );
+        gbMicroTrieItems( &corpus, 1 );
+        gbMicroFreeCorpus( &corpus );
+    }
+
+    gbMicroObjectPool();
+    gbMicroSlab();
+    gbMicroList();
+
+    for( i = 0; i < sizeof(value_sizes) / sizeof(value_sizes[0]); ++i )
+    {
+        gbMicroLzf( "json", value_sizes[i] );
+        gbMicroLzf( "random", value_sizes[i] );
+    }
+
+    fprintf( output, "\n  ]\n}\n" );
+
+    if( output != stdout )
+        fclose( output );
+
+    return 0;
+}
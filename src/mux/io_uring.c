@@ -0,0 +1,719 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#if HAVE_IO_URING
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The epoll backend is kept around under another name, it is used when
+ * the running kernel does not support io_uring ( or it is disabled by a
+ * seccomp profile or by the kernel.io_uring_disabled sysctl ). */
+#define aeApiState    aeEpollState
+#define aeApiCreate   aeEpollCreate
+#define aeApiResize   aeEpollResize
+#define aeApiFree     aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll     aeEpollPoll
+#define aeApiName     aeEpollName
+#include "epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+/* This backend also provides aeApiRead() and aeApiClose(). */
+#define AE_API_READ 1
+
+/* Largest SQ ring we ask for, the kernel clamps it anyway. */
+#define AE_URING_MAX_ENTRIES 4096
+/* Provided buffers recv requests pick from, the count must be a power of 2. */
+#define AE_URING_BUFFERS     256
+#define AE_URING_BUFFER_SIZE GBNET_IO_CHUNK_SIZE
+#define AE_URING_BGID        0
+
+/* user_data layout: generation << 32 | operation << 24 | fd */
+#define AE_URING_OP_POLLIN  1
+#define AE_URING_OP_POLLOUT 2
+#define AE_URING_OP_RECV    3
+#define AE_URING_OP_CANCEL  4
+#define AE_URING_DATA(gen,op,fd) (((uint64_t)(gen) << 32) | ((uint64_t)(op) << 24) | (uint32_t)(fd))
+
+/* What is in flight for the read side of a fd. */
+#define AE_URING_NONE 0
+#define AE_URING_POLL 1
+#define AE_URING_RECV 2
+
+/* Every interest change, re-arm and buffer given back is only queued in the
+ * SQ ring and all of them are submitted by the same io_uring_enter() call
+ * that waits for the next completions.
+ *
+ * Sockets are read by multishot recv requests: the kernel picks a buffer
+ * from the provided buffer ring and fills it as soon as data comes in, the
+ * read handler gets it through aeApiRead() without any system call. Other
+ * fds ( listeners ), kernels without multishot recv and sockets that ran out
+ * of buffers use one-shot polls, as the writable side always does. Polls are
+ * re-armed after they fire rather than multishot because arming checks the
+ * current state of the fd, which gives the same level triggered semantics
+ * of epoll the handlers expect. */
+typedef struct aeUringFd {
+    int rmode;           /* read side request in flight, AE_URING_(NONE|POLL|RECV) */
+    int warmed;          /* is a POLLOUT request in flight */
+    uint32_t rgen, wgen; /* bumped on cancellation, tells stale completions apart */
+    uint32_t ogen;       /* rgen when the fd was opened, older data is not ours */
+    int norecv;          /* recv does not work for this fd, stick to polls */
+    int pollonce;        /* recv ran out of buffers, poll before trying again */
+    int head, tail;      /* received buffers not read yet, -1 if none */
+    char dirty;          /* in the dirty list */
+    char ready;          /* in the ready list */
+    long long fired;     /* iteration this fd was last reported in */
+    int slot;            /* ... and its index in eventLoop->fired */
+} aeUringFd;
+
+typedef struct aeApiState {
+    int ringfd;
+    unsigned entries;
+    /* mmap()ed rings */
+    void *ring;
+    size_t ringsz;
+    struct io_uring_sqe *sqes;
+    size_t sqesz;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned tail;       /* local SQ tail, published on every push */
+    /* provided buffers, br is NULL if the kernel does not support them */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned short brtail;
+    int *bnext;          /* next buffer in the list of the fd it belongs to */
+    unsigned *boff;      /* where unread data begins */
+    unsigned *blen;      /* ... and ends */
+    /* per fd state */
+    aeUringFd *fds;
+    int *dirty;          /* fds whose requests have to be ( re )armed */
+    int ndirty;
+    int *ready;          /* fds with buffered data left to report */
+    int nready;
+    long long iter;
+} aeApiState;
+
+/* 0 until the first loop is created, then 1 for io_uring or -1 for epoll.
+ * Worker loops can be created concurrently, so it is only ever set once,
+ * atomically, and never changes afterwards. */
+static int aeUringAvailable = 0;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int aeUringRegister(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static unsigned aeUringPending(aeApiState *state) {
+    return state->tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    struct io_uring_sqe *sqe;
+
+    /* SQ ring full, hand what we have to the kernel without waiting */
+    while (aeUringPending(state) >= state->entries) {
+        if (aeUringEnter(state->ringfd, aeUringPending(state), 0, 0, NULL, 0) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return NULL;
+    }
+
+    sqe = &state->sqes[state->tail & *state->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void aeUringPushSqe(aeApiState *state) {
+    __atomic_store_n(state->sqtail, ++state->tail, __ATOMIC_RELEASE);
+}
+
+static void aeUringInitFd(aeUringFd *st) {
+    memset(st, 0, sizeof(*st));
+    st->head = st->tail = -1;
+    st->fired = -1;
+}
+
+static void aeUringMarkDirty(aeApiState *state, int fd) {
+    if (!state->fds[fd].dirty) {
+        state->fds[fd].dirty = 1;
+        state->dirty[state->ndirty++] = fd;
+    }
+}
+
+static void aeUringMarkReady(aeApiState *state, int fd) {
+    if (!state->fds[fd].ready) {
+        state->fds[fd].ready = 1;
+        state->ready[state->nready++] = fd;
+    }
+}
+
+/* Give a buffer back to the kernel. */
+static void aeUringRecycle(aeApiState *state, int bid) {
+    struct io_uring_buf *b = &state->br->bufs[state->brtail & (AE_URING_BUFFERS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(state->bufs + (size_t)bid * AE_URING_BUFFER_SIZE);
+    b->len = AE_URING_BUFFER_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&state->br->tail, ++state->brtail, __ATOMIC_RELEASE);
+}
+
+static void aeUringAppend(aeApiState *state, int fd, int bid, unsigned len) {
+    aeUringFd *st = &state->fds[fd];
+
+    state->bnext[bid] = -1;
+    state->boff[bid] = 0;
+    state->blen[bid] = len;
+    if (st->tail == -1)
+        st->head = bid;
+    else
+        state->bnext[st->tail] = bid;
+    st->tail = bid;
+}
+
+static void aeUringDrop(aeApiState *state, int fd) {
+    aeUringFd *st = &state->fds[fd];
+
+    while (st->head != -1) {
+        int bid = st->head;
+
+        st->head = state->bnext[bid];
+        aeUringRecycle(state, bid);
+    }
+    st->tail = -1;
+}
+
+static void aeUringArmPoll(aeApiState *state, int fd, int op) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    aeUringFd *st = &state->fds[fd];
+
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (op == AE_URING_OP_POLLIN) {
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = AE_URING_DATA(st->rgen, op, fd);
+        st->rmode = AE_URING_POLL;
+    } else {
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = AE_URING_DATA(st->wgen, op, fd);
+        st->warmed = 1;
+    }
+    aeUringPushSqe(state);
+}
+
+static void aeUringArmRecv(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    aeUringFd *st = &state->fds[fd];
+
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_BGID;
+    sqe->user_data = AE_URING_DATA(st->rgen, AE_URING_OP_RECV, fd);
+    st->rmode = AE_URING_RECV;
+    aeUringPushSqe(state);
+}
+
+static void aeUringCancel(aeApiState *state, int fd, int op) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    aeUringFd *st = &state->fds[fd];
+
+    if (sqe) {
+        sqe->opcode = op == AE_URING_OP_RECV ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = AE_URING_DATA(op == AE_URING_OP_POLLOUT ? st->wgen : st->rgen, op, fd);
+        sqe->user_data = AE_URING_DATA(0, AE_URING_OP_CANCEL, 0);
+        aeUringPushSqe(state);
+    }
+
+    /* whatever the request still completes with is stale now, but data
+     * received meanwhile, which is still ours unless the fd is closed */
+    if (op == AE_URING_OP_POLLOUT) {
+        st->wgen++;
+        st->warmed = 0;
+    } else {
+        st->rgen++;
+        st->rmode = AE_URING_NONE;
+    }
+}
+
+static void aeUringReport(gbEventLoop *eventLoop, int fd, int mask, int *numevents) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *st = &state->fds[fd];
+
+    mask &= eventLoop->events[fd].mask;
+    if (!mask) return;
+
+    if (st->fired == state->iter) {
+        eventLoop->fired[st->slot].mask |= mask;
+    } else if (*numevents < eventLoop->setsize) {
+        st->fired = state->iter;
+        st->slot = *numevents;
+        eventLoop->fired[*numevents].fd = fd;
+        eventLoop->fired[*numevents].mask = mask;
+        (*numevents)++;
+    }
+}
+
+static int aeUringResizeFds(aeApiState *state, int setsize) {
+    state->fds = zrealloc(state->fds, sizeof(aeUringFd)*setsize);
+    state->dirty = zrealloc(state->dirty, sizeof(int)*setsize);
+    state->ready = zrealloc(state->ready, sizeof(int)*setsize);
+    return (state->fds && state->dirty && state->ready) ? 0 : -1;
+}
+
+static void aeUringFree(aeApiState *state) {
+    if (state->br) munmap(state->br, sizeof(struct io_uring_buf)*AE_URING_BUFFERS);
+    if (state->bufs) munmap(state->bufs, (size_t)AE_URING_BUFFERS*AE_URING_BUFFER_SIZE);
+    if (state->sqes) munmap(state->sqes, state->sqesz);
+    if (state->ring) munmap(state->ring, state->ringsz);
+    if (state->ringfd != -1) close(state->ringfd);
+    zfree(state->bnext);
+    zfree(state->boff);
+    zfree(state->blen);
+    zfree(state->fds);
+    zfree(state->dirty);
+    zfree(state->ready);
+    zfree(state);
+}
+
+/* Register the provided buffers ring ( 5.19 ), without it every fd is polled. */
+static void aeUringSetupBuffers(aeApiState *state) {
+    struct io_uring_buf_reg reg;
+    int i;
+
+    state->br = mmap(NULL, sizeof(struct io_uring_buf)*AE_URING_BUFFERS, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    state->bufs = mmap(NULL, (size_t)AE_URING_BUFFERS*AE_URING_BUFFER_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    state->bnext = zmalloc(sizeof(int)*AE_URING_BUFFERS);
+    state->boff = zmalloc(sizeof(unsigned)*AE_URING_BUFFERS);
+    state->blen = zmalloc(sizeof(unsigned)*AE_URING_BUFFERS);
+    if (state->br == MAP_FAILED || state->bufs == MAP_FAILED) goto err;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->br;
+    reg.ring_entries = AE_URING_BUFFERS;
+    reg.bgid = AE_URING_BGID;
+    if (aeUringRegister(state->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) goto err;
+
+    state->brtail = 0;
+    for (i = 0; i < AE_URING_BUFFERS; i++)
+        aeUringRecycle(state, i);
+    return;
+
+err:
+    if (state->br != MAP_FAILED) munmap(state->br, sizeof(struct io_uring_buf)*AE_URING_BUFFERS);
+    if (state->bufs != MAP_FAILED) munmap(state->bufs, (size_t)AE_URING_BUFFERS*AE_URING_BUFFER_SIZE);
+    state->br = NULL;
+    state->bufs = NULL;
+}
+
+static aeApiState *aeUringCreate(int setsize) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+    struct io_uring_params p;
+    unsigned entries = 1;
+    int i;
+
+    if (!state) return NULL;
+    state->ringfd = -1;
+
+    while (entries < (unsigned)setsize && entries < AE_URING_MAX_ENTRIES)
+        entries <<= 1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+    state->ringfd = aeUringSetup(entries, &p);
+    if (state->ringfd == -1 && errno == EINVAL) {
+        /* IORING_SETUP_COOP_TASKRUN needs 5.19 */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CLAMP;
+        state->ringfd = aeUringSetup(entries, &p);
+    }
+    if (state->ringfd == -1) goto err;
+
+    /* we need io_uring_enter() timeouts and the rings in a single mmap() */
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto err;
+    }
+
+    state->entries = p.sq_entries;
+    state->ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > state->ringsz)
+        state->ringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    state->ring = mmap(NULL, state->ringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       state->ringfd, IORING_OFF_SQ_RING);
+    if (state->ring == MAP_FAILED) {
+        state->ring = NULL;
+        goto err;
+    }
+
+    state->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sqhead = (unsigned *)((char *)state->ring + p.sq_off.head);
+    state->sqtail = (unsigned *)((char *)state->ring + p.sq_off.tail);
+    state->sqmask = (unsigned *)((char *)state->ring + p.sq_off.ring_mask);
+    state->sqarray = (unsigned *)((char *)state->ring + p.sq_off.array);
+    state->cqhead = (unsigned *)((char *)state->ring + p.cq_off.head);
+    state->cqtail = (unsigned *)((char *)state->ring + p.cq_off.tail);
+    state->cqmask = (unsigned *)((char *)state->ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->ring + p.cq_off.cqes);
+    state->tail = *state->sqtail;
+
+    /* SQ slots are always consumed in order */
+    for (i = 0; i < (int)p.sq_entries; i++)
+        state->sqarray[i] = i;
+
+    if (aeUringResizeFds(state, setsize) == -1) goto err;
+    for (i = 0; i < setsize; i++)
+        aeUringInitFd(&state->fds[i]);
+
+    aeUringSetupBuffers(state);
+    return state;
+
+err:
+    {
+        int error = errno;
+
+        aeUringFree(state);
+        errno = error;
+    }
+    return NULL;
+}
+
+static int aeApiCreate(gbEventLoop *eventLoop) {
+    aeApiState *state;
+    int decided = 0, error;
+
+    if (__atomic_load_n(&aeUringAvailable, __ATOMIC_ACQUIRE) == -1)
+        return aeEpollCreate(eventLoop);
+
+    state = aeUringCreate(eventLoop->setsize);
+    if (!state) {
+        error = errno;
+
+        /* only the first loop can fall back, the others must match it */
+        if (!__atomic_compare_exchange_n(&aeUringAvailable, &decided, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (decided == 1) {
+                errno = error;
+                return -1;
+            }
+        } else
+            gbLog(WARNING, "io_uring is not available ( %s ), falling back to epoll.", strerror(error));
+
+        return aeEpollCreate(eventLoop);
+    }
+
+    /* a loop created meanwhile fell back to epoll, so this one does too */
+    if (!__atomic_compare_exchange_n(&aeUringAvailable, &decided, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && decided == -1) {
+        aeUringFree(state);
+        return aeEpollCreate(eventLoop);
+    }
+
+    if (!state->br)
+        gbLog(WARNING, "io_uring provided buffers are not available, sockets will be polled.");
+
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(gbEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int i;
+
+    if (aeUringAvailable == -1)
+        return aeEpollResize(eventLoop, setsize);
+
+    if (aeUringResizeFds(state, setsize) == -1) return -1;
+    for (i = eventLoop->setsize; i < setsize; i++)
+        aeUringInitFd(&state->fds[i]);
+    return 0;
+}
+
+static void aeApiFree(gbEventLoop *eventLoop) {
+    if (aeUringAvailable == -1) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+    aeUringFree(eventLoop->apidata);
+}
+
+static int aeApiAddEvent(gbEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *st;
+
+    if (aeUringAvailable == -1)
+        return aeEpollAddEvent(eventLoop, fd, mask);
+
+    st = &state->fds[fd];
+    if ((mask & GB_READABLE) && st->rmode == AE_URING_NONE) {
+        aeUringMarkDirty(state, fd);
+        if (st->head != -1)
+            aeUringMarkReady(state, fd);
+    }
+    if ((mask & GB_WRITABLE) && !st->warmed)
+        aeUringMarkDirty(state, fd);
+    return 0;
+}
+
+static void aeApiDelEvent(gbEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *st;
+
+    if (aeUringAvailable == -1) {
+        aeEpollDelEvent(eventLoop, fd, delmask);
+        return;
+    }
+
+    st = &state->fds[fd];
+    if ((delmask & GB_READABLE) && st->rmode != AE_URING_NONE)
+        aeUringCancel(state, fd, st->rmode == AE_URING_RECV ? AE_URING_OP_RECV : AE_URING_OP_POLLIN);
+    if ((delmask & GB_WRITABLE) && st->warmed)
+        aeUringCancel(state, fd, AE_URING_OP_POLLOUT);
+}
+
+/* Like read(2), but returns the data a recv request already received
+ * first, or EAGAIN if one is still waiting for it. */
+static ssize_t aeApiRead(gbEventLoop *eventLoop, int fd, void *buf, size_t count) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *st;
+    size_t nread = 0;
+
+    if (aeUringAvailable == -1)
+        return read(fd, buf, count);
+
+    st = &state->fds[fd];
+    if (st->head == -1) {
+        if (st->rmode == AE_URING_RECV) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return read(fd, buf, count);
+    }
+
+    while (st->head != -1 && nread < count) {
+        int bid = st->head;
+        size_t n = state->blen[bid] - state->boff[bid];
+
+        if (n > count - nread) n = count - nread;
+        memcpy((char *)buf + nread, state->bufs + (size_t)bid * AE_URING_BUFFER_SIZE + state->boff[bid], n);
+        state->boff[bid] += n;
+        nread += n;
+
+        if (state->boff[bid] == state->blen[bid]) {
+            st->head = state->bnext[bid];
+            aeUringRecycle(state, bid);
+        }
+    }
+    if (st->head == -1)
+        st->tail = -1;
+    else
+        aeUringMarkReady(state, fd);
+
+    return nread;
+}
+
+/* The fd is about to be closed and its events were already deleted: drop
+ * what was received for it, so the next fd with the same number does not
+ * get it. */
+static void aeApiClose(gbEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *st;
+
+    if (aeUringAvailable == -1)
+        return;
+
+    st = &state->fds[fd];
+    aeUringDrop(state, fd);
+    st->rgen++;
+    st->ogen = st->rgen;
+    st->norecv = 0;
+    st->pollonce = 0;
+}
+
+static int aeApiPoll(gbEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, wait = 1;
+    int i, numevents = 0;
+
+    if (aeUringAvailable == -1)
+        return aeEpollPoll(eventLoop, tvp);
+
+    state->iter++;
+
+    /* ( re )arm the requests of every fd whose interest changed or fired */
+    for (i = 0; i < state->ndirty; i++) {
+        int fd = state->dirty[i];
+        int mask = eventLoop->events[fd].mask;
+        aeUringFd *st = &state->fds[fd];
+
+        st->dirty = 0;
+        if ((mask & GB_READABLE) && st->rmode == AE_URING_NONE) {
+            if (state->br && !st->norecv && !st->pollonce) {
+                aeUringArmRecv(state, fd);
+            } else {
+                st->pollonce = 0;
+                aeUringArmPoll(state, fd, AE_URING_OP_POLLIN);
+            }
+        }
+        if ((mask & GB_WRITABLE) && !st->warmed)
+            aeUringArmPoll(state, fd, AE_URING_OP_POLLOUT);
+    }
+    state->ndirty = 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        if (!tvp->tv_sec && !tvp->tv_usec) wait = 0;
+    }
+    /* buffered data to report already, don't block */
+    if (state->nready) wait = 0;
+
+    /* submit and wait with a single system call, errors here are either
+     * EINTR or ETIME, or a CQ overflow being flushed, completions already
+     * posted are reaped anyway */
+    aeUringEnter(state->ringfd, aeUringPending(state), wait,
+                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqmask];
+        uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+        int op = (int)((cqe->user_data >> 24) & 0xff);
+        int fd = (int)(cqe->user_data & 0xffffff);
+        int res = cqe->res;
+        aeUringFd *st;
+
+        if (op == AE_URING_OP_CANCEL) continue;
+        st = &state->fds[fd];
+
+        if (op == AE_URING_OP_POLLIN || op == AE_URING_OP_POLLOUT) {
+            int in = op == AE_URING_OP_POLLIN;
+
+            if (gen != (in ? st->rgen : st->wgen)) continue;
+
+            /* one-shot, it is gone now */
+            if (in)
+                st->rmode = AE_URING_NONE;
+            else
+                st->warmed = 0;
+            aeUringMarkDirty(state, fd);
+
+            /* let the handlers find out about errors */
+            if (res < 0 || (res & ((in ? POLLIN : POLLOUT)|POLLERR|POLLHUP)))
+                aeUringReport(eventLoop, fd, in ? GB_READABLE : GB_WRITABLE, &numevents);
+        } else if (op == AE_URING_OP_RECV) {
+            int more = cqe->flags & IORING_CQE_F_MORE;
+
+            /* received for a previous user of this fd number */
+            if ((int32_t)(gen - st->ogen) < 0) {
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                    aeUringRecycle(state, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                continue;
+            }
+
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                if (res > 0)
+                    aeUringAppend(state, fd, cqe->flags >> IORING_CQE_BUFFER_SHIFT, res);
+                else
+                    aeUringRecycle(state, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+
+            if (!more && gen == st->rgen && st->rmode == AE_URING_RECV) {
+                st->rmode = AE_URING_NONE;
+                aeUringMarkDirty(state, fd);
+
+                /* out of buffers, otherwise EOF or an error ( or recv not
+                 * supported at all ): read(2) will tell the handler */
+                if (res == -ENOBUFS)
+                    st->pollonce = 1;
+                else if (res <= 0)
+                    st->norecv = 1;
+                aeUringReport(eventLoop, fd, GB_READABLE, &numevents);
+            } else if (res > 0) {
+                aeUringReport(eventLoop, fd, GB_READABLE, &numevents);
+            }
+        }
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+
+    /* data a handler did not read entirely, or received while the fd was
+     * not readable */
+    for (i = 0; i < state->nready; i++) {
+        int fd = state->ready[i];
+
+        state->fds[fd].ready = 0;
+        if (state->fds[fd].head != -1)
+            aeUringReport(eventLoop, fd, GB_READABLE, &numevents);
+    }
+    state->nready = 0;
+
+    return numevents;
+}
+
+char *aeApiName(void) {
+    return aeUringAvailable == -1 ? "epoll" : "io_uring";
+}
+#else
+void AVOID_EMPTY_UNIT_WARNING_BY_GCC_IO_URING(){ }
+#endif
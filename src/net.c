@@ -37,6 +37,7 @@
 #include "log.h"
 #include "query.h"
 #include "endianness.h"
+#include "query.h"
 
 #include <stdio.h>
 #include <sys/time.h>
@@ -67,6 +68,9 @@
 #ifdef HAVE_EVPORT
 #include "mux/evport.c"
 #else
+#ifdef HAVE_IO_URING
+#include "mux/io_uring.c"
+#else
 #ifdef HAVE_EPOLL
 #include "mux/epoll.c"
 #else
@@ -77,6 +81,7 @@
 #endif
 #endif
 #endif
+#endif
 
 gbEventLoop *gbCreateEventLoop(int setsize)
 {
@@ -232,6 +237,34 @@ int gbGetFileEvents(gbEventLoop *eventLoop, int fd)
     return fe->mask;
 }
 
+/* Read from a file descriptor with a GB_READABLE event, like read(2) but
+ * the multiplexing layer might have already received the data for us. */
+ssize_t gbReadFileEvent(gbEventLoop *eventLoop, int fd, void *buf, size_t count)
+{
+    assert( eventLoop != NULL );
+    assert( buf != NULL );
+
+#ifdef AE_API_READ
+    if (fd < eventLoop->setsize)
+        return aeApiRead(eventLoop, fd, buf, count);
+#endif
+    return read(fd, buf, count);
+}
+
+/* Delete every event of the file descriptor and close it, dropping what
+ * was received for it and not read yet. */
+void gbCloseFileEvent(gbEventLoop *eventLoop, int fd)
+{
+    assert( eventLoop != NULL );
+
+    gbDeleteFileEvent(eventLoop, fd, GB_READABLE | GB_WRITABLE);
+#ifdef AE_API_READ
+    if (fd < eventLoop->setsize)
+        aeApiClose(eventLoop, fd);
+#endif
+    close(fd);
+}
+
 static void gbGetTime(long *seconds, long *milliseconds)
 {
     assert( seconds != NULL );
@@ -911,16 +944,34 @@ static int gbNetListen(char *err, int s, struct sockaddr *sa, socklen_t len)
     return GBNET_OK;
 }
 
-int gbNetTcpServer(char *err, int port, char *bindaddr)
+static int gbNetTcpGenericServer(char *err, int port, char *bindaddr, int reuseport)
 {
     assert( bindaddr != NULL );
 
-    int s;
+    int s, yes = 1;
     struct sockaddr_in sa;
 
     if ((s = gbNetCreateSocket(err,AF_INET)) == GBNET_ERR)
         return GBNET_ERR;
 
+    // let several sockets listen on the same port, the kernel will balance
+    // incoming connections across them
+    if (reuseport)
+    {
+#ifdef SO_REUSEPORT
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1)
+        {
+            gbNetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+            close(s);
+            return GBNET_ERR;
+        }
+#else
+        gbNetSetError(err, "SO_REUSEPORT not supported");
+        close(s);
+        return GBNET_ERR;
+#endif
+    }
+
     memset(&sa,0,sizeof(sa));
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
@@ -936,6 +987,16 @@ int gbNetTcpServer(char *err, int port, char *bindaddr)
     return s;
 }
 
+int gbNetTcpServer(char *err, int port, char *bindaddr)
+{
+    return gbNetTcpGenericServer(err, port, bindaddr, 0);
+}
+
+int gbNetTcpReusePortServer(char *err, int port, char *bindaddr)
+{
+    return gbNetTcpGenericServer(err, port, bindaddr, 1);
+}
+
 int gbNetUnixServer(char *err, char *path, mode_t perm)
 {
     assert( path != NULL );
@@ -1087,14 +1148,27 @@ gbClient* gbClientCreate( int fd, gbServer *server  )
 
     assert( client != NULL );
 
-    client->fd 			= fd;
-    client->buffer 		= NULL;
-    client->buffer_size = 0;
-    client->status		= STATUS_WAITING_SIZE;
-    client->read 		= 0;
-    client->wrote 		= 0;
-    client->server 		= server;
-    client->shutdown 	= 0;
+    client->fd 			 = fd;
+    client->rbuffer 	 = NULL;
+    client->rbuffer_size = 0;
+    client->read 		 = 0;
+    client->buffer 		 = NULL;
+    client->buffer_size  = 0;
+    client->wbuffer 	 = NULL;
+    client->wbuffer_size = 0;
+    client->wbuffer_len  = 0;
+    client->segments 	 = NULL;
+    client->segments_size = 0;
+    client->nsegments 	 = 0;
+    client->segment 	 = 0;
+    client->wrote 		 = 0;
+    client->marks 		 = NULL;
+    client->marks_size 	 = 0;
+    client->nmarks 		 = 0;
+    client->mark 		 = 0;
+    client->received 	 = 0;
+    client->server 		 = server;
+    client->shutdown 	 = 0;
 
     ll_append( server->clients, client );
 
@@ -1107,16 +1181,24 @@ void gbClientReset( gbClient *client )
 {
     assert( client != NULL );
 
-    if( client->buffer != NULL )
+    // keep the output buffer around for the next replies unless
+    // a big response made it grow over the usual size
+    if( client->wbuffer != NULL && client->wbuffer_size > GBNET_IO_CHUNK_SIZE )
     {
-        zfree( client->buffer );
+        zfree( client->wbuffer );
+
+        client->wbuffer 	 = NULL;
+        client->wbuffer_size = 0;
     }
 
-    client->buffer      = NULL;
-    client->buffer_size = 0;
-    client->status		= STATUS_WAITING_SIZE;
-    client->read 		= 0;
+    assert( client->segment == client->nsegments );
+
+    client->wbuffer_len = 0;
+    client->nsegments 	= 0;
+    client->segment 	= 0;
     client->wrote 		= 0;
+    client->nmarks 		= 0;
+    client->mark 		= 0;
     client->shutdown 	= 0;
 }
 
@@ -1127,19 +1209,47 @@ void gbClientDestroy( gbClient *client )
 
     gbServer *server = client->server;
 
-    if( client->buffer != NULL )
+    if( client->rbuffer != NULL )
     {
-        zfree( client->buffer );
-        client->buffer = NULL;
+        zfree( client->rbuffer );
+        client->rbuffer = NULL;
+    }
+
+    if( client->wbuffer != NULL )
+    {
+        zfree( client->wbuffer );
+        client->wbuffer = NULL;
+    }
+
+    if( client->segments != NULL )
+    {
+        // release items pinned by replies we won't send anymore
+        for( ; client->segment < client->nsegments; ++client->segment )
+        {
+            gbReplySegment *seg = &client->segments[client->segment];
+            if( seg->item )
+            {
+                gbServerLock( seg->server );
+                gbItemUnpin( seg->server, seg->item, seg->data, seg->size );
+                gbServerUnlock( seg->server );
+            }
+        }
+
+        zfree( client->segments );
+        client->segments = NULL;
+    }
+
+    if( client->marks != NULL )
+    {
+        zfree( client->marks );
+        client->marks = NULL;
     }
 
     if (client->fd != -1)
     {
         assert( server->events != NULL );
 
-        gbDeleteFileEvent( server->events, client->fd, GB_READABLE );
-        gbDeleteFileEvent( server->events, client->fd, GB_WRITABLE );
-        close(client->fd);
+        gbCloseFileEvent( server->events, client->fd );
     }
 
     ll_item_t *item = NULL;
@@ -1159,49 +1269,149 @@ void gbClientDestroy( gbClient *client )
     zfree( client );
 }
 
-int gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, uint32_t size, gbFileProc *proc, short shutdown )
+static gbReplySegment *gbClientPushSegment( gbClient *client )
 {
     assert( client != NULL );
-    assert( reply != NULL );
-    assert( size > 0 );
 
-    if( client->fd <= 0 ) return GB_ERR;
+    if( client->nsegments == client->segments_size )
+    {
+        client->segments_size = client->segments_size ? client->segments_size * 2 : 16;
+        client->segments	  = zrealloc( client->segments, client->segments_size * sizeof(gbReplySegment) );
 
-    uint32_t rsize = sizeof( short )  + // reply opcode
-        sizeof( gbItemEncoding ) +      // data type
-        sizeof( uint32_t ) + 	        // data length
-        size;			  		        // data
+        assert( client->segments != NULL );
+    }
+
+    return &client->segments[ client->nsegments++ ];
+}
+
+// Reserve size bytes at the end of the output buffer.
+static byte_t *gbClientReserve( gbClient *client, uint32_t size )
+{
+    assert( client != NULL );
+    assert( size > 0 );
+
+    gbReplySegment *seg = NULL;
+    byte_t *p = NULL;
 
     // realloc only if needed
-    if( rsize > client->buffer_size )
+    if( client->wbuffer_len + size > client->wbuffer_size )
+    {
+        uint32_t needed = client->wbuffer_len + size;
+
+        client->wbuffer_size = client->wbuffer_size ? client->wbuffer_size : GBNET_IO_CHUNK_SIZE;
+        while( client->wbuffer_size < needed )
+        {
+            client->wbuffer_size *= 2;
+        }
+
+        client->wbuffer = (byte_t *)zrealloc( client->wbuffer, client->wbuffer_size );
+    }
+
+    assert( client->wbuffer != NULL );
+
+    // bytes are appended sequentially, so just grow the last chunk if it's
+    // in the output buffer too
+    seg = client->nsegments ? &client->segments[ client->nsegments - 1 ] : NULL;
+    if( seg == NULL || seg->item != NULL )
     {
-        client->buffer = (byte_t *)zrealloc( client->buffer, rsize );
+        seg = gbClientPushSegment( client );
+
+        seg->item   = NULL;
+        seg->server = NULL;
+        seg->data   = NULL;
+        seg->offset = client->wbuffer_len;
+        seg->size   = 0;
     }
 
-    assert( client->buffer != NULL );
+    p = client->wbuffer + client->wbuffer_len;
 
-    client->buffer_size = rsize;
-    client->read  		= 0;
-    client->wrote 		= 0;
-    client->shutdown 	= shutdown;
+    seg->size			+= size;
+    client->wbuffer_len += size;
 
-    memcpy( client->buffer,
+    return p;
+}
+
+#define GBNET_REPLY_HEADER_SIZE ( sizeof( short ) + sizeof( gbItemEncoding ) + sizeof( uint32_t ) )
+
+static void gbClientWriteHeader( byte_t *p, short code, gbItemEncoding encoding, uint32_t size )
+{
+    memcpy( p,
             memrev16ifbe(&code),
             sizeof( short ) );
 
-    memcpy( client->buffer + sizeof( short ),
+    memcpy( p + sizeof( short ),
             &encoding,
             sizeof( gbItemEncoding ) );
 
-    memcpy( client->buffer + sizeof( short ) + sizeof( gbItemEncoding ),
+    memcpy( p + sizeof( short ) + sizeof( gbItemEncoding ),
             memrev32ifbe(&size),
             sizeof( uint32_t ) );
+}
+
+static int gbClientEnqueueHeader( gbClient *client, short code, gbItemEncoding encoding, uint32_t size, short shutdown )
+{
+    assert( client != NULL );
+    assert( size > 0 );
+
+    if( client->fd <= 0 ) return GB_ERR;
+
+    gbClientWriteHeader( gbClientReserve( client, GBNET_REPLY_HEADER_SIZE ), code, encoding, size );
+
+    client->shutdown |= shutdown;
+
+    return GB_OK;
+}
+
+// Append a reply to the client output buffer, the read handler will flush
+// every reply queued while processing a batch of pipelined requests with
+// a single write and will only install a writable event if the socket can
+// not take it all.
+int gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, uint32_t size, gbFileProc *proc, short shutdown )
+{
+    assert( client != NULL );
+    assert( reply != NULL );
+    assert( size > 0 );
+
+    if( gbClientEnqueueHeader( client, code, encoding, size, shutdown ) != GB_OK )
+    {
+        return GB_ERR;
+    }
+
+    memcpy( gbClientReserve( client, size ), reply, size );
+
+    return GB_OK;
+}
+
+// Drop everything queued past the first len bytes of the output buffer.
+void gbClientTruncateOutput( gbClient *client, uint32_t len )
+{
+    assert( client != NULL );
+    assert( len <= client->wbuffer_len );
+
+    gbReplySegment *seg = NULL;
+    uint32_t drop = client->wbuffer_len - len;
+
+    while( drop > 0 )
+    {
+        assert( client->nsegments > client->segment );
+
+        seg = &client->segments[ client->nsegments - 1 ];
+
+        assert( seg->item == NULL );
 
-    memcpy( client->buffer + sizeof( short ) + sizeof( gbItemEncoding ) + sizeof( uint32_t ),
-            reply,
-            size );
+        if( seg->size > drop )
+        {
+            seg->size -= drop;
+            drop = 0;
+        }
+        else
+        {
+            drop -= seg->size;
+            --client->nsegments;
+        }
+    }
 
-    return gbCreateFileEvent( client->server->events, client->fd, GB_WRITABLE, proc, client );
+    client->wbuffer_len = len;
 }
 
 int gbClientEnqueueCode( gbClient *client, short code, gbFileProc proc, short shutdown )
@@ -1217,11 +1427,36 @@ int gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc
 {
     assert( client != NULL );
     assert( item != NULL );
-    assert( item->data != NULL || item->encoding == GB_ENC_NUMBER );
+    assert( item->data != NULL || item->encoding == GB_ENC_NUMBER || item->encoding == GB_ENC_INLINE );
     assert( item->size > 0 );
 
-    if( item->encoding == GB_ENC_PLAIN )
+    if( item->encoding == GB_ENC_INLINE )
     {
+        return gbClientEnqueueData( client, code, GB_ENC_PLAIN, gbItemBuffer( item ), item->size, proc, shutdown );
+    }
+    else if( item->encoding == GB_ENC_PLAIN )
+    {
+        // big values are not copied, the reply references the item buffer
+        // and the item is pinned until it's sent
+        if( item->size >= GBNET_ZERO_COPY_MIN_SIZE && gbItemPin( item ) )
+        {
+            if( gbClientEnqueueHeader( client, code, GB_ENC_PLAIN, item->size, shutdown ) != GB_OK )
+            {
+                gbItemUnpin( client->server, item, item->data, item->size );
+                return GB_ERR;
+            }
+
+            gbReplySegment *seg = gbClientPushSegment( client );
+
+            seg->item   = item;
+            seg->server = client->server;
+            seg->data   = item->data;
+            seg->offset = 0;
+            seg->size   = item->size;
+
+            return GB_OK;
+        }
+
         return gbClientEnqueueData( client, code, GB_ENC_PLAIN, item->data, item->size, proc, shutdown );
     }
     else if( item->encoding == GB_ENC_LZF )
@@ -1253,90 +1488,149 @@ int gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc
         return GBNET_ERR;
 }
 
-int gbClientEnqueueKeyValueSet( gbClient *client, uint32_t elements, gbFileProc *proc, short shutdown )
+// Start a REPL_KVAL reply, its header is written by gbClientEndKeyValueSet.
+void gbClientBeginKeyValueSet( gbClient *client, gbKeyValueWriter *writer )
 {
     assert( client != NULL );
-    assert( client->server != NULL );
-    assert( elements > 0 );
-    assert( client->server->m_buffer != NULL );
+    assert( writer != NULL );
 
-    gbServer *server = client->server;
-    gbItem *item = NULL;
-    uint32_t sz = sizeof(uint32_t),
-             vsize = 0,
-             space = server->limits.maxresponsesize;
-    byte_t *data = server->m_buffer,
-           *p = data,
-           *v = NULL;
-    gbItemEncoding encoding;
-    long num;
+    writer->client   = client;
+    writer->start    = client->wbuffer_len;
+    writer->size     = sizeof(uint32_t);
+    writer->elements = 0;
+    writer->overflow = 0;
 
-#define CHECK_SPACE(needed) if( needed > space ) \
-    { \
-        gbLog( WARNING, "Max response size reached, asked for %u more bytes.", needed ); \
-            return GBNET_ERR; \
-    }
+    gbClientReserve( client, GBNET_REPLY_HEADER_SIZE + sizeof(uint32_t) );
+}
 
-#define SAFE_MEMCPY( p, data, size ) CHECK_SPACE(size); memcpy( p, data, size ); p += size; space -= size
+int gbClientAppendKeyValue( gbKeyValueWriter *writer, unsigned char *key, uint32_t klen, gbItemEncoding encoding, byte_t *v, uint32_t vsize )
+{
+    assert( writer != NULL );
+    assert( key != NULL );
+    assert( v != NULL );
+    assert( vsize > 0 );
 
-    SAFE_MEMCPY( p, memrev32ifbe(&elements), sz );
+    uint32_t needed = sizeof(uint32_t) + klen + sizeof(gbItemEncoding) + sizeof(uint32_t) + vsize,
+             n = 0;
+    byte_t *p = NULL;
 
-    ll_foreach_2( server->m_keys, server->m_values, ki, vi )
+    if( writer->overflow || writer->size + needed > writer->client->server->limits.maxresponsesize )
     {
-        // handle expired/nulled items
-        if( vi->data != NULL )
-        {
-            item 	 = vi->data;
-            encoding = item->encoding;
+        if( writer->overflow == 0 )
+            gbLog( WARNING, "Max response size reached, asked for %u more bytes.", needed );
 
-            // write key size + key
-            sz = strlen( ki->data );
+        writer->overflow = 1;
 
-            assert( sz > 0 );
+        return GBNET_ERR;
+    }
 
-            SAFE_MEMCPY( p, memrev32ifbe(&sz), sizeof(uint32_t) );
-            SAFE_MEMCPY( p, ki->data, sz );
+    p = gbClientReserve( writer->client, needed );
 
-            // write value size + value
-            if( encoding == GB_ENC_PLAIN )
-            {
-                vsize = item->size;
-                v	  = item->data;
-            }
-            else if( encoding == GB_ENC_LZF )
-            {
-                encoding = GB_ENC_PLAIN;
-                vsize = lzf_decompress
-                    (
-                     item->data,
-                     item->size,
-                     client->server->lzf_buffer,
-                     client->server->limits.maxrequestsize
-                    );
-
-                v = server->lzf_buffer;
-            }
-            else if( item->encoding == GB_ENC_NUMBER )
-            {
-                num = (long)item->data;
+    n = klen;
+    memcpy( p, memrev32ifbe(&n), sizeof(uint32_t) );
+    p += sizeof(uint32_t);
+
+    memcpy( p, key, klen );
+    p += klen;
+
+    memcpy( p, &encoding, sizeof(gbItemEncoding) );
+    p += sizeof(gbItemEncoding);
+
+    n = vsize;
+    memcpy( p, memrev32ifbe(&n), sizeof(uint32_t) );
+    p += sizeof(uint32_t);
+
+    memcpy( p, v, vsize );
+
+    writer->size += needed;
+    ++writer->elements;
+
+    return GBNET_OK;
+}
+
+int gbClientAppendKeyItem( gbKeyValueWriter *writer, unsigned char *key, uint32_t klen, gbItem *item )
+{
+    assert( writer != NULL );
+    assert( item != NULL );
+
+    gbServer *server = writer->client->server;
+    size_t declen = 0;
+    long num;
+
+    if( item->encoding == GB_ENC_LZF )
+    {
+        declen = lzf_decompress
+        (
+            item->data,
+            item->size,
+            server->lzf_buffer,
+            server->limits.maxrequestsize
+        );
+
+        assert( declen > item->size );
+
+        return gbClientAppendKeyValue( writer, key, klen, GB_ENC_PLAIN, server->lzf_buffer, declen );
+    }
+    else if( item->encoding == GB_ENC_NUMBER )
+    {
+        num = (long)item->data;
 #if __x86_64__ || __ppc64__
-                v = (byte_t *)memrev64ifbe(&num);
+        return gbClientAppendKeyValue( writer, key, klen, GB_ENC_NUMBER, (byte_t *)memrev64ifbe(&num), item->size );
 #else
-                v = (byte_t *)memrev32ifbe(&num);
+        return gbClientAppendKeyValue( writer, key, klen, GB_ENC_NUMBER, (byte_t *)memrev32ifbe(&num), item->size );
 #endif
-                vsize = item->size;
-            }
+    }
 
-            assert( v != NULL );
-            assert( vsize > 0 );
+    return gbClientAppendKeyValue( writer, key, klen, GB_ENC_PLAIN, gbItemBuffer( item ), item->size );
+}
 
-            SAFE_MEMCPY( p, &encoding,            sizeof( gbItemEncoding ) );
-            SAFE_MEMCPY( p, memrev32ifbe(&vsize), sizeof( uint32_t ) );
-            SAFE_MEMCPY( p, v, 		              vsize );
-        }
+/*
+ * Complete the reply, or drop it replying with REPL_ERR_NOT_FOUND if it's
+ * empty and with an error if it grew past maxresponsesize.
+ */
+int gbClientEndKeyValueSet( gbKeyValueWriter *writer, gbFileProc *proc, short shutdown )
+{
+    assert( writer != NULL );
+
+    gbClient *client = writer->client;
+    uint32_t elements = writer->elements;
+
+    if( writer->overflow || elements == 0 || client->fd <= 0 )
+    {
+        gbClientTruncateOutput( client, writer->start );
+
+        if( writer->overflow || client->fd <= 0 )
+            return GBNET_ERR;
+
+        return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, proc, shutdown );
     }
 
-    int ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, data, p - data, proc, shutdown );
+    gbClientWriteHeader( client->wbuffer + writer->start, REPL_KVAL, GB_ENC_PLAIN, writer->size );
+
+    memcpy( client->wbuffer + writer->start + GBNET_REPLY_HEADER_SIZE, memrev32ifbe(&elements), sizeof(uint32_t) );
+
+    client->shutdown |= shutdown;
+
+    return GBNET_OK;
+}
+
+// Reply with the pairs of the m_keys and m_values lists.
+int gbClientEnqueueKeyValueSet( gbClient *client, gbFileProc *proc, short shutdown )
+{
+    assert( client != NULL );
+    assert( client->server != NULL );
+
+    gbServer *server = client->server;
+    gbKeyValueWriter writer;
+
+    gbClientBeginKeyValueSet( client, &writer );
+
+    ll_foreach_2_sparse( server->m_keys, server->m_values, ki, vi )
+    {
+        // handle expired/nulled items
+        if( vi->data != NULL )
+            gbClientAppendKeyItem( &writer, ki->data, strlen( ki->data ), vi->data );
+    }
 
-    return ret;
+    return gbClientEndKeyValueSet( &writer, proc, shutdown );
 }
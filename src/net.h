@@ -36,9 +36,13 @@
 #include <stdint.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "obpool.h"
+#include "slab.h"
 #include "trie.h"
 #include "llist.h"
+#include "expire.h"
+#include "histogram.h"
 #include "default.h"
 
 #if defined(__sun)
@@ -169,6 +173,16 @@ typedef struct
 	unsigned int nitems;
 	// number of compressed items
 	unsigned int ncompressed;
+	// number of items with a GB_ENC_INLINE value
+	unsigned int ninlined;
+	// memory saved by inline values compared to a separate allocation
+	unsigned long inline_saved;
+	// number of items referencing a shared value buffer
+	unsigned int nshared;
+	// memory saved by shared buffers compared to a copy for every item
+	unsigned long shared_saved;
+	// number of items evicted to free memory
+	unsigned long nevicted;
 	// number of currently connected clients
 	unsigned int nclients;
 	// number of cron loops performed
@@ -186,6 +200,11 @@ typedef struct
 }
 gbServerStats;
 
+// free items not accessed in the last 'gc_ratio' seconds
+#define GB_EVICT_GC  0x00
+// free the least recently used items when new data is stored
+#define GB_EVICT_LRU 0x01
+
 typedef struct gbServer
 {
 	// the main event loop structure
@@ -216,49 +235,145 @@ typedef struct gbServer
 	unsigned long compression;
 	// buffer used for lzf (de)compression, alloc'd only once
 	byte_t *lzf_buffer;
-	// static lists used for multi-* operands
+	// static lists used for the STATS reply
 	llist_t *m_keys;
 	llist_t *m_values;
-	// buffer used to send multi get responses
-	byte_t *m_buffer;
-    // gbItem object pool allocator
+    // volatile gbItem object pool allocator, stored items live in the tree leaves
     opool_t item_pool;
+    // allocator of the PLAIN and LZF item buffers
+    slab_t   slab;
+    // pending replies count of the buffers their item dropped while still
+    // sending them, by buffer address
+    htable_t orphans;
 	// cron timed event id
 	long long cron_id;
 	// data that is not being accessed in the last 'gc_ratio' seconds get deleted if the server needs memory.
     time_t	 gc_ratio;
     // check for expired items every 'expired_cron' seconds.
     unsigned long expired_cron;
+    // maximum number of expired items to free for each cron cycle.
+    unsigned long expired_cron_limit;
+    // 1 if the last cycle left some expired items behind.
+    int      expired_pending;
+    // items with a TTL ordered by expiration time.
+    gbExpireIndex expire;
     // check if max memory usage is reached every 'max_mem_cron' seconds.
     unsigned long max_mem_cron;
+    // policy used to free memory when max_memory is reached, one of GB_EVICT_*.
+    int      evict_policy;
+    // key the eviction CLOCK hand is pointing to.
+    tr_iter_t lru_hand;
+    // gbServerClock time the CLOCK hand started its current lap.
+    uint32_t lru_lap;
+    // key the 'gc' policy sweep is at, the sweep goes on across cron loops.
+    tr_iter_t gc_hand;
+    // 1 while memory is being freed by the cron.
+    int      gc_pending;
+    // microseconds of expiration and memory freeing work per cron loop, 0 for no limit.
+    unsigned long cron_budget;
+    // 1 if keys are indexed by a hash table too.
+    int      hash_index;
+    // 1 if the slab allocator moves empty pages between its classes.
+    int      slab_rebalance;
 	// flag to say the server to shutdown ASAP
 	int		 shutdown;
 	// plain configuration instance
 	trie_t	 config;
+	// every worker of the process, the keyspace is sharded across them
+	struct gbServer **workers;
+	// number of workers ( worker_threads )
+	int		 nworkers;
+	// index of this worker inside the workers array, 0 is the main one
+	int		 worker_id;
+	// thread running this worker event loop
+	pthread_t thread;
+	// lock of this worker keyspace shard, only used with more than one worker
+	pthread_mutex_t lock;
+	// per opcode latency from a request being received to its reply being sent
+	gbHistogram *latency;
+	// per opcode time spent processing requests
+	gbHistogram *handling;
 
 	gbServerLimits limits;
 	gbServerStats stats;
 }
 gbServer;
 
-#define STATUS_WAITING_SIZE   0x00
-#define STATUS_WAITING_BUFFER 0x01
-#define STATUS_SENDING_REPLY  0x02
+#define gbServerLock(s)   do { if( (s)->nworkers > 1 ) pthread_mutex_lock( &(s)->lock ); } while(0)
+#define gbServerUnlock(s) do { if( (s)->nworkers > 1 ) pthread_mutex_unlock( &(s)->lock ); } while(0)
+
+// a chunk of the client output, either bytes queued into the output buffer
+// or the buffer of an item pinned until it's sent ( zero copy replies )
+typedef struct
+{
+	// pinned item or NULL if the chunk lives in the output buffer
+	struct gbItem *item;
+	// worker owning the pinned item
+	struct gbServer *server;
+	// item buffer being sent
+	byte_t   *data;
+	// offset of the chunk inside the output buffer
+	uint32_t  offset;
+	// chunk size
+	uint32_t  size;
+}
+gbReplySegment;
+
+// where the reply to a request ends in the client output, used to time the
+// request once it's been sent
+typedef struct
+{
+	// request opcode
+	short	  op;
+	// index of the output chunk holding the end of the reply
+	uint32_t  segment;
+	// offset of the end of the reply inside that chunk
+	uint32_t  end;
+	// time the request was received
+	uint64_t  received;
+}
+gbLatencyMark;
 
 typedef struct gbClient
 {
 	// main client file descriptor
 	int		  fd;
-	// client request/response buffer
+	// input buffer, may hold several pipelined requests
+	byte_t   *rbuffer;
+	// input buffer allocated size
+	uint32_t  rbuffer_size;
+	// number of bytes currently read into the input buffer
+	uint32_t  read;
+	// request currently being processed ( points inside the input buffer )
 	byte_t   *buffer;
-	// client request/response buffer size
+	// size of the request currently being processed
 	uint32_t  buffer_size;
-	// number of bytes currently read
-	uint32_t  read;
-	// number of bytes currently wrote
+	// output buffer, replies are appended here and flushed together
+	byte_t   *wbuffer;
+	// output buffer allocated size
+	uint32_t  wbuffer_size;
+	// number of bytes queued into the output buffer
+	uint32_t  wbuffer_len;
+	// output chunks in the order they have to be sent
+	gbReplySegment *segments;
+	// output chunks allocated size
+	uint32_t  segments_size;
+	// number of output chunks queued
+	uint32_t  nsegments;
+	// index of the first chunk not completely sent yet
+	uint32_t  segment;
+	// number of bytes of the current chunk already wrote
 	uint32_t  wrote;
-	// client read status
-	byte_t	  status;
+	// replies waiting to be sent to be timed
+	gbLatencyMark *marks;
+	// latency marks allocated size
+	uint32_t  marks_size;
+	// number of latency marks queued
+	uint32_t  nmarks;
+	// index of the first mark whose reply is not sent yet
+	uint32_t  mark;
+	// time of the last read from the client
+	uint64_t  received;
 	// last time this client was seen alive
 	time_t    seen;
 	// pointer to the main server structure
@@ -276,25 +391,74 @@ typedef unsigned char gbItemEncoding;
 #define GB_ENC_LZF    0x01
 // the item contains a number and data pointer is actually that number
 #define GB_ENC_NUMBER 0x02
+// PLAIN but the buffer is stored inside the item slot itself, starting at
+// the data field, it's sent to clients as PLAIN
+#define GB_ENC_INLINE 0x03
 
-typedef struct
+typedef struct gbItem
 {
-	// the item buffer
-	void  		  *data;
 	// the item buffer size
 	uint32_t 	   size;
-	// the item encoding
-	gbItemEncoding encoding;
+	// times are seconds since stats.started, see gbServerClock
 	// time the item was last accessed
-	time_t	       last_access_time;
+	uint32_t	   last_access_time;
 	// time the item was created
-	time_t		   time;
-	// TTL of this item
-	short		   ttl;
-	// flag to lock the item
-	time_t		   lock;
+	uint32_t	   time;
+	// time the item expires at, 0 if it has no TTL
+	uint32_t	   expire;
+	// TTL the item expire time was set with
+	uint32_t	   ttl;
+	// time the item stays locked until, 0 if it's not locked
+	uint32_t	   lock;
+	// position + 1 of the item inside the expire index, 0 if not indexed
+	uint32_t	   expire_slot;
+	// number of pending replies still sending the item buffer
+	uint16_t       refs;
+	// the item encoding
+	gbItemEncoding encoding;
+	// GB_ITEM_* flags
+	uint8_t        flags;
+	// the item buffer, last so GB_ENC_INLINE values can overlap it
+	void  		  *data;
+}
+gbItem;
+
+#define GB_ITEM_REFS_MAX  0xFFFF
+// the item buffer is shared with other items, see gbSharedAlloc
+#define GB_ITEM_SHARED    0x01
+
+// gbItem lock value of an item locked until it's unlocked
+#define GB_ITEM_LOCKED_FOREVER UINT32_MAX
+
+// current time in seconds since the server started, the gbItem time unit
+#define gbServerClock(server) ( (uint32_t)( (server)->stats.time - (server)->stats.started ) )
+
+// values up to this size are stored inline as GB_ENC_INLINE
+#define GB_ITEM_INLINE_SIZE 24
+// size of the item slot of the tree leaves, with room for an inline value
+#define GB_ITEM_SLOT_SIZE ( sizeof(gbItem) - sizeof(void *) + GB_ITEM_INLINE_SIZE )
+
+// the value buffer of a PLAIN, LZF or INLINE item
+#define gbItemBuffer(item) ( (item)->encoding == GB_ENC_INLINE ? (byte_t *)&(item)->data : (byte_t *)(item)->data )
+
+// 1 once the gbTimeNs() 'deadline' has passed ( never if 0 ), the clock is only read every GB_CRON_BUDGET_CHECK steps
+#define gbDeadlineReached( deadline, step ) ( (deadline) && ( (step) % GB_CRON_BUDGET_CHECK ) == 0 && gbTimeNs() >= (deadline) )
+
+// a REPL_KVAL reply written into the client output a pair at a time, so
+// that M* operators don't collect their matches first, see gbClientBeginKeyValueSet
+typedef struct
+{
+	gbClient *client;
+	// offset of the reply inside the output buffer
+	uint32_t  start;
+	// size of the reply data so far, bounded by maxresponsesize
+	uint32_t  size;
+	// number of pairs written
+	uint32_t  elements;
+	// 1 once a pair did not fit in maxresponsesize
+	byte_t    overflow;
 }
-__attribute__((packed)) gbItem;
+gbKeyValueWriter;
 
 gbEventLoop *gbCreateEventLoop(int setsize);
 void gbDeleteEventLoop(gbEventLoop *eventLoop);
@@ -302,6 +466,8 @@ void gbStopEventLoop(gbEventLoop *eventLoop);
 int gbCreateFileEvent(gbEventLoop *eventLoop, int fd, int mask,gbFileProc *proc, void *clientData);
 void gbDeleteFileEvent(gbEventLoop *eventLoop, int fd, int mask);
 int gbGetFileEvents(gbEventLoop *eventLoop, int fd);
+ssize_t gbReadFileEvent(gbEventLoop *eventLoop, int fd, void *buf, size_t count);
+void gbCloseFileEvent(gbEventLoop *eventLoop, int fd);
 long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,gbTimeProc *proc, void *clientData,gbEventFinalizerProc *finalizerProc);
 int gbDeleteTimeEvent(gbEventLoop *eventLoop, long long id);
 int gbProcessEvents(gbEventLoop *eventLoop, int flags);
@@ -319,6 +485,7 @@ int gbNetUnixNonBlockConnect(char *err, char *path);
 int gbNetRead(int fd, char *buf, int count);
 int gbNetResolve(char *err, char *host, char *ipbuf);
 int gbNetTcpServer(char *err, int port, char *bindaddr);
+int gbNetTcpReusePortServer(char *err, int port, char *bindaddr);
 int gbNetUnixServer(char *err, char *path, mode_t perm);
 int gbNetTcpAccept(char *err, int serversock, char *ip, int *port);
 int gbNetUnixAccept(char *err, int serversock);
@@ -335,9 +502,14 @@ void gbServerFormatUptime( gbServer *server, char *s );
 gbClient *gbClientCreate( int fd, gbServer *server );
 void      gbClientReset( gbClient *client );
 int 	  gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, uint32_t size, gbFileProc *proc, short shutdown );
+void      gbClientTruncateOutput( gbClient *client, uint32_t len );
 int       gbClientEnqueueCode( gbClient *client, short code, gbFileProc, short shutdown );
 int		  gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc *proc, short shutdown );
-int		  gbClientEnqueueKeyValueSet( gbClient *client, uint32_t elements, gbFileProc *proc, short shutdown );
+int		  gbClientEnqueueKeyValueSet( gbClient *client, gbFileProc *proc, short shutdown );
+void      gbClientBeginKeyValueSet( gbClient *client, gbKeyValueWriter *writer );
+int       gbClientAppendKeyValue( gbKeyValueWriter *writer, unsigned char *key, uint32_t klen, gbItemEncoding encoding, byte_t *v, uint32_t vsize );
+int       gbClientAppendKeyItem( gbKeyValueWriter *writer, unsigned char *key, uint32_t klen, gbItem *item );
+int       gbClientEndKeyValueSet( gbKeyValueWriter *writer, gbFileProc *proc, short shutdown );
 void	  gbClientDestroy( gbClient *client );
 
 #endif
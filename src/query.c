@@ -31,8 +31,10 @@
 #include "trie.h"
 #include "lzf.h"
 #include "configure.h"
+#include "endianness.h"
 
 #define min(a,b) ( a < b ? a : b )
+#define max(a,b) ( a > b ? a : b )
 
 extern void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 
@@ -90,8 +92,12 @@ static gbItem *gbCreateVolatileItem( gbServer *server, void *data, size_t size,
     item->encoding = encoding;
     item->time	   = 0;
     item->last_access_time	= 0;
-    item->ttl	   = -1;
+    item->expire   = 0;
+    item->ttl	   = 0;
+    item->expire_slot = 0;
     item->lock	   = 0;
+    item->refs	   = 0;
+    item->flags	   = 0;
 
     return item;
 }
@@ -110,22 +116,117 @@ static void gbDestroyVolatileItem( gbServer *server, gbItem *item )
     opool_free_object( &server->item_pool, item );
 }
 
-static gbItem *gbCreateItem( gbServer *server, void *data, size_t size, gbItemEncoding encoding, int ttl )
+// Memory a GB_ENC_INLINE value of 'size' bytes saves, the slab buffer it
+// would need otherwise, since every item slot has room for it.
+static size_t gbInlineSaving( size_t size )
+{
+    return size < SLAB_MIN_SIZE ? SLAB_MIN_SIZE : size;
+}
+
+/*
+ * Immutable value buffers referenced by many items, so that an MSET stores
+ * the value only once. Their reference count lives right before the bytes
+ * the items point to, and any change of an item value replaces its buffer,
+ * so a key modified later gets a private copy.
+ */
+#define GB_SHARED_HEADER sizeof(uint64_t)
+#define gbSharedRefs(data) ( (uint64_t *)(data) - 1 )
+
+// Copy 'size' bytes of 'data' into a new shared buffer with no references yet.
+static byte_t *gbSharedAlloc( gbServer *server, void *data, size_t size )
 {
     assert( server != NULL );
-    assert( size == 0 || data != NULL );
+    assert( data != NULL );
 
-    gbItem *item = ( gbItem * )opool_alloc_object( &server->item_pool );
+    byte_t *buffer = (byte_t *)slab_alloc( &server->slab, GB_SHARED_HEADER + size ) + GB_SHARED_HEADER;
+
+    *gbSharedRefs( buffer ) = 0;
+
+    memcpy( buffer, data, size );
+
+    return buffer;
+}
+
+// Drop a reference to the shared buffer, freeing it once it was the last one.
+static void gbSharedRelease( gbServer *server, byte_t *data, size_t size )
+{
+    assert( server != NULL );
+    assert( data != NULL );
+    assert( *gbSharedRefs( data ) > 0 );
+
+    if( --*gbSharedRefs( data ) == 0 )
+    {
+        slab_free( &server->slab, gbSharedRefs( data ), GB_SHARED_HEADER + size );
+    }
+    else
+    {
+        server->stats.shared_saved -= size;
+    }
+
+    --server->stats.nshared;
+}
 
+/*
+ * Create the item inside the tree leaf of a tr_upsert slot, storing a copy
+ * of 'data' or 'data' itself if it's a GB_ENC_NUMBER, or a reference to it
+ * if it's a gbSharedAlloc buffer and 'shared' is set. Unless the leaf was
+ * just created, its previous item is destroyed and the slot reused.
+ */
+static gbItem *gbCreateItemAt( gbServer *server, tr_slot_t *slot, gbItem *item, int created, void *data, size_t size, gbItemEncoding encoding, int shared )
+{
+    assert( server != NULL );
+    assert( slot != NULL );
     assert( item != NULL );
+    assert( size == 0 || data != NULL );
+    assert( encoding != GB_ENC_INLINE || size <= GB_ITEM_INLINE_SIZE );
+    assert( !shared || encoding == GB_ENC_PLAIN || encoding == GB_ENC_LZF );
+
+    tr_resize_slot( &server->tree, slot, (long)size - ( created ? 0 : (long)item->size ) );
+
+    if( !created )
+    {
+        gbDestroyItem( server, item );
+    }
+
+    item->flags = 0;
+
+    if( encoding == GB_ENC_INLINE )
+    {
+        memcpy( &item->data, data, size );
+
+        ++server->stats.ninlined;
+        server->stats.inline_saved += gbInlineSaving( size );
+    }
+    else if( encoding == GB_ENC_NUMBER )
+    {
+        item->data = data;
+    }
+    else if( shared )
+    {
+        item->data   = data;
+        item->flags |= GB_ITEM_SHARED;
+
+        if( (*gbSharedRefs( data ))++ > 0 )
+            server->stats.shared_saved += size;
+
+        ++server->stats.nshared;
+    }
+    else
+    {
+        item->data = slab_alloc( &server->slab, size );
+
+        memcpy( item->data, data, size );
+    }
 
-    item->data 	           = data;
     item->size 	           = size;
     item->encoding         = encoding;
     item->time             =
-    item->last_access_time = server->stats.time;
-    item->ttl	           = ttl;
+    item->last_access_time = gbServerClock(server);
+    item->expire           =
+    item->ttl	           = 0;
+    item->expire_slot      = 0;
     item->lock	           = 0;
+    item->refs             = 0;
 
     if( encoding == GB_ENC_LZF )
     {
@@ -145,6 +246,114 @@ static gbItem *gbCreateItem( gbServer *server, void *data, size_t size, gbItemEn
     return item;
 }
 
+// Create the item of the key, see gbCreateItemAt.
+static gbItem *gbCreateItem( gbServer *server, unsigned char *key, size_t klen, void *data, size_t size, gbItemEncoding encoding, int shared )
+{
+    assert( server != NULL );
+    assert( key != NULL );
+
+    tr_slot_t slot;
+    int created = 0;
+    gbItem *item = tr_upsert( &server->tree, key, klen, &slot, &created );
+
+    return gbCreateItemAt( server, &slot, item, created, data, size, encoding, shared );
+}
+
+/*
+ * Release the item buffer, unless a pending reply is still sending it. In
+ * that case its pins move to the orphans, since the item slot could be gone
+ * or reused by the time the replies are done, and gbItemUnpin frees it.
+ */
+static void gbItemFreeData( gbServer *server, gbItem *item )
+{
+    assert( server != NULL );
+    assert( item != NULL );
+    assert( item->encoding != GB_ENC_NUMBER );
+
+    if( item->encoding == GB_ENC_INLINE )
+    {
+        --server->stats.ninlined;
+        server->stats.inline_saved -= gbInlineSaving( item->size );
+    }
+    else if( item->data != NULL && item->refs != 0 )
+    {
+        ht_add( &server->orphans, (unsigned char *)&item->data, sizeof(item->data), (void *)(uintptr_t)item->refs );
+
+        item->refs = 0;
+    }
+    else if( item->data != NULL && ( item->flags & GB_ITEM_SHARED ) )
+    {
+        gbSharedRelease( server, item->data, item->size );
+    }
+    else if( item->data != NULL )
+    {
+        slab_free( &server->slab, item->data, item->size );
+    }
+
+    item->data   = NULL;
+    item->flags &= ~GB_ITEM_SHARED;
+}
+
+int gbItemPin( gbItem *item )
+{
+    assert( item != NULL );
+
+    // shared buffers are sent by copy, their sharers would otherwise mix up
+    // each other's pins once one of them drops the buffer
+    if( item->encoding != GB_ENC_PLAIN || ( item->flags & GB_ITEM_SHARED ) || item->refs == GB_ITEM_REFS_MAX )
+    {
+        return 0;
+    }
+
+    ++item->refs;
+
+    return 1;
+}
+
+void gbItemUnpin( gbServer *server, gbItem *item, byte_t *data, uint32_t size )
+{
+    assert( server != NULL );
+    assert( item != NULL );
+
+    uintptr_t refs = 0;
+
+    // the buffer was dropped by a destroy or a conversion while pinned, the item is not ours anymore
+    if( ht_size( &server->orphans ) && ( refs = (uintptr_t)ht_find( &server->orphans, (unsigned char *)&data, sizeof(data) ) ) != 0 )
+    {
+        if( refs > 1 )
+        {
+            ht_set( &server->orphans, (unsigned char *)&data, sizeof(data), (void *)( refs - 1 ) );
+        }
+        else
+        {
+            ht_remove( &server->orphans, (unsigned char *)&data, sizeof(data) );
+            slab_free( &server->slab, data, size );
+
+            server->stats.memused = zmem_used();
+        }
+    }
+    else
+    {
+        assert( item->refs > 0 );
+        assert( item->data == data );
+
+        --item->refs;
+    }
+}
+
+// Weight of the item inside the tree counters, the size of its stored value.
+size_t gbItemWeight( void *item )
+{
+    assert( item != NULL );
+
+    return ((gbItem *)item)->size;
+}
+
+/*
+ * Release everything the item owns, its slot belongs to the tree leaf of the
+ * key and goes away with it, so the key is removed after this, which reads
+ * the item size as its weight.
+ */
 void gbDestroyItem( gbServer *server, gbItem *item )
 {
     assert( server != NULL );
@@ -155,50 +364,196 @@ void gbDestroyItem( gbServer *server, gbItem *item )
         --server->stats.ncompressed;
     }
 
-    if( item->encoding != GB_ENC_NUMBER && item->data != NULL )
+    gbExpireRemove( &server->expire, item );
+
+    if( item->encoding != GB_ENC_NUMBER )
     {
-        zfree( item->data );
-        item->data = NULL;
+        gbItemFreeData( server, item );
     }
 
-    opool_free_object( &server->item_pool, item );
-
     server->stats.memused = zmem_used();
     server->stats.nitems -= 1;
     server->stats.sizeavg = server->stats.nitems == 0 ? 0 : server->stats.memused / server->stats.nitems;
 }
 
-static int gbItemIsLocked( gbItem *item, gbServer *server, time_t eta )
+// Destroy the item of the key and remove the key from the tree.
+static void gbRemoveItem( gbServer *server, gbItem *item, unsigned char *key, size_t klen )
+{
+    assert( server != NULL );
+    assert( item != NULL );
+
+    gbDestroyItem( server, item );
+
+    tr_remove( &server->tree, key, klen );
+}
+
+static void gbItemSetTtl( gbServer *server, gbItem *item, unsigned char *key, size_t klen, long ttl )
 {
+    assert( server != NULL );
     assert( item != NULL );
+
+    if( ttl > 0 )
+    {
+        item->ttl    = min( server->limits.maxitemttl, ttl );
+        item->expire = gbServerClock(server) + item->ttl;
+
+        gbExpireSet( &server->expire, item, key, klen, server->stats.started + item->expire );
+    }
+    else
+    {
+        item->ttl    =
+        item->expire = 0;
+
+        gbExpireRemove( &server->expire, item );
+    }
+}
+
+// Lock the item for 'locktime' seconds, or until it's unlocked if -1.
+static void gbItemSetLock( gbServer *server, gbItem *item, long locktime )
+{
     assert( server != NULL );
+    assert( item != NULL );
+
+    uint32_t now = gbServerClock(server);
 
-    eta = eta == 0 ? server->stats.time - item->time : eta;
-    return ( item->lock == -1 || eta < item->lock );
+    if( locktime == -1 )
+        item->lock = GB_ITEM_LOCKED_FOREVER;
+
+    else if( locktime > 0 )
+        item->lock = now + min( locktime, GB_ITEM_LOCKED_FOREVER - 1 - now );
+
+    else
+        item->lock = 0;
 }
 
-static int gbIsNodeStillValid( tnode_t *node, gbItem *item, gbServer *server, int remove )
+static int gbItemIsLocked( gbItem *item, gbServer *server )
 {
-    assert( node != NULL );
     assert( item != NULL );
     assert( server != NULL );
 
-    register time_t eta = server->stats.time - item->time,
-             ttl = item->ttl;
+    return ( item->lock == GB_ITEM_LOCKED_FOREVER || item->lock > gbServerClock(server) );
+}
+
+/*
+ * Approximated LRU eviction with the CLOCK algorithm, the hand moves along
+ * the keys in lexicographic order and frees every item which was not
+ * accessed since its previous lap, until the used memory is below
+ * max_memory or the gbTimeNs() 'deadline' is reached ( 0 for none ).
+ * Return the number of evicted items.
+ */
+size_t gbEvictItems( gbServer *server, uint64_t deadline )
+{
+    assert( server != NULL );
+
+    tnode_t *node = NULL;
+    gbItem *item = NULL;
+    int laps = 0;
+    size_t evicted = 0, steps = 0;
 
-    if( ttl > 0 && eta >= ttl )
+    while( server->stats.nitems && server->stats.memused > server->limits.maxmem && !gbDeadlineReached( deadline, ++steps ) )
     {
-        gbLog( DEBUG, "[ACCESS] TTL of %ds expired for item at %p.", ttl, item );
+        node = tr_iter_next( &server->tree, &server->lru_hand );
 
-        if( remove )
-            node->data = NULL;
+        // end of the tree, start a new lap unless only locked items are left
+        if( node == NULL )
+        {
+            if( ++laps > 2 )
+                break;
 
-        gbDestroyItem( server, item );
+            server->lru_lap = gbServerClock(server);
+            continue;
+        }
 
-        return 0;
+        item = node->data;
+
+        // accessed after the lap started, give it a second chance
+        if( item->last_access_time > server->lru_lap || gbItemIsLocked( item, server ) )
+            continue;
+
+        gbLog( DEBUG, "[LRU] Evicting item %p not accessed since %us.", item, gbServerClock(server) - item->last_access_time );
+
+        gbRemoveItem( server, item, server->lru_hand.key, server->lru_hand.len );
+
+        ++evicted;
     }
 
-    return 1;
+    server->stats.nevicted += evicted;
+
+    return evicted;
+}
+
+/*
+ * Go on with the 'gc' policy sweep, freeing the items not accessed in the
+ * last gc_ratio seconds, until the gbTimeNs() 'deadline' ( 0 for none ).
+ * Return 1 if the sweep did not reach the end of the tree yet.
+ */
+int gbCollectItems( gbServer *server, uint64_t deadline )
+{
+    assert( server != NULL );
+
+    tnode_t *node = NULL;
+    gbItem *item = NULL;
+    size_t steps = 0;
+    uint32_t eta;
+
+    while( ( node = tr_iter_next( &server->tree, &server->gc_hand ) ) != NULL )
+    {
+        item = node->data;
+        eta  = gbServerClock(server) - item->last_access_time;
+
+        // item is older enough to be deleted
+        if( eta && eta >= server->gc_ratio )
+        {
+            gbLog( DEBUG, "[OOM] Removing item %p since wasn't accessed from %us.", item, eta );
+
+            gbRemoveItem( server, item, server->gc_hand.key, server->gc_hand.len );
+        }
+
+        if( gbDeadlineReached( deadline, ++steps ) )
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Free the items whose TTL is expired, at most 'expired_cron_limit' of them
+ * and until the gbTimeNs() 'deadline' ( 0 for none ), so a mass expiration
+ * can't stall the event loop. Return 1 if some expired items are still left.
+ */
+int gbExpireItems( gbServer *server, uint64_t deadline )
+{
+    assert( server != NULL );
+
+    gbExpireEntry *entry = NULL;
+    gbItem		  *item = NULL;
+    unsigned char *key = NULL;
+    size_t         klen = 0;
+    unsigned long  done = 0;
+
+    while( ( entry = gbExpireTop( &server->expire ) ) && entry->when <= server->stats.time )
+    {
+        if( server->expired_cron_limit && done >= server->expired_cron_limit )
+            return 1;
+
+        else if( gbDeadlineReached( deadline, ++done ) )
+            return 1;
+
+        item = entry->item;
+
+        gbLog( DEBUG, "[CRON] TTL of %us expired for item at %p.", item->ttl, item );
+
+        // the destroy drops the entry, keep its key for the tree removal
+        key  = entry->key;
+        klen = entry->klen;
+        entry->key = NULL;
+
+        gbRemoveItem( server, item, key, klen );
+
+        zfree( key );
+    }
+
+    return 0;
 }
 
 static int gbIsItemStillValid( gbItem *item, gbServer *server, unsigned char *key, size_t klen, int remove )
@@ -208,18 +563,15 @@ static int gbIsItemStillValid( gbItem *item, gbServer *server, unsigned char *ke
     assert( key != NULL );
     assert( klen > 0 );
 
-    register time_t eta = server->stats.time - item->time,
-             ttl = item->ttl;
-
-    if( ttl > 0 && eta >= ttl )
+    if( item->expire && gbServerClock(server) >= item->expire )
     {
-        gbLog( DEBUG, "[ACCESS] TTL of %ds expired for item at %p.", ttl, item );
+        gbLog( DEBUG, "[ACCESS] TTL of %us expired for item at %p.", item->ttl, item );
+
+        gbDestroyItem( server, item );
 
         if( remove )
             tr_remove( &server->tree, key, klen );
 
-        gbDestroyItem( server, item );
-
         return 0;
     }
 
@@ -372,28 +724,34 @@ static int gbParseTtlKeyValue( gbServer *server, byte_t *buffer, size_t size, by
         return 1;
 }
 
-static gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbServer *server )
+/*
+ * Choose how to store the value, compressing it into the lzf_buffer if it's
+ * worth it. The bytes to store and their size are put in 'data' and 'size'.
+ */
+static gbItemEncoding gbEncodeValue( gbServer *server, byte_t *v, size_t vlen, void **data, size_t *size )
 {
+    assert( server != NULL );
     assert( v != NULL );
     assert( vlen > 0 );
-    assert( k != NULL );
-    assert( klen > 0 );
-    assert( server != NULL );
 
     gbItemEncoding encoding = GB_ENC_PLAIN;
-    void *data = v;
     size_t comprlen = vlen, needcompr = vlen - 4; // compress at least of 4 bytes
-    gbItem *item, *old;
 
+    *data = v;
+
+    // small enough to live inside the item slot
+    if( vlen <= GB_ITEM_INLINE_SIZE )
+    {
+        encoding = GB_ENC_INLINE;
+    }
     // should we compress ?
-    if( vlen > server->compression )
+    else if( vlen > server->compression )
     {
         comprlen = lzf_compress( v, vlen, server->lzf_buffer, needcompr );
         // not enough compression
         if( comprlen == 0 )
         {
             encoding = GB_ENC_PLAIN;
-            data	 = zmemdup( v, vlen );
         }
         // succesfully compressed
         else {
@@ -406,22 +764,31 @@ static gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbSe
 
             encoding = GB_ENC_LZF;
             vlen 	 = comprlen;
-            data 	 = zmemdup( server->lzf_buffer, comprlen );
+            *data 	 = server->lzf_buffer;
         }
     }
     else {
         encoding = GB_ENC_PLAIN;
-        data = zmemdup( v, vlen );
     }
 
-    item = gbCreateItem( server, data, vlen, encoding, -1 );
-    old = tr_insert( &server->tree, k, klen, item );
-    if( old )
-    {
-        gbDestroyItem( server, old );
-    }
+    *size = vlen;
 
-    return item;
+    return encoding;
+}
+
+static gbItem *gbSingleSet( byte_t *v, size_t vlen, tr_slot_t *slot, gbItem *item, int created, gbServer *server )
+{
+    assert( v != NULL );
+    assert( vlen > 0 );
+    assert( slot != NULL );
+    assert( item != NULL );
+    assert( server != NULL );
+
+    void *data = NULL;
+    size_t size = 0;
+    gbItemEncoding encoding = gbEncodeValue( server, v, vlen, &data, &size );
+
+    return gbCreateItemAt( server, slot, item, created, data, size, encoding, 0 );
 }
 
 static int gbQuerySetHandler( gbClient *client, byte_t *p )
@@ -435,26 +802,32 @@ static int gbQuerySetHandler( gbClient *client, byte_t *p )
     size_t ttllen = 0, klen = 0, vlen = 0;
     gbServer *server = client->server;
     gbItem *item = NULL;
+    tr_slot_t slot;
+    int created = 0;
     long ttl;
 
+    // make room for the new item instead of rejecting it
+    if( server->evict_policy == GB_EVICT_LRU )
+        gbEvictItems( server, 0 );
+
     if( server->stats.memused <= server->limits.maxmem )
     {
         if( gbParseTtlKeyValue( server, p, client->buffer_size - sizeof(short), &t, &k, &v, &ttllen, &klen, &vlen ) )
         {
             if( gbQueryParseLong( t, ttllen, &ttl ) )
             {
-                item = tr_find( &server->tree, k, klen );
+                // the leaf is found or created once for both the lock check and the set
+                item = tr_upsert( &server->tree, k, klen, &slot, &created );
                 // locked item
-                if( item && gbItemIsLocked( item, server, 0 ) )
+                if( !created && gbItemIsLocked( item, server ) )
                 {
                     return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
                 }
 
-                item = gbSingleSet( v, vlen, k, klen, server );
+                item = gbSingleSet( v, vlen, &slot, item, created, server );
                 if( ttl > 0 )
                 {
-                    item->time = server->stats.time;
-                    item->ttl  = min( server->limits.maxitemttl, ttl );
+                    gbItemSetTtl( server, item, k, klen, ttl );
                 }
 
                 return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
@@ -471,12 +844,16 @@ static int gbQuerySetHandler( gbClient *client, byte_t *p )
 
 typedef struct {
     gbServer *server;
-    byte_t *value;
-    size_t vlen;
+    // the value as it's stored, encoded once for every key
+    void *data;
+    size_t size;
+    gbItemEncoding encoding;
+    // shared buffer every matched key references, allocated on the first match
+    byte_t *shared;
 }
 multi_set_ctx_t;
 
-static int gbMultiSetCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiSetCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
     assert( ctx != NULL );
     assert( key != NULL );
     assert( data != NULL );
@@ -485,19 +862,29 @@ static int gbMultiSetCallback( void *ctx, unsigned char *key, void *data ) {
 
     gbServer *server = setctx->server;
     gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
 
     if( !item ){
         return 0;
     }
-    else if( gbItemIsLocked( item, server, 0 ) ){
+    else if( gbItemIsLocked( item, server ) ){
         return 0;
     }
     else if( gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ){
         return 0;
     }
 
-    gbSingleSet( setctx->value, setctx->vlen, key, keylen, server );
+    // inline values live in the item slot anyway
+    if( setctx->encoding == GB_ENC_INLINE )
+    {
+        gbCreateItem( server, key, keylen, setctx->data, setctx->size, setctx->encoding, 0 );
+    }
+    else
+    {
+        if( setctx->shared == NULL )
+            setctx->shared = gbSharedAlloc( server, setctx->data, setctx->size );
+
+        gbCreateItem( server, key, keylen, setctx->shared, setctx->size, setctx->encoding, 1 );
+    }
 
     return 1;
 }
@@ -513,15 +900,17 @@ static int gbQueryMultiSetHandler( gbClient *client, byte_t *p )
     gbServer *server = client->server;
     gbItem *item = NULL;
 
+    if( server->evict_policy == GB_EVICT_LRU )
+        gbEvictItems( server, 0 );
+
     if( server->stats.memused <= server->limits.maxmem )
     {
         if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) )
         {
             multi_set_ctx_t ctx = {0};
 
-            ctx.server = server;
-            ctx.value  = v;
-            ctx.vlen   = vlen;
+            ctx.server   = server;
+            ctx.encoding = gbEncodeValue( server, v, vlen, &ctx.data, &ctx.size );
 
             size_t found = tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbMultiSetCallback, &ctx );
             if( found )
@@ -555,9 +944,9 @@ static int gbQueryTtlHandler( gbClient *client, byte_t *p )
         {
             if( gbQueryParseLong( v, vlen, &ttl ) )
             {
-                item->last_access_time =
-                item->time = server->stats.time;
-                item->ttl  = min( server->limits.maxitemttl, ttl );
+                item->last_access_time = gbServerClock(server);
+
+                gbItemSetTtl( server, item, k, klen, ttl );
 
                 return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
             }
@@ -577,7 +966,7 @@ typedef struct {
 }
 multi_ttl_ctx_t;
 
-static int gbMultiTtlCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiTtlCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
     assert( ctx != NULL );
     assert( key != NULL );
     assert( data != NULL );
@@ -586,15 +975,14 @@ static int gbMultiTtlCallback( void *ctx, unsigned char *key, void *data ) {
 
     gbServer *server = (gbServer *)ttlctx->server;
     gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
 
     if( gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ) {
         return 0;
     }
 
-    item->last_access_time =
-    item->time = server->stats.time;
-    item->ttl  = min( server->limits.maxitemttl, ttlctx->ttl );
+    item->last_access_time = gbServerClock(server);
+
+    gbItemSetTtl( server, item, key, keylen, ttlctx->ttl );
 
     return 1;
 }
@@ -647,10 +1035,10 @@ static int gbQueryGetHandler( gbClient *client, byte_t *p )
         node = tr_find_node( &server->tree, k, klen );
         if( node &&                                               // key exists
                 ( item = node->data ) &&                            // value exists
-                gbIsNodeStillValid( node, node->data, server, 1 ) ) // item is not expired
+                gbIsItemStillValid( item, server, k, klen, 1 ) )    // item is not expired
         {
             item = node->data;
-            item->last_access_time = server->stats.time;
+            item->last_access_time = gbServerClock(server);
 
             return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
         }
@@ -662,6 +1050,32 @@ static int gbQueryGetHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
+typedef struct {
+    gbServer *server;
+    gbKeyValueWriter writer;
+}
+multi_get_ctx_t;
+
+// Append every valid item to the reply as the walk finds it.
+static int gbMultiGetCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
+    assert( ctx != NULL );
+    assert( key != NULL );
+    assert( data != NULL );
+
+    multi_get_ctx_t *getctx = (multi_get_ctx_t *)ctx;
+
+    gbServer *server = getctx->server;
+    gbItem *item = (gbItem *)data;
+
+    if( getctx->writer.overflow || gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ) {
+        return 0;
+    }
+
+    item->last_access_time = gbServerClock(server);
+
+    return gbClientAppendKeyItem( &getctx->writer, key, keylen, item ) == GBNET_OK;
+}
+
 static int gbQueryMultiGetHandler( gbClient *client, byte_t *p )
 {
     assert( client != NULL );
@@ -670,7 +1084,6 @@ static int gbQueryMultiGetHandler( gbClient *client, byte_t *p )
     byte_t *expr = NULL, *v = NULL;
     size_t exprlen = 0, vlen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
     long limit = -1;
 
     if( gbParseKeyAndOptionalValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) )
@@ -684,55 +1097,16 @@ static int gbQueryMultiGetHandler( gbClient *client, byte_t *p )
             }
         }
 
-        size_t found = tr_search( &server->tree, expr, exprlen, limit, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-        if( found )
-        {
-            ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-            {
-                item = vi->data;
-
-                if( !item || gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) == 0 )
-                {
-                    --found;
-                    vi->data = NULL;
-                }
-                else
-                    item->last_access_time = server->stats.time;
-            }
-
-            if( found )
-            {
-
-                int ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
-
-                ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-                {
-                    // free allocated key
-                    zfree( ki->data );
-                    ki->data = NULL;
-                }
+        multi_get_ctx_t ctx;
 
-                ll_reset( server->m_keys );
-                ll_reset( server->m_values );
+        ctx.server = server;
 
-                return ret;
-            }
-            else {
-                ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-                {
-                    // free allocated key
-                    zfree( ki->data );
-                    ki->data = NULL;
-                }
+        // pairs go straight into the client output, the key bytes included
+        gbClientBeginKeyValueSet( client, &ctx.writer );
 
-                ll_reset( server->m_keys );
-                ll_reset( server->m_values );
+        tr_search_callback( &server->tree, expr, exprlen, limit, server->limits.maxkeysize, gbMultiGetCallback, &ctx );
 
-                return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
-            }
-        }
-        else
-            return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+        return gbClientEndKeyValueSet( &ctx.writer, gbWriteReplyHandler, 0 );
     }
     else
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
@@ -755,15 +1129,12 @@ static int gbQueryDelHandler( gbClient *client, byte_t *p )
         {
             item = node->data;
 
-            if( gbItemIsLocked( item, server, 0 ) )
+            if( gbItemIsLocked( item, server ) )
                 return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
 
-            else if( gbIsNodeStillValid( node, item, server, 1 ) )
+            else if( gbIsItemStillValid( item, server, k, klen, 1 ) )
             {
-                gbDestroyItem( server, item );
-
-                // Remove item from tree
-                node->data = NULL;
+                gbRemoveItem( server, item, k, klen );
 
                 return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
             }
@@ -775,7 +1146,7 @@ static int gbQueryDelHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbMultiDelCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiDelCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
     assert( ctx != NULL );
     assert( key != NULL );
     assert( data != NULL );
@@ -783,15 +1154,13 @@ static int gbMultiDelCallback( void *ctx, unsigned char *key, void *data ) {
     gbServer *server = (gbServer *)ctx;
     tnode_t *node = (tnode_t *)data;
     gbItem *item = (gbItem *)node->data;
-    size_t keylen = strlen(key);
 
     // locked item
-    if( !item || gbItemIsLocked( item, server, 0 ) ){
+    if( !item || gbItemIsLocked( item, server ) ){
         return 0;
     }
-    else if( gbIsNodeStillValid( node, item, server, 1 ) ){
-        node->data = NULL;
-        gbDestroyItem( server, item );
+    else if( gbIsItemStillValid( item, server, key, keylen, 1 ) ){
+        gbRemoveItem( server, item, key, keylen );
 
         return 1;
     }
@@ -830,35 +1199,29 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta )
     byte_t *k = NULL;
     size_t klen = 0;
     gbServer *server = client->server;
-    tnode_t *node = NULL;
     gbItem *item = NULL;
+    tr_slot_t slot;
+    int created = 0;
     long num = 0;
 
     if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) )
     {
-        node = tr_find_node( &server->tree, k, klen );
-
-        item = node ? node->data : NULL;
-        if( item == NULL )
+        item = tr_upsert( &server->tree, k, klen, &slot, &created );
+        if( created )
         {
-            item = gbCreateItem( server, (void *)1, sizeof( long ), GB_ENC_NUMBER, -1 );
-            // just reuse the node
-            if( node )
-                node->data = item;
-            else
-                tr_insert( &server->tree, k, klen, item );
+            item = gbCreateItemAt( server, &slot, item, created, (void *)1, sizeof( long ), GB_ENC_NUMBER, 0 );
 
             return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
         }
-        else if( gbIsNodeStillValid( node, item, server, 1 ) == 0 )
+        else if( gbIsItemStillValid( item, server, k, klen, 1 ) == 0 )
         {
             return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
         }
         else {
-            if( gbItemIsLocked( item, server, 0 ) )
+            if( gbItemIsLocked( item, server ) )
                 return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
 
-            item->last_access_time = server->stats.time;
+            item->last_access_time = gbServerClock(server);
 
             if( item->encoding == GB_ENC_NUMBER )
             {
@@ -866,12 +1229,13 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta )
 
                 return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
             }
-            else if( item->encoding == GB_ENC_PLAIN && gbQueryParseLong( item->data, item->size, &num ) )
+            else if( ( item->encoding == GB_ENC_PLAIN || item->encoding == GB_ENC_INLINE ) && gbQueryParseLong( gbItemBuffer( item ), item->size, &num ) )
             {
                 num += delta;
 
-                zfree( item->data );
-                item->data = NULL;
+                tr_resize_slot( &server->tree, &slot, (long)sizeof(long) - (long)item->size );
+
+                gbItemFreeData( server, item );
 
                 server->stats.memused = zmem_used();
 
@@ -895,7 +1259,7 @@ typedef struct {
 }
 multi_inc_ctx_t;
 
-static int gbMultiIncDecCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiIncDecCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
     assert( ctx != NULL );
     assert( key != NULL );
     assert( data != NULL );
@@ -904,27 +1268,27 @@ static int gbMultiIncDecCallback( void *ctx, unsigned char *key, void *data ) {
 
     gbServer *server = (gbServer *)incctx->server;
     gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
     long num = 0;
 
-    if( !item || gbItemIsLocked( item, server, 0 ) ){
+    if( !item || gbItemIsLocked( item, server ) ){
         return 0;
     }
     if( gbIsItemStillValid( item, server, key, keylen, 1 ) == 0 ) {
         return 0;
     }
 
-    item->last_access_time = server->stats.time;
+    item->last_access_time = gbServerClock(server);
 
     if( item->encoding == GB_ENC_NUMBER ) {
         item->data = (void *)( (long)item->data + incctx->delta );
     }
-    else if( item->encoding == GB_ENC_PLAIN ) {
-        if( gbQueryParseLong( item->data, item->size, &num ) ) {
+    else if( item->encoding == GB_ENC_PLAIN || item->encoding == GB_ENC_INLINE ) {
+        if( gbQueryParseLong( gbItemBuffer( item ), item->size, &num ) ) {
             num += incctx->delta;
 
-            zfree( item->data );
-            item->data = NULL;
+            tr_resize( &server->tree, key, keylen, (long)sizeof(long) - (long)item->size );
+
+            gbItemFreeData( server, item );
 
             server->stats.memused = zmem_used();
 
@@ -980,16 +1344,15 @@ static int gbQueryLockHandler( gbClient *client, byte_t *p )
     if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, &v, &klen, &vlen ) )
     {
         node = tr_find_node( &server->tree, k, klen );
-        if( node && ( item = node->data ) && gbIsNodeStillValid( node, item, server, 1 ) )
+        if( node && ( item = node->data ) && gbIsItemStillValid( item, server, k, klen, 1 ) )
         {
             if( gbQueryParseLong( v, vlen, &locktime ) )
             {
-                item->last_access_time = server->stats.time;
+                item->last_access_time = gbServerClock(server);
 
-                if( gbItemIsLocked( item, server, 0 ) == 0 )
+                if( gbItemIsLocked( item, server ) == 0 )
                 {
-                    item->time = server->stats.time;
-                    item->lock = locktime;
+                    gbItemSetLock( server, item, locktime );
 
                     return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
                 }
@@ -1012,7 +1375,7 @@ typedef struct {
 }
 multi_lock_ctx_t;
 
-static int gbMultiLockCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiLockCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
     assert( ctx != NULL );
     assert( key != NULL );
     assert( data != NULL );
@@ -1021,13 +1384,12 @@ static int gbMultiLockCallback( void *ctx, unsigned char *key, void *data ) {
 
     gbServer *server = (gbServer *)mlockctx->server;
     gbItem *item = (gbItem *)data;
-    size_t keylen = strlen(key);
 
-    if( gbIsItemStillValid( item, server, key, keylen, 1 ) && gbItemIsLocked( item, server, 0 ) == 0 )
+    if( gbIsItemStillValid( item, server, key, keylen, 1 ) && gbItemIsLocked( item, server ) == 0 )
     {
-        item->last_access_time =
-        item->time = server->stats.time;
-        item->lock = mlockctx->locktime;
+        item->last_access_time = gbServerClock(server);
+
+        gbItemSetLock( server, item, mlockctx->locktime );
 
         return 1;
     }
@@ -1080,10 +1442,10 @@ static int gbQueryUnlockHandler( gbClient *client, byte_t *p )
     if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) )
     {
         node = tr_find_node( &server->tree, k, klen );
-        if( node && ( item = node->data ) && gbIsNodeStillValid( node, item, server, 1 ) )
+        if( node && ( item = node->data ) && gbIsItemStillValid( item, server, k, klen, 1 ) )
         {
             item->lock = 0;
-            item->last_access_time = server->stats.time;
+            item->last_access_time = gbServerClock(server);
 
             return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
         }
@@ -1094,7 +1456,7 @@ static int gbQueryUnlockHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbMultiUnlockCallback( void *ctx, unsigned char *key, void *data ) {
+static int gbMultiUnlockCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
     assert( ctx != NULL );
     assert( key != NULL );
     assert( data != NULL );
@@ -1102,10 +1464,10 @@ static int gbMultiUnlockCallback( void *ctx, unsigned char *key, void *data ) {
     gbServer *server = (gbServer *)ctx;
     gbItem *item = (gbItem *)data;
 
-    if( item && gbIsItemStillValid( item, server, key, strlen(key), 1 ) )
+    if( item && gbIsItemStillValid( item, server, key, keylen, 1 ) )
     {
         item->lock = 0;
-        item->last_access_time = server->stats.time;
+        item->last_access_time = gbServerClock(server);
 
         return 1;
     }
@@ -1136,27 +1498,13 @@ static int gbQueryMultiUnlockHandler( gbClient *client, byte_t *p )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbCountCallback( void *ctx, unsigned char *key, void *data ) {
-    assert( ctx != NULL );
-    assert( key != NULL );
-    assert( data != NULL );
-
-    gbServer *server = (gbServer *)ctx;
-    gbItem *item = (gbItem *)data;
-
-    if( !item || !gbIsItemStillValid( item, server, key, strlen(key), 1 ) ){
-        return 0;
-    }
-    else {
-        item->last_access_time = server->stats.time;
-
-        return 1;
-    }
-
-    return 1;
-}
-
-static int gbQueryCountHandler( gbClient *client, byte_t *p )
+/*
+ * Reply with the number of keys starting with the prefix ( COUNT ) or with
+ * the size of their values ( SIZE ), both come from the subtree counters of
+ * the tree so no key is visited. They are approximate, the items whose TTL
+ * is over are counted until the cron collects them.
+ */
+static int gbQueryCountHandler( gbClient *client, short op, byte_t *p )
 {
     assert( client != NULL );
     assert( p != NULL );
@@ -1168,28 +1516,157 @@ static int gbQueryCountHandler( gbClient *client, byte_t *p )
 
     if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
     {
-        size_t found = tr_count( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbCountCallback, server );
+        size_t bytes = 0, found = tr_count_prefix( &server->tree, expr, exprlen, &bytes );
 
-        return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+        if( op == OP_SIZE )
+            return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&bytes, sizeof(size_t), gbWriteReplyHandler, 0 );
+        else
+            return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
     }
     else
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-static int gbQueryStatsHandler( gbClient *client, byte_t *p )
+// names used for the per opcode STATS keys
+static const char *gbOpcodeNames[ OP_LAST + 1 ] =
+{
+    NULL, "set", "ttl", "get", "del", "inc", "dec", "lock", "unlock",
+    "mset", "mttl", "mget", "mdel", "minc", "mdec", "mlock", "munlock",
+    "count", "stats", "ping", "meta", "keys", "resetstats", "scan", "size",
+    "mgetrange", "keysrange", "countrange"
+};
+
+#define GB_STAT_NAME_SIZE 64
+
+static int gbQueryResetStatsHandler( gbClient *client, byte_t *p )
 {
     assert( client != NULL );
     assert( p != NULL );
 
     gbServer *server = client->server;
-    size_t elems = 0;
-    char s[0xFF] = {0};
+    int i, op;
+
+    // histograms can be reset while their worker records into them
+    for( i = 0; i < server->nworkers; ++i )
+    {
+        for( op = 1; op <= OP_LAST; ++op )
+        {
+            gbHistogramReset( &server->workers[i]->latency[op] );
+            gbHistogramReset( &server->workers[i]->handling[op] );
+        }
+    }
+
+    return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+}
+
+static int gbQueryStatsHandler( gbClient *client, byte_t *p )
+{
+    assert( client != NULL );
+    assert( p != NULL );
 
-#define APPEND_LONG_STAT( key, value ) ++elems; \
+    gbServer *server = client->server,
+             *worker = NULL;
+    gbServerStats stats = server->stats;
+    size_t trie_nodes = 0,
+           trie_mem = 0,
+           index_mem = 0,
+           pool_used = 0,
+           pool_capacity = 0,
+           pool_total_capacity = 0,
+           trie_leaves = 0,
+           slab_mem = 0,
+           slab_free_pages = 0,
+           slab_moved = 0;
+    slab_class_t classes[SLAB_MAX_CLASSES], *cls = NULL;
+    uint32_t c, nclasses = 0;
+    double sizesum = 0.0,
+           comprsum = 0.0;
+    int    i, op, ncompr = 0;
+    char s[0xFF] = {0},
+         *names = NULL,
+         *name = NULL;
+    gbHistogram *hists = NULL;
+
+    stats.nitems      =
+    stats.ncompressed =
+    stats.ninlined    =
+    stats.inline_saved =
+    stats.nshared     =
+    stats.shared_saved =
+    stats.nevicted    =
+    stats.nclients    =
+    stats.connections =
+    stats.requests    = 0;
+
+    memset( classes, 0x00, sizeof(classes) );
+
+    // sum up the counters of every worker, locking one shard at a time
+    for( i = 0; i < server->nworkers; ++i )
+    {
+        worker = server->workers[i];
+
+        gbServerLock( worker );
+
+        if( worker->stats.firstin && ( stats.firstin == 0 || worker->stats.firstin < stats.firstin ) )
+            stats.firstin = worker->stats.firstin;
+
+        stats.lastin       = max( stats.lastin,  worker->stats.lastin );
+        stats.memused      = max( stats.memused, worker->stats.memused );
+        stats.mempeak      = max( stats.mempeak, worker->stats.mempeak );
+        stats.nitems      += worker->stats.nitems;
+        stats.ncompressed += worker->stats.ncompressed;
+        stats.ninlined    += worker->stats.ninlined;
+        stats.inline_saved += worker->stats.inline_saved;
+        stats.nshared     += worker->stats.nshared;
+        stats.shared_saved += worker->stats.shared_saved;
+        stats.nevicted    += worker->stats.nevicted;
+        stats.nclients    += worker->stats.nclients;
+        stats.connections += worker->stats.connections;
+        stats.requests    += worker->stats.requests;
+
+        sizesum += worker->stats.sizeavg * worker->stats.nitems;
+        if( worker->stats.compravg )
+        {
+            comprsum += worker->stats.compravg;
+            ++ncompr;
+        }
+
+        trie_nodes          += worker->tree.n_nodes;
+        trie_mem            += worker->tree.mem;
+        trie_leaves         += worker->tree.n_leaves;
+        index_mem           += worker->tree.index ? worker->tree.index->mem : 0;
+        pool_used           += worker->item_pool.used;
+        pool_capacity       += worker->item_pool.capacity;
+        pool_total_capacity += worker->item_pool.total_capacity;
+        slab_mem            += slab_memory( &worker->slab );
+        slab_free_pages     += worker->slab.nfree_pages;
+        slab_moved          += worker->slab.moved;
+
+        // every worker has the same classes
+        nclasses = worker->slab.nclasses;
+        for( c = 0; c < nclasses; ++c )
+        {
+            classes[c].size       = worker->slab.classes[c].size;
+            classes[c].per_page   = worker->slab.classes[c].per_page;
+            classes[c].pages     += worker->slab.classes[c].pages;
+            classes[c].used      += worker->slab.classes[c].used;
+            classes[c].requested += worker->slab.classes[c].requested;
+        }
+
+        gbServerUnlock( worker );
+    }
+
+    stats.sizeavg  = stats.nitems ? sizesum / stats.nitems : 0;
+    stats.compravg = ncompr ? comprsum / ncompr : 0;
+
+    // m_keys, m_values and the item pool belong to our own shard
+    gbServerLock( server );
+
+#define APPEND_LONG_STAT( key, value ) \
     ll_append( server->m_keys, key ); \
     ll_append( server->m_values, gbCreateVolatileItem( server, (void *)(long)value, sizeof(long), GB_ENC_NUMBER ) )
 
-#define APPEND_STRING_STAT( key, value ) ++elems; \
+#define APPEND_STRING_STAT( key, value ) \
     ll_append( server->m_keys, key ); \
     ll_append( server->m_values, gbCreateVolatileItem( server, zstrdup(value), strlen(value), GB_ENC_PLAIN ) )
 
@@ -1206,34 +1683,101 @@ static int gbQueryStatsHandler( gbClient *client, byte_t *p )
 #endif
 
     APPEND_STRING_STAT( "server_arch", (sizeof(long) == 8) ? "64" : "32" );
-    APPEND_LONG_STAT( "server_started",             server->stats.started );
-    APPEND_LONG_STAT( "server_time",                server->stats.time );
-    APPEND_LONG_STAT( "first_item_seen",            server->stats.firstin );
-    APPEND_LONG_STAT( "last_item_seen",             server->stats.lastin );
-    APPEND_LONG_STAT( "total_items",                server->stats.nitems );
-    APPEND_LONG_STAT( "total_compressed_items",     server->stats.ncompressed );
-    APPEND_LONG_STAT( "total_clients",              server->stats.nclients );
-    APPEND_LONG_STAT( "total_cron_done",            server->stats.crondone );
-    APPEND_LONG_STAT( "total_connections",          server->stats.connections );
-    APPEND_LONG_STAT( "total_requests",             server->stats.requests );
-    APPEND_LONG_STAT( "item_pool_current_used",     server->item_pool.used );
-    APPEND_LONG_STAT( "item_pool_current_capacity", server->item_pool.capacity );
-    APPEND_LONG_STAT( "item_pool_total_capacity",   server->item_pool.total_capacity );
+    APPEND_LONG_STAT( "server_started",             stats.started );
+    APPEND_LONG_STAT( "server_time",                stats.time );
+    APPEND_LONG_STAT( "first_item_seen",            stats.firstin );
+    APPEND_LONG_STAT( "last_item_seen",             stats.lastin );
+    APPEND_LONG_STAT( "total_items",                stats.nitems );
+    APPEND_LONG_STAT( "total_compressed_items",     stats.ncompressed );
+    APPEND_LONG_STAT( "total_evicted_items",        stats.nevicted );
+    APPEND_LONG_STAT( "total_clients",              stats.nclients );
+    APPEND_LONG_STAT( "total_cron_done",            stats.crondone );
+    APPEND_LONG_STAT( "total_connections",          stats.connections );
+    APPEND_LONG_STAT( "total_requests",             stats.requests );
+    APPEND_LONG_STAT( "item_pool_current_used",     pool_used );
+    APPEND_LONG_STAT( "item_pool_current_capacity", pool_capacity );
+    APPEND_LONG_STAT( "item_pool_total_capacity",   pool_total_capacity );
     APPEND_LONG_STAT( "item_pool_object_size",      server->item_pool.object_size );
     APPEND_LONG_STAT( "item_pool_max_block_size",   server->item_pool.max_block_size );
-    APPEND_LONG_STAT( "memory_available",           server->stats.memavail );
+    APPEND_LONG_STAT( "total_inlined_items",        stats.ninlined );
+    APPEND_LONG_STAT( "inline_saved_memory",        stats.inline_saved );
+    APPEND_FLOAT_STAT( "inline_saved_bytes_per_item", stats.ninlined ? stats.inline_saved / (double)stats.ninlined : 0.0 );
+    APPEND_LONG_STAT( "total_shared_items",         stats.nshared );
+    APPEND_LONG_STAT( "shared_saved_memory",        stats.shared_saved );
+    APPEND_LONG_STAT( "slab_memory",                slab_mem );
+    APPEND_LONG_STAT( "slab_free_pages",            slab_free_pages );
+    APPEND_LONG_STAT( "slab_moved_pages",           slab_moved );
+
+    hists = zmalloc( sizeof(gbHistogram) * 2 );
+    name  = names = zmalloc( ( ( OP_LAST + 1 ) * 10 + SLAB_MAX_CLASSES * 4 ) * GB_STAT_NAME_SIZE );
+
+    // objects and bytes lost to the class rounding and to page tails of every class in use
+#define APPEND_SLAB_STAT( suffix, value ) \
+    snprintf( name, GB_STAT_NAME_SIZE, "slab_%u_%s", cls->size, suffix ); \
+    APPEND_LONG_STAT( name, (value) ); \
+    name += GB_STAT_NAME_SIZE
+
+    for( c = 0; c < nclasses; ++c )
+    {
+        cls = &classes[c];
+        if( cls->pages == 0 )
+            continue;
+
+        APPEND_SLAB_STAT( "pages", cls->pages );
+        APPEND_SLAB_STAT( "used",  cls->used );
+        APPEND_SLAB_STAT( "free",  cls->pages * cls->per_page - cls->used );
+        APPEND_SLAB_STAT( "waste", cls->used * cls->size - cls->requested + cls->pages * ( SLAB_PAGE_SIZE - cls->per_page * cls->size ) );
+    }
+    APPEND_LONG_STAT( "trie_nodes",                 trie_nodes );
+    APPEND_LONG_STAT( "trie_memory",                trie_mem );
+    APPEND_LONG_STAT( "trie_leaves",                trie_leaves );
+    APPEND_LONG_STAT( "trie_leaf_size",             sizeof(tnode_t) + server->tree.leaf_size );
+    APPEND_FLOAT_STAT( "trie_bytes_per_key",        stats.nitems ? trie_mem / (double)stats.nitems : 0.0 );
+    APPEND_LONG_STAT( "hash_index_memory",          index_mem );
+    APPEND_LONG_STAT( "memory_available",           stats.memavail );
     APPEND_LONG_STAT( "memory_usable",              server->limits.maxmem );
-    APPEND_LONG_STAT( "memory_used",                server->stats.memused );
-    APPEND_LONG_STAT( "memory_peak", 			    server->stats.mempeak );
+    APPEND_LONG_STAT( "memory_used",                stats.memused );
+    APPEND_LONG_STAT( "memory_peak", 			    stats.mempeak );
     APPEND_FLOAT_STAT( "memory_fragmentation",      zmem_fragmentation_ratio() );
-    APPEND_LONG_STAT( "item_size_avg",              server->stats.sizeavg );
-    APPEND_LONG_STAT( "compr_rate_avg",             server->stats.compravg );
-    APPEND_FLOAT_STAT( "reqs_per_client_avg",       server->stats.requests / (double)server->stats.connections );
+    APPEND_LONG_STAT( "item_size_avg",              stats.sizeavg );
+    APPEND_LONG_STAT( "compr_rate_avg",             stats.compravg );
+    APPEND_FLOAT_STAT( "reqs_per_client_avg",       stats.requests / (double)stats.connections );
+
+    // latency percentiles of every opcode seen since the last reset, in microseconds
+#define APPEND_LATENCY_STAT( kind, suffix, value ) \
+    snprintf( name, GB_STAT_NAME_SIZE, "%s_%s_%s_us", kind, gbOpcodeNames[op], suffix ); \
+    APPEND_FLOAT_STAT( name, (value) / 1000.0 ); \
+    name += GB_STAT_NAME_SIZE
+
+#define APPEND_LATENCY_STATS( kind, h ) if( (h)->count ) { \
+    APPEND_LATENCY_STAT( kind, "p50",  gbHistogramPercentile( h, 50.0 ) ); \
+    APPEND_LATENCY_STAT( kind, "p90",  gbHistogramPercentile( h, 90.0 ) ); \
+    APPEND_LATENCY_STAT( kind, "p99",  gbHistogramPercentile( h, 99.0 ) ); \
+    APPEND_LATENCY_STAT( kind, "p999", gbHistogramPercentile( h, 99.9 ) ); \
+    APPEND_LATENCY_STAT( kind, "max",  (h)->max ); \
+    }
 
+    for( op = 1; op <= OP_LAST; ++op )
+    {
+        memset( hists, 0x00, sizeof(gbHistogram) * 2 );
+
+        for( i = 0; i < server->nworkers; ++i )
+        {
+            gbHistogramMerge( &hists[0], &server->workers[i]->latency[op] );
+            gbHistogramMerge( &hists[1], &server->workers[i]->handling[op] );
+        }
+
+        APPEND_LATENCY_STATS( "latency", &hists[0] );
+        APPEND_LATENCY_STATS( "handler", &hists[1] );
+    }
+
+#undef APPEND_SLAB_STAT
+#undef APPEND_LATENCY_STATS
+#undef APPEND_LATENCY_STAT
 #undef APPEND_LONG_STAT
 #undef APPEND_STRING_STAT
 
-    int ret = gbClientEnqueueKeyValueSet( client, elems, gbWriteReplyHandler, 0 );
+    int ret = gbClientEnqueueKeyValueSet( client, gbWriteReplyHandler, 0 );
 
     ll_foreach_2( server->m_keys, server->m_values, ki, vi )
     {
@@ -1249,6 +1793,11 @@ static int gbQueryStatsHandler( gbClient *client, byte_t *p )
     ll_reset( server->m_keys );
     ll_reset( server->m_values );
 
+    gbServerUnlock( server );
+
+    zfree( names );
+    zfree( hists );
+
     return ret;
 }
 
@@ -1267,32 +1816,37 @@ static int gbGetItemMeta( gbServer *server, gbItem *item, byte_t *m, size_t mlen
     }
     else if( strncmp( (char *)m, "encoding", min( mlen, 8 ) ) == 0 )
     {
-        *v = item->encoding;
+        // inline values are plain ones as far as clients are concerned
+        *v = item->encoding == GB_ENC_INLINE ? GB_ENC_PLAIN : item->encoding;
         return 1;
     }
     else if( strncmp( (char *)m, "access", min( mlen, 6 ) ) == 0 )
     {
-        *v = item->last_access_time;
+        *v = server->stats.started + item->last_access_time;
         return 1;
     }
     else if( strncmp( (char *)m, "created", min( mlen, 7 ) ) == 0 )
     {
-        *v = item->time;
+        *v = server->stats.started + item->time;
         return 1;
     }
     else if( strncmp( (char *)m, "ttl", min( mlen, 3 ) ) == 0 )
     {
-        *v = item->ttl;
+        *v = item->expire ? item->ttl : -1;
         return 1;
     }
     else if( strncmp( (char *)m, "left", min( mlen, 4 ) ) == 0 )
     {
-        *v = item->ttl <= 0 ? -1 : item->ttl - ( server->stats.time - item->time );
+        *v = item->expire ? (long)item->expire - gbServerClock(server) : -1;
         return 1;
     }
     else if( strncmp( (char *)m, "lock", min( mlen, 4 ) ) == 0 )
     {
-        *v = item->lock;
+        // seconds the item is still locked for
+        if( item->lock == GB_ITEM_LOCKED_FOREVER )
+            *v = -1;
+        else
+            *v = gbItemIsLocked( item, server ) ? item->lock - gbServerClock(server) : 0;
         return 1;
     }
 
@@ -1315,7 +1869,7 @@ static int gbQueryMetaHandler( gbClient *client, byte_t *p )
     if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, &m, &klen, &mlen ) )
     {
         node = tr_find_node( &server->tree, k, klen );
-        if(node && node->data && gbIsNodeStillValid( node, node->data, server, 1 ) )
+        if(node && node->data && gbIsItemStillValid( node->data, server, k, klen, 1 ) )
         {
             item = node->data;
 
@@ -1327,7 +1881,7 @@ static int gbQueryMetaHandler( gbClient *client, byte_t *p )
                 ret = gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
             }
 
-            item->last_access_time = server->stats.time;
+            item->last_access_time = gbServerClock(server);
 
             return ret;
         }
@@ -1338,6 +1892,18 @@ static int gbQueryMetaHandler( gbClient *client, byte_t *p )
     return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
+// Append the key as the value of a pair keyed by its index.
+static int gbKeysCallback( void *ctx, unsigned char *key, int keylen, void *data ) {
+    assert( ctx != NULL );
+    assert( key != NULL );
+
+    gbKeyValueWriter *writer = (gbKeyValueWriter *)ctx;
+    char index[0xFF] = {0};
+    int len = sprintf( index, "%u", writer->elements );
+
+    return gbClientAppendKeyValue( writer, (unsigned char *)index, len, GB_ENC_PLAIN, key, keylen ) == GBNET_OK;
+}
+
 static int gbQueryKeysHandler( gbClient *client, byte_t *p )
 {
     assert( client != NULL );
@@ -1346,59 +1912,222 @@ static int gbQueryKeysHandler( gbClient *client, byte_t *p )
     byte_t *expr = NULL;
     size_t exprlen = 0;
     gbServer *server = client->server;
-    gbItem *item = NULL;
+    gbKeyValueWriter writer;
 
     if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) )
     {
-        size_t found = tr_search( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, &server->m_values, NULL );
-        long unsigned int i;
+        gbClientBeginKeyValueSet( client, &writer );
 
-        if( found )
-        {
-            char index[0xFF] = {0};
-            ll_item_t *key = NULL;
+        tr_search_callback( &server->tree, expr, exprlen, -1, server->limits.maxkeysize, gbKeysCallback, &writer );
 
-            ll_reset( server->m_keys );
-            for( i = 0, key = server->m_values->head; i < found && key; key = key->next, ++i )
-            {
-                sprintf( index, "%lu", i );
-                ll_append( server->m_keys, zstrdup(index) );
-                // convert strings to gbItems
-                key->data = gbCreateVolatileItem( server, key->data, strlen(key->data), GB_ENC_PLAIN );
-            }
+        return gbClientEndKeyValueSet( &writer, gbWriteReplyHandler, 0 );
+    }
+    else
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+}
+
+/*
+ * Parse "<prefix> <count> [<cursor>]", the cursor is the last key returned
+ * by the previous page, so it must be inside the prefix.
+ */
+static int gbParseScanArgs( gbServer *server, byte_t *buffer, size_t size, byte_t **expr, size_t *exprlen, long *count, byte_t **cursor, size_t *cursorlen )
+{
+    assert( server != NULL );
+    assert( buffer != NULL );
 
-            int ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
+    byte_t *v = NULL, *sep = NULL;
+    size_t vlen = 0, clen = 0;
 
-            ll_foreach_2( server->m_keys, server->m_values, ki, vi )
-            {
-                // free volatile item
-                gbDestroyVolatileItem( server, vi->data );
-                // free zstrdup'ed key
-                zfree( ki->data );
-                ki->data = NULL;
-            }
+    if( gbParseKeyAndOptionalValue( server, buffer, size, expr, &v, exprlen, &vlen ) == 0 || v == NULL )
+        return 0;
 
-            ll_reset( server->m_keys );
-            ll_reset( server->m_values );
+    sep  = memchr( v, ' ', vlen );
+    clen = sep ? sep - v : vlen;
 
-            return ret;
+    if( clen == 0 || gbQueryParseLong( v, clen, count ) == 0 || *count <= 0 )
+        return 0;
+
+    *cursor    = sep ? sep + 1 : NULL;
+    *cursorlen = sep ? vlen - clen - 1 : 0;
+
+    if( *cursor && ( *cursorlen < *exprlen || *cursorlen >= server->limits.maxkeysize || memcmp( *cursor, *expr, *exprlen ) != 0 ) )
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Reply with up to 'count' keys of the prefix following the cursor, in key
+ * order. When there are more, the set ends with an entry having an empty key
+ * and the cursor to resume from as value. Only the keys of the page are
+ * visited, so the cost of a call does not depend on the size of the prefix.
+ */
+static int gbQueryScanHandler( gbClient *client, byte_t *p )
+{
+    assert( client != NULL );
+    assert( p != NULL );
+
+    gbServer *server = client->server;
+    byte_t *expr = NULL, *cursor = NULL;
+    size_t exprlen = 0, cursorlen = 0;
+    unsigned char *current = NULL, *next = NULL, *swap = NULL;
+    int curlen = 0, nextlen = 0;
+    tnode_t *node = NULL;
+    gbItem *item = NULL;
+    gbKeyValueWriter writer;
+    long count = 0, found = 0;
+
+    if( gbParseScanArgs( server, p, client->buffer_size - sizeof(short), &expr, &exprlen, &count, &cursor, &cursorlen ) == 0 )
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    current = alloca( server->limits.maxkeysize );
+    next    = alloca( server->limits.maxkeysize );
+
+    gbClientBeginKeyValueSet( client, &writer );
+
+    // tr_next only yields keys after the given one, the prefix itself is checked first
+    if( cursor == NULL )
+    {
+        memcpy( current, expr, exprlen );
+        curlen = exprlen;
+
+        node = tr_find_node( &server->tree, expr, exprlen );
+        if( node && node->data && gbIsItemStillValid( node->data, server, expr, exprlen, 1 ) )
+        {
+            item = node->data;
+            item->last_access_time = gbServerClock(server);
+
+            gbClientAppendKeyItem( &writer, current, curlen, item );
+            ++found;
         }
-        else
-            return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
     }
     else
+    {
+        memcpy( current, cursor, cursorlen );
+        curlen = cursorlen;
+    }
+
+    while( ( node = tr_next( &server->tree, current, curlen, next, server->limits.maxkeysize, &nextlen ) ) != NULL )
+    {
+        // keys are sorted, the first one outside the prefix ends the scan
+        if( nextlen < exprlen || memcmp( next, expr, exprlen ) != 0 )
+            break;
+
+        else if( found == count )
+        {
+            // an empty key marks the cursor to resume from
+            gbClientAppendKeyValue( &writer, (unsigned char *)"", 0, GB_ENC_PLAIN, current, curlen );
+
+            break;
+        }
+
+        swap = current; current = next; next = swap;
+        curlen = nextlen;
+
+        item = node->data;
+        if( gbIsItemStillValid( item, server, current, curlen, 1 ) )
+        {
+            item->last_access_time = gbServerClock(server);
+
+            gbClientAppendKeyItem( &writer, current, curlen, item );
+            ++found;
+        }
+    }
+
+    return gbClientEndKeyValueSet( &writer, gbWriteReplyHandler, 0 );
+}
+
+// Parse "<start> <end> [<limit>]", the keys bounding a range query, both included.
+static int gbParseRangeArgs( gbServer *server, byte_t *buffer, size_t size, byte_t **start, size_t *startlen, byte_t **end, size_t *endlen, long *limit )
+{
+    assert( server != NULL );
+    assert( buffer != NULL );
+
+    byte_t *v = NULL, *sep = NULL;
+    size_t vlen = 0;
+
+    if( gbParseKeyAndOptionalValue( server, buffer, size, start, &v, startlen, &vlen ) == 0 || v == NULL )
+        return 0;
+
+    sep     = memchr( v, ' ', vlen );
+    *end    = v;
+    *endlen = sep ? sep - v : vlen;
+    *limit  = -1;
+
+    if( *startlen >= server->limits.maxkeysize || *endlen == 0 || *endlen >= server->limits.maxkeysize )
+        return 0;
+
+    else if( sep && ( vlen - *endlen - 1 == 0 || gbQueryParseLong( sep + 1, vlen - *endlen - 1, limit ) == 0 ) )
+        return 0;
+
+    // a limit of zero or less means no limit, the shard merge included
+    if( *limit <= 0 )
+        *limit = -1;
+
+    return 1;
+}
+
+/*
+ * Reply with the keys between the given ones in key order, up to the limit,
+ * with their values ( MGETRANGE ) or indexed like KEYS does ( KEYSRANGE ).
+ * Only the part of the tree inside the range is visited.
+ */
+static int gbQueryRangeHandler( gbClient *client, short op, byte_t *p )
+{
+    assert( client != NULL );
+    assert( p != NULL );
+
+    gbServer *server = client->server;
+    byte_t *start = NULL, *end = NULL;
+    size_t startlen = 0, endlen = 0;
+    long limit = -1;
+    multi_get_ctx_t ctx;
+
+    if( gbParseRangeArgs( server, p, client->buffer_size - sizeof(short), &start, &startlen, &end, &endlen, &limit ) == 0 )
         return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    ctx.server = server;
+
+    gbClientBeginKeyValueSet( client, &ctx.writer );
+
+    if( op == OP_MGETRANGE )
+        tr_search_range( &server->tree, start, startlen, end, endlen, limit, server->limits.maxkeysize, gbMultiGetCallback, &ctx );
+    else
+        tr_search_range( &server->tree, start, startlen, end, endlen, limit, server->limits.maxkeysize, gbKeysCallback, &ctx.writer );
+
+    return gbClientEndKeyValueSet( &ctx.writer, gbWriteReplyHandler, 0 );
 }
 
-int gbProcessQuery( gbClient *client )
+/*
+ * Reply with the number of keys between the given ones, up to the limit.
+ * Like COUNT it comes from the tree counters, the expired items which were
+ * not collected yet are counted too.
+ */
+static int gbQueryCountRangeHandler( gbClient *client, byte_t *p )
 {
     assert( client != NULL );
-    assert( client->buffer_size >= sizeof(short) );
+    assert( p != NULL );
 
-    short  op = *(short *)&client->buffer[0];
-    byte_t *p =  client->buffer + sizeof(short);
+    gbServer *server = client->server;
+    byte_t *start = NULL, *end = NULL;
+    size_t startlen = 0, endlen = 0, found = 0;
+    long limit = -1;
+
+    if( gbParseRangeArgs( server, p, client->buffer_size - sizeof(short), &start, &startlen, &end, &endlen, &limit ) == 0 )
+        return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+    found = tr_count_range( &server->tree, start, startlen, end, endlen );
 
-    ++client->server->stats.requests;
+    if( limit > 0 && found > (size_t)limit )
+        found = limit;
+
+    return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+}
+
+static int gbDispatchQuery( gbClient *client, short op, byte_t *p )
+{
+    assert( client != NULL );
+    assert( p != NULL );
 
     if( op == OP_GET )
     {
@@ -1458,7 +2187,7 @@ int gbProcessQuery( gbClient *client )
     }
     else if( op == OP_COUNT )
     {
-        return gbQueryCountHandler( client, p );
+        return gbQueryCountHandler( client, op, p );
     }
     else if( op == OP_STATS )
     {
@@ -1476,6 +2205,26 @@ int gbProcessQuery( gbClient *client )
     {
         return gbQueryKeysHandler( client, p );
     }
+    else if( op == OP_RESETSTATS )
+    {
+        return gbQueryResetStatsHandler( client, p );
+    }
+    else if( op == OP_SCAN )
+    {
+        return gbQueryScanHandler( client, p );
+    }
+    else if( op == OP_SIZE )
+    {
+        return gbQueryCountHandler( client, op, p );
+    }
+    else if( op == OP_MGETRANGE || op == OP_KEYSRANGE )
+    {
+        return gbQueryRangeHandler( client, op, p );
+    }
+    else if( op == OP_COUNTRANGE )
+    {
+        return gbQueryCountRangeHandler( client, p );
+    }
     else if( op == OP_END )
     {
         return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 1 );
@@ -1483,3 +2232,390 @@ int gbProcessQuery( gbClient *client )
     else
         return GB_ERR;
 }
+
+// FNV-1a hash of the key, used to pick the shard owning it.
+static gbServer *gbQueryShard( gbServer *server, short op, byte_t *p, size_t size )
+{
+    assert( server != NULL );
+    assert( p != NULL );
+
+    byte_t  *end = p + size;
+    uint32_t hash = 2166136261U;
+    size_t   i = 0;
+
+    // SET requests start with the TTL
+    if( op == OP_SET )
+    {
+        while( p < end && *p != ' ' ) ++p;
+        ++p;
+    }
+
+    for( ; p < end && *p != ' ' && i < server->limits.maxkeysize; ++p, ++i )
+    {
+        hash = ( hash ^ *p ) * 16777619U;
+    }
+
+    return server->workers[ hash % server->nworkers ];
+}
+
+// Run the query with the shard as the client server, holding its lock.
+static int gbProcessShardQuery( gbClient *client, gbServer *shard, short op, byte_t *p )
+{
+    assert( client != NULL );
+    assert( shard != NULL );
+
+    gbServer *server = client->server;
+    int ret;
+
+    gbServerLock( shard );
+
+    client->server = shard;
+    ret = gbDispatchQuery( client, op, p );
+    client->server = server;
+
+    gbServerUnlock( shard );
+
+    return ret;
+}
+
+#define GB_REPLY_HEADER_SIZE ( sizeof( short ) + sizeof( gbItemEncoding ) + sizeof( uint32_t ) )
+
+static byte_t *gbReadReplyHeader( byte_t *frame, short *code, uint32_t *size )
+{
+    memcpy( code, frame, sizeof( short ) );
+    memcpy( size, frame + sizeof( short ) + sizeof( gbItemEncoding ), sizeof( uint32_t ) );
+
+    (void)memrev16ifbe( code );
+    (void)memrev32ifbe( size );
+
+    return frame + GB_REPLY_HEADER_SIZE;
+}
+
+/*
+ * Read cursor over the key/value set replied by a single shard, 'key' is
+ * what the trie sorted the entry by: the key itself for MGET, the value
+ * for KEYS and KEYSRANGE since their keys are just indexes.
+ */
+typedef struct
+{
+    byte_t  *q;
+    uint32_t left;
+    uint32_t klen;
+    uint32_t size;
+    byte_t  *key;
+    uint32_t keylen;
+}
+gbShardCursor;
+
+static void gbShardCursorLoad( gbShardCursor *c, short op )
+{
+    uint32_t vlen = 0;
+
+    memcpy( &c->klen, c->q, sizeof( uint32_t ) );
+    (void)memrev32ifbe( &c->klen );
+    memcpy( &vlen, c->q + sizeof( uint32_t ) + c->klen + sizeof( gbItemEncoding ), sizeof( uint32_t ) );
+    (void)memrev32ifbe( &vlen );
+
+    c->size = sizeof( uint32_t ) + c->klen + sizeof( gbItemEncoding ) + sizeof( uint32_t ) + vlen;
+
+    if( op == OP_KEYS || op == OP_KEYSRANGE )
+    {
+        c->key	  = c->q + sizeof( uint32_t ) + c->klen + sizeof( gbItemEncoding ) + sizeof( uint32_t );
+        c->keylen = vlen;
+    }
+    else
+    {
+        c->key	  = c->q + sizeof( uint32_t );
+        c->keylen = c->klen;
+    }
+}
+
+static int gbShardCursorCompare( gbShardCursor *a, gbShardCursor *b )
+{
+    int cmp = memcmp( a->key, b->key, min( a->keylen, b->keylen ) );
+
+    return cmp ? cmp : (int)a->keylen - (int)b->keylen;
+}
+
+// Load the next entry of the shard set, 0 if it was a SCAN continuation cursor.
+static int gbShardCursorNext( gbShardCursor *c, short op )
+{
+    gbShardCursorLoad( c, op );
+
+    // the cursor is always the last entry, a shard could only resume from
+    // its own last key, which is now somewhere in the merged set
+    return op != OP_SCAN || c->klen > 0;
+}
+
+/*
+ * Merge the replies queued by every shard for a multi-key operator starting
+ * at 'start' inside the client output buffer into a single one: key/value
+ * sets are joined in key order ( up to the MGET and range limits or the SCAN
+ * count, KEYS indexes are renumbered ), counters are summed up ( COUNTRANGE
+ * ones up to its limit ), otherwise the first error is reported. A SCAN page
+ * ends with a cursor to the last merged key if any shard has more keys past
+ * it.
+ */
+static int gbMergeShardReplies( gbClient *client, short op, byte_t *p, uint32_t start )
+{
+    assert( client != NULL );
+    assert( p != NULL );
+
+    gbServer *server = client->server;
+    byte_t   *frame = NULL,
+             *data = NULL,
+             *merged = NULL,
+             *m = NULL,
+             *expr = NULL,
+             *v = NULL,
+             *last = NULL;
+    short     code = REPL_ERR_NOT_FOUND,
+              error = REPL_ERR_NOT_FOUND;
+    uint32_t  size = 0,
+              elements = 0,
+              nelems = 0;
+    size_t    found = 0,
+              sum = 0,
+              exprlen = 0,
+              optlen = 0,
+              msize = sizeof( uint32_t );
+    uint32_t  lastlen = 0;
+    long      limit = -1;
+    int       nvals = 0,
+              nkvals = 0,
+              ncursors = 0,
+              i = 0,
+              more = 0,
+              ret = GB_OK;
+    char      index[0xFF] = {0};
+    gbShardCursor *cursors = NULL,
+                  *c = NULL;
+
+    for( frame = client->wbuffer + start; frame < client->wbuffer + client->wbuffer_len; frame = data + size )
+    {
+        data = gbReadReplyHeader( frame, &code, &size );
+
+        if( code == REPL_VAL )
+        {
+            assert( size == sizeof( size_t ) );
+
+            memcpy( &found, data, sizeof( size_t ) );
+            sum += found;
+            ++nvals;
+        }
+        else if( code == REPL_KVAL )
+        {
+            memcpy( &nelems, data, sizeof( uint32_t ) );
+            (void)memrev32ifbe( &nelems );
+
+            elements += nelems;
+            // KEYS indexes could get longer once renumbered
+            msize	 += size - sizeof( uint32_t ) + nelems * 10;
+            ++nkvals;
+        }
+        else if( code != REPL_ERR_NOT_FOUND && error == REPL_ERR_NOT_FOUND )
+        {
+            error = code;
+        }
+    }
+
+    if( nkvals )
+    {
+        if( op == OP_MGET && gbParseKeyAndOptionalValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &optlen ) && v && optlen )
+        {
+            gbQueryParseLong( v, optlen, &limit );
+        }
+        else if( op == OP_MGETRANGE || op == OP_KEYSRANGE )
+        {
+            gbParseRangeArgs( server, p, client->buffer_size - sizeof(short), &expr, &exprlen, &v, &optlen, &limit );
+        }
+        else if( op == OP_SCAN )
+        {
+            gbParseScanArgs( server, p, client->buffer_size - sizeof(short), &expr, &exprlen, &limit, &v, &optlen );
+            // room for the continuation cursor
+            msize += sizeof( uint32_t ) + sizeof( gbItemEncoding ) + sizeof( uint32_t ) + server->limits.maxkeysize;
+        }
+
+        merged = m = zmalloc( msize );
+        m += sizeof( uint32_t );
+        elements = 0;
+        cursors = zmalloc( sizeof( gbShardCursor ) * nkvals );
+        ncursors = 0;
+
+        for( frame = client->wbuffer + start; frame < client->wbuffer + client->wbuffer_len; frame = data + size )
+        {
+            data = gbReadReplyHeader( frame, &code, &size );
+            if( code != REPL_KVAL )
+                continue;
+
+            memcpy( &cursors[ncursors].left, data, sizeof( uint32_t ) );
+            (void)memrev32ifbe( &cursors[ncursors].left );
+            cursors[ncursors].q = data + sizeof( uint32_t );
+
+            if( cursors[ncursors].left == 0 )
+                continue;
+
+            else if( gbShardCursorNext( &cursors[ncursors], op ) )
+                ++ncursors;
+
+            else
+                more = 1;
+        }
+
+        // every shard yields its keys in trie order, pick the smallest head
+        // each time so the merged set looks like the one of a single tree
+        while( ncursors && ( limit < 0 || elements < limit ) )
+        {
+            for( i = 1, c = cursors; i < ncursors; ++i )
+            {
+                if( gbShardCursorCompare( &cursors[i], c ) < 0 )
+                    c = &cursors[i];
+            }
+
+            if( op == OP_KEYS || op == OP_KEYSRANGE )
+            {
+                uint32_t ilen = sprintf( index, "%u", elements );
+                uint32_t rlen = ilen;
+
+                memcpy( m, memrev32ifbe( &rlen ), sizeof( uint32_t ) );
+                memcpy( m + sizeof( uint32_t ), index, ilen );
+                m += sizeof( uint32_t ) + ilen;
+
+                memcpy( m, c->q + sizeof( uint32_t ) + c->klen, c->size - sizeof( uint32_t ) - c->klen );
+                m += c->size - sizeof( uint32_t ) - c->klen;
+            }
+            else
+            {
+                last    = m + sizeof( uint32_t );
+                lastlen = c->klen;
+
+                memcpy( m, c->q, c->size );
+                m += c->size;
+            }
+
+            ++elements;
+            c->q += c->size;
+
+            if( --c->left == 0 )
+                *c = cursors[--ncursors];
+
+            else if( gbShardCursorNext( c, op ) == 0 )
+            {
+                more = 1;
+                *c = cursors[--ncursors];
+            }
+        }
+
+        // keys left in any shard, resume after the last merged one
+        if( op == OP_SCAN && elements && ( more || ncursors ) )
+        {
+            uint32_t sz = 0;
+            gbItemEncoding encoding = GB_ENC_PLAIN;
+
+            memcpy( m, &sz, sizeof( uint32_t ) );
+            m += sizeof( uint32_t );
+            memcpy( m, &encoding, sizeof( gbItemEncoding ) );
+            m += sizeof( gbItemEncoding );
+            sz = lastlen;
+            memcpy( m, memrev32ifbe( &sz ), sizeof( uint32_t ) );
+            m += sizeof( uint32_t );
+            memmove( m, last, lastlen );
+            m += lastlen;
+
+            ++elements;
+        }
+
+        zfree( cursors );
+
+        nelems = elements;
+        memcpy( merged, memrev32ifbe( &nelems ), sizeof( uint32_t ) );
+    }
+
+    gbClientTruncateOutput( client, start );
+
+    if( merged && elements )
+    {
+        if( m - merged > server->limits.maxresponsesize )
+        {
+            gbLog( WARNING, "Max response size reached, merged reply is %u bytes.", (uint32_t)( m - merged ) );
+            ret = GB_ERR;
+        }
+        else
+            ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, merged, m - merged, gbWriteReplyHandler, 0 );
+    }
+    else if( nvals )
+    {
+        // every shard counted up to the limit by itself
+        if( op == OP_COUNTRANGE && gbParseRangeArgs( server, p, client->buffer_size - sizeof(short), &expr, &exprlen, &v, &optlen, &limit ) && limit > 0 && sum > (size_t)limit )
+            sum = limit;
+
+        ret = gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&sum, sizeof(size_t), gbWriteReplyHandler, 0 );
+    }
+    else
+        ret = gbClientEnqueueCode( client, error, gbWriteReplyHandler, 0 );
+
+    if( merged )
+        zfree( merged );
+
+    return ret;
+}
+
+int gbProcessQuery( gbClient *client )
+{
+    assert( client != NULL );
+    assert( client->buffer_size >= sizeof(short) );
+
+    gbServer *server = client->server;
+    short  op;
+    byte_t *p =  client->buffer + sizeof(short);
+    uint32_t start = client->wbuffer_len;
+    int i, ret = GB_OK;
+
+    memcpy( &op, client->buffer, sizeof(short) );
+
+    ++server->stats.requests;
+
+    if( server->nworkers == 1 )
+    {
+        return gbDispatchQuery( client, op, p );
+    }
+
+    switch( op )
+    {
+        // these do not touch the keyspace ( STATS locks every shard by itself )
+        case OP_PING:
+        case OP_END:
+        case OP_STATS:
+        case OP_RESETSTATS:
+
+            return gbDispatchQuery( client, op, p );
+
+        // multi-key operators are executed on every shard and merged
+        case OP_MSET:
+        case OP_MTTL:
+        case OP_MGET:
+        case OP_MDEL:
+        case OP_MINC:
+        case OP_MDEC:
+        case OP_MLOCK:
+        case OP_MUNLOCK:
+        case OP_COUNT:
+        case OP_KEYS:
+        case OP_SCAN:
+        case OP_SIZE:
+        case OP_MGETRANGE:
+        case OP_KEYSRANGE:
+        case OP_COUNTRANGE:
+
+            for( i = 0; i < server->nworkers && ret == GB_OK; ++i )
+            {
+                ret = gbProcessShardQuery( client, server->workers[i], op, p );
+            }
+
+            return ret == GB_OK ? gbMergeShardReplies( client, op, p, start ) : ret;
+
+        default:
+
+            return gbProcessShardQuery( client, gbQueryShard( server, op, p, client->buffer_size - sizeof(short) ), op, p );
+    }
+}
@@ -56,6 +56,15 @@
 #define OP_PING    19
 #define OP_META    20
 #define OP_KEYS    21
+#define OP_RESETSTATS 22
+#define OP_SCAN    23
+#define OP_SIZE    24
+// range
+#define OP_MGETRANGE  25
+#define OP_KEYSRANGE  26
+#define OP_COUNTRANGE 27
+// highest opcode but OP_END, the ones timed by the latency stats
+#define OP_LAST    OP_COUNTRANGE
 #define OP_END    0xFF
 
 /*
@@ -70,7 +79,13 @@
 #define REPL_VAL 		   6
 #define REPL_KVAL		   7
 
-void gbDestroyItem( gbServer *server, gbItem *item );
-int  gbProcessQuery( gbClient *client );
+void   gbDestroyItem( gbServer *server, gbItem *item );
+int    gbItemPin( gbItem *item );
+void   gbItemUnpin( gbServer *server, gbItem *item, byte_t *data, uint32_t size );
+size_t gbEvictItems( gbServer *server, uint64_t deadline );
+int    gbCollectItems( gbServer *server, uint64_t deadline );
+int    gbExpireItems( gbServer *server, uint64_t deadline );
+size_t gbItemWeight( void *item );
+int    gbProcessQuery( gbClient *client );
 
 #endif
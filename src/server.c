@@ -75,181 +75,360 @@ void gbOOM(size_t size)
     abort();
 }
 
-void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+// Remember where the reply to the request just processed ends, to time it
+// once it's been sent.
+static void gbClientPushLatencyMark( gbClient *client, short op )
 {
-    assert( el != NULL );
-    assert( privdata != NULL );
+    assert( client != NULL );
 
-    gbClient *client = privdata;
+    gbLatencyMark *mark = NULL;
+
+    if( client->nsegments == 0 )
+    {
+        return;
+    }
+
+    if( client->nmarks == client->marks_size )
+    {
+        client->marks_size = client->marks_size ? client->marks_size * 2 : 16;
+        client->marks	   = zrealloc( client->marks, client->marks_size * sizeof(gbLatencyMark) );
+
+        assert( client->marks != NULL );
+    }
+
+    mark = &client->marks[ client->nmarks++ ];
+
+    mark->op	   = op;
+    mark->segment  = client->nsegments - 1;
+    mark->end	   = client->segments[ mark->segment ].size;
+    mark->received = client->received;
+}
+
+// Record the latency of every request whose reply has been completely sent.
+static void gbClientRecordLatency( gbClient *client )
+{
+    assert( client != NULL );
+
+    gbServer *server = client->server;
+    gbLatencyMark *mark = NULL;
+    uint64_t now = gbTimeNs();
+
+    for( ; client->mark < client->nmarks; ++client->mark )
+    {
+        mark = &client->marks[ client->mark ];
+
+        if( mark->segment > client->segment || ( mark->segment == client->segment && mark->end > client->wrote ) )
+        {
+            break;
+        }
+
+        gbHistogramRecord( &server->latency[ mark->op ], now - mark->received );
+    }
+}
+
+// Write as much of the client output as the socket will take with a single
+// writev, if something is left wait for the socket to be writable and stop
+// reading new requests meanwhile. Returns GB_ERR if the client has been destroyed.
+static int gbClientFlushReplies( gbClient *client )
+{
+    assert( client != NULL );
+    assert( client->segment <= client->nsegments );
+
+    gbServer *server = client->server;
+    struct iovec iov[GBNET_MAX_IOVEC];
+    gbReplySegment *seg = NULL;
     ssize_t nwrote;
-    size_t towrite = 0;
+    uint32_t i, niov = 0, skip = client->wrote;
 
-    if( client->status == STATUS_SENDING_REPLY )
+    if( client->segment == client->nsegments )
     {
-        towrite = client->buffer_size - client->wrote;
+        return GB_OK;
+    }
+
+    for( i = client->segment; i < client->nsegments && niov < GBNET_MAX_IOVEC; ++i, ++niov )
+    {
+        seg = &client->segments[i];
 
-        assert( towrite >= 0 );
+        iov[niov].iov_base = ( seg->item ? seg->data : client->wbuffer + seg->offset ) + skip;
+        iov[niov].iov_len  = seg->size - skip;
+
+        skip = 0;
+    }
 
-        nwrote = write( client->fd, client->buffer + client->wrote, towrite );
+    nwrote = writev( client->fd, iov, niov );
 
-        if(nwrote == -1)
+    if(nwrote == -1)
+    {
+        if (errno == EAGAIN)
         {
-            if (errno == EAGAIN)
-            {
-                nwrote = 0;
-            }
-            else
-            {
-                gbLog( DEBUG, "Error writing to client: %s",strerror(errno));
-                gbClientDestroy(client);
-                return;
-            }
+            nwrote = 0;
         }
-        else if(nwrote == 0)
+        else
         {
-            gbLog( DEBUG, "Client closed connection.");
+            gbLog( DEBUG, "Error writing to client: %s",strerror(errno));
             gbClientDestroy(client);
-            return;
+            return GB_ERR;
         }
-        else
+    }
+    else if(nwrote == 0)
+    {
+        gbLog( DEBUG, "Client closed connection.");
+        gbClientDestroy(client);
+        return GB_ERR;
+    }
+
+    client->seen = server->stats.time;
+
+    // move past every chunk completely sent, releasing pinned items
+    while( client->segment < client->nsegments && nwrote > 0 )
+    {
+        seg = &client->segments[client->segment];
+
+        if( nwrote < seg->size - client->wrote )
         {
             client->wrote += nwrote;
-            client->seen = client->server->stats.time;
+            break;
+        }
+
+        nwrote -= seg->size - client->wrote;
+        client->wrote = 0;
+        ++client->segment;
+
+        if( seg->item )
+        {
+            gbServerLock( seg->server );
+            gbItemUnpin( seg->server, seg->item, seg->data, seg->size );
+            gbServerUnlock( seg->server );
+        }
+    }
+
+    if( client->mark < client->nmarks )
+    {
+        gbClientRecordLatency(client);
+    }
 
-            if( client->wrote == client->buffer_size )
+    if( client->segment < client->nsegments )
+    {
+        if( ( gbGetFileEvents( server->events, client->fd ) & GB_WRITABLE ) == 0 )
+        {
+            if( gbCreateFileEvent( server->events, client->fd, GB_WRITABLE, gbWriteReplyHandler, client ) == GB_ERR )
             {
-                if( client->shutdown )
-                {
-                    gbLog( DEBUG, "Client shutdown." );
-                    gbClientDestroy(client);
-                }
-                else
-                {
-                    gbClientReset(client);
-                    gbDeleteFileEvent( client->server->events, client->fd, GB_WRITABLE );
-                }
+                gbLog( WARNING, "Could not create writable event for client." );
+                gbClientDestroy(client);
+                return GB_ERR;
             }
 
+            gbDeleteFileEvent( server->events, client->fd, GB_READABLE );
         }
     }
-    else
+    else if( client->shutdown )
     {
-        assert(0);
-
-        gbLog( WARNING, "Unexpected status %d for client while sending response.", client->status );
+        gbLog( DEBUG, "Client shutdown." );
         gbClientDestroy(client);
+        return GB_ERR;
+    }
+    else
+    {
+        gbClientReset(client);
     }
+
+    return GB_OK;
 }
 
-void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+// Process every complete request frame in the client input buffer, the
+// trailing partial frame ( if any ) is moved to the beginning of the buffer.
+// Returns GB_ERR if the client has been destroyed.
+static int gbClientProcessInput( gbClient *client )
 {
-    assert( el != NULL );
-    assert( privdata != NULL );
+    assert( client != NULL );
 
-    gbClient *client = ( gbClient * )privdata;
     gbServer *server = client->server;
-    byte_t   *p = NULL;
-    int nread = 0, toread = 0;
+    byte_t   *p = client->rbuffer;
+    uint32_t  left = client->read,
+              size = 0;
+    uint64_t  start = gbTimeNs(),
+              end = 0;
+    short     op = 0;
+
+    while( left >= sizeof(uint32_t) && client->shutdown == 0 )
+    {
+        // do not queue more than a full response worth of replies before
+        // flushing them, the rest will be processed once they're sent
+        if( client->wbuffer_len >= server->limits.maxresponsesize )
+        {
+            break;
+        }
 
-    assert( server != NULL );
+        memcpy( &size, p, sizeof(uint32_t) );
+        (void)memrev32ifbe(&size);
 
-    // we're still readying the buffer size from the socket
-    if( client->status == STATUS_WAITING_SIZE )
-    {
-        toread = sizeof(uint32_t) - client->read;
-        // keep reading it
-        if( toread > 0 )
+        // make sure the buffer is not too big or too small ( must be at least 2 bytes to contain the opcode )
+        if( size > server->limits.maxrequestsize || size < sizeof(short) )
         {
-            p = (byte_t *)( &client->buffer_size + client->read );
+            gbLog( WARNING, "Client request size %u invalid.", size );
+            gbClientDestroy(client);
+            return GB_ERR;
         }
-        // we're done, start reading the buffer
-        else
+        // request not complete yet
+        else if( left - sizeof(uint32_t) < size )
         {
-            client->read   = 0;
-            client->status = STATUS_WAITING_BUFFER;
-            // make sure the buffer is not too big or too small ( must be at least 2 bytes to contain the opcode )
-            if( client->buffer_size > server->limits.maxrequestsize || client->buffer_size < sizeof(short) )
-            {
-                gbLog( WARNING, "Client request size %d invalid.", client->buffer_size );
-                gbClientDestroy(client);
-                return;
-            }
-            // allocate buffer for the incoming request
-            else
-            {
-                client->buffer = zmalloc( client->buffer_size );
-
-                assert( client->buffer != NULL );
-            }
+            break;
         }
-    }
 
-    // we are reading the buffer ( of client->buffer_size total bytes )
-    if( client->status == STATUS_WAITING_BUFFER )
-    {
-        toread = client->buffer_size - client->read;
-        if( toread > 0 )
+        client->buffer 		= p + sizeof(uint32_t);
+        client->buffer_size = size;
+
+        if( gbProcessQuery(client) != GB_OK )
         {
-            p = client->buffer + client->read;
+            size_t sz = client->buffer_size < 255 ? client->buffer_size : 255;
+
+            gbLog( WARNING, "Malformed query, dropping client." );
+            gbLog( WARNING, "  Buffer size: %d opcode:%d - First %d bytes:", client->buffer_size, *(short *)&client->buffer[0], sz );
+            gbLogDumpBuffer( WARNING, client->buffer, sz );
+
+            gbClientDestroy(client);
+            return GB_ERR;
         }
-        // nothing left to read
-        else
+
+        memcpy( &op, client->buffer, sizeof(short) );
+        (void)memrev16ifbe(&op);
+
+        if( op > 0 && op <= OP_LAST )
         {
-            // we should never have more incoming bytes than specified by the protocol
-            // but since it's handled anyway, just assert this in the debug build
-            assert( toread == 0 );
+            end = gbTimeNs();
 
-            client->read   = 0;
-            client->status = STATUS_SENDING_REPLY;
+            gbHistogramRecord( &server->handling[op], end - start );
+            gbClientPushLatencyMark( client, op );
+
+            start = end;
         }
+
+        p    += sizeof(uint32_t) + size;
+        left -= sizeof(uint32_t) + size;
+    }
+
+    client->buffer 		= NULL;
+    client->buffer_size = 0;
+
+    if( left > 0 && p != client->rbuffer )
+    {
+        memmove( client->rbuffer, p, left );
+    }
+
+    client->read = left;
+
+    // release the input buffer if a big request made it grow
+    if( client->read == 0 && client->rbuffer_size > GBNET_IO_CHUNK_SIZE )
+    {
+        zfree( client->rbuffer );
+
+        client->rbuffer 	 = NULL;
+        client->rbuffer_size = 0;
+    }
+
+    return GB_OK;
+}
+
+void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+{
+    assert( el != NULL );
+    assert( privdata != NULL );
+
+    gbClient *client = privdata;
+    gbServer *server = client->server;
+
+    if( gbClientFlushReplies(client) != GB_OK )
+    {
+        return;
     }
 
-    // if we still have something to read
-    if( client->status != STATUS_SENDING_REPLY )
+    // everything was sent, handle requests left in the input buffer and
+    // start reading again
+    if( client->nsegments == 0 )
     {
-        nread = read( fd, p, toread );
-        if (nread == -1)
+        gbDeleteFileEvent( server->events, client->fd, GB_WRITABLE );
+
+        if( gbClientProcessInput(client) != GB_OK || gbClientFlushReplies(client) != GB_OK )
         {
-            // try again, operation failed
-            if (errno == EAGAIN)
-            {
-                nread = 0;
-            }
-            else
-            {
-                gbLog( WARNING, "Error reading from client: %s",strerror(errno));
-                gbClientDestroy(client);
-                return;
-            }
-            // bye bye dear client ^_^
+            return;
         }
-        else if (nread == 0)
+
+        if( client->nsegments == 0 && gbCreateFileEvent( server->events, client->fd, GB_READABLE, gbReadQueryHandler, client ) == GB_ERR )
         {
-            gbLog( DEBUG, "Client closed connection.");
+            gbLog( WARNING, "Could not create readable event for client." );
             gbClientDestroy(client);
-            return;
         }
     }
+}
+
+void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask )
+{
+    assert( el != NULL );
+    assert( privdata != NULL );
+
+    gbClient *client = ( gbClient * )privdata;
+    gbServer *server = client->server;
+    uint32_t  needed = 0,
+              size = 0;
+    int nread = 0;
 
-    client->read += nread;
-    client->seen = client->server->stats.time;
+    assert( server != NULL );
 
-    // process the query only if we were reading it and the request is complete
-    if( client->status == STATUS_WAITING_BUFFER && client->read == client->buffer_size )
+    // make room for a full chunk, or for the whole request if we already
+    // know it's bigger than that
+    needed = client->read + GBNET_IO_CHUNK_SIZE;
+    if( client->read >= sizeof(uint32_t) )
     {
-        client->status = STATUS_SENDING_REPLY;
+        memcpy( &size, client->rbuffer, sizeof(uint32_t) );
+        (void)memrev32ifbe(&size);
 
-        if( gbProcessQuery(client) != GB_OK )
+        if( size <= server->limits.maxrequestsize && size + sizeof(uint32_t) > needed )
         {
-            size_t sz = client->buffer_size < 255 ? client->buffer_size : 255;
+            needed = size + sizeof(uint32_t);
+        }
+    }
 
-            gbLog( WARNING, "Malformed query, dropping client." );
-            gbLog( WARNING, "  Buffer size: %d opcode:%d - First %d bytes:", client->buffer_size, *(short *)&client->buffer[0], sz );
-            gbLogDumpBuffer( WARNING, client->buffer, sz );
+    if( needed > client->rbuffer_size )
+    {
+        client->rbuffer 	 = zrealloc( client->rbuffer, needed );
+        client->rbuffer_size = needed;
+
+        assert( client->rbuffer != NULL );
+    }
 
+    nread = gbReadFileEvent( el, fd, client->rbuffer + client->read, client->rbuffer_size - client->read );
+    if (nread == -1)
+    {
+        // try again, operation failed
+        if (errno == EAGAIN)
+        {
+            return;
+        }
+        else
+        {
+            gbLog( WARNING, "Error reading from client: %s",strerror(errno));
             gbClientDestroy(client);
+            return;
         }
     }
+    // bye bye dear client ^_^
+    else if (nread == 0)
+    {
+        gbLog( DEBUG, "Client closed connection.");
+        gbClientDestroy(client);
+        return;
+    }
+
+    client->read    += nread;
+    client->seen     = server->stats.time;
+    client->received = gbTimeNs();
+
+    // process every complete request we've got so far and send all the
+    // replies at once
+    if( gbClientProcessInput(client) == GB_OK )
+    {
+        gbClientFlushReplies(client);
+    }
 }
 
 void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask)
@@ -257,7 +436,8 @@ void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask)
     assert( e != NULL );
     assert( privdata != NULL );
 
-    int client_port = 0, client_fd;
+    int client_port = 0, client_fd, i;
+    unsigned int nclients = 0;
     char client_ip[128] = {0};
     gbServer *server = (gbServer *)privdata;
 
@@ -268,14 +448,25 @@ void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask)
 
     if (client_fd == GB_ERR)
     {
+        // another worker sharing the unix socket got this client first
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+            return;
+
         gbLog( WARNING, "Error accepting client connection: %s", server->error );
         return;
     }
-    else if( server->stats.nclients >= server->limits.maxclients )
+
+    // max_clients is a process wide limit
+    for( i = 0, nclients = 0; i < server->nworkers; ++i )
+    {
+        nclients += server->workers[i]->stats.nclients;
+    }
+
+    if( nclients >= server->limits.maxclients )
     {
         close(client_fd);
         client_fd = -1;
-        gbLog( WARNING, "Dropping connection, current clients = %d, max = %d.", server->stats.nclients, server->limits.maxclients );
+        gbLog( WARNING, "Dropping connection, current clients = %d, max = %d.", nclients, server->limits.maxclients );
     }
 
     gbLog( DEBUG, "New connection from %s:%d", *client_ip ? client_ip : server->address, client_port );
@@ -306,41 +497,28 @@ void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask)
     }
 }
 
-#define GB_DEL_ITEM(s,n,i) (n)->data = NULL; gbDestroyItem( (s), (i) )
-
-void gbMemoryFreeHandler( tnode_t *node, size_t level, void *data )
+static void gbServerLogFreed( gbServer *server, unsigned long mem_before, unsigned long items_before )
 {
-    assert( node != NULL );
-    assert( data != NULL );
-
-    gbServer *server = data;
-    gbItem	 *item = node->data;
-    time_t	  eta = item ? ( server->stats.time - item->last_access_time ) : 0;
+    long mem_freed   = mem_before   - server->stats.memused,
+         items_freed = items_before - server->stats.nitems;
+    char freed[0xFF] = {0};
 
-    // item is older enough to be deleted
-    if( eta && eta >= server->gc_ratio )
+    if( mem_freed > 0 && items_freed > 0 )
     {
-        gbLog( DEBUG, "[OOM] Removing item %p since wasn't accessed from %lus.", item, eta );
+        gbMemFormat( mem_freed, freed, 0xFF );
 
-        GB_DEL_ITEM( server, node, item );
+        gbLog( INFO, "Freed %s of expired data ( %lu items ).", freed, items_freed );
     }
-}
-
-void gbHandleDeadTTLHandler( tnode_t *node, size_t level, void *data )
-{
-    assert( node != NULL );
-    assert( data != NULL );
-
-    gbServer *server = data;
-    gbItem	 *item = node->data;
-    time_t	  eta = item ? ( server->stats.time - item->time ) : 0;
-
-    // item is older enough to be deleted
-    if( item && item->ttl > 0 && eta >= item->ttl )
+    else if( items_freed > 0 )
     {
-        gbLog( DEBUG, "[CRON] TTL of %ds expired for item at %p.", item->ttl, item );
+        gbLog( INFO, "Freed %lu expired items.", items_freed );
+    }
+    // is this even possible ?
+    else if( mem_freed > 0 )
+    {
+        gbMemFormat( mem_freed, freed, 0xFF );
 
-        GB_DEL_ITEM( server, node, item );
+        gbLog( INFO, "Freed %s of expired data.", freed );
     }
 }
 
@@ -355,89 +533,105 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
     time_t now = time(NULL);
     char used[0xFF] = {0},
          max[0xFF] = {0},
-         freed[0xFF] = {0},
          uptime[0xFF] = {0},
          avgsize[0xFF] = {0};
     unsigned long mem_before = 0, items_before = 0;
-    long mem_freed = 0, items_freed = 0;
-
-    server->stats.time = now;
+    uint64_t deadline = 0;
 
     // shutdown requested
     if( server->shutdown ){
+        // the main worker will join the others and free everything
+        if( server->worker_id != 0 )
+        {
+            gbStopEventLoop( eventLoop );
+            return GB_NOMORE;
+        }
+
         gbServerDestroy( server );
         return 0;
     }
 
+    gbServerLock( server );
+
+    server->stats.time = now;
+
+    // expiration and memory freeing share the cron budget, what's left of
+    // their work goes on with the next cron loops
+    if( server->cron_budget )
+        deadline = gbTimeNs() + server->cron_budget * 1000;
+
     CRON_EVERY( server->expired_cron )
+    {
+        server->expired_pending = 1;
+    }
+
+    // a cycle stopped by expired_cron_limit or by the budget goes on with the next cron loop
+    if( server->expired_pending )
     {
         mem_before   = server->stats.memused;
         items_before = server->stats.nitems;
 
-        tr_recurse( &server->tree, gbHandleDeadTTLHandler, server, 0 );
+        server->expired_pending = gbExpireItems( server, deadline );
 
-        mem_freed   = mem_before   - server->stats.memused;
-        items_freed = items_before - server->stats.nitems;
+        gbServerLogFreed( server, mem_before, items_before );
+    }
 
-        if( mem_freed > 0 && items_freed > 0 )
+    CRON_EVERY( server->max_mem_cron )
+    {
+        if( server->stats.memused > server->limits.maxmem && server->gc_pending == 0 )
         {
-            gbMemFormat( mem_freed, freed, 0xFF );
+            if( server->evict_policy == GB_EVICT_LRU )
+                gbLog( WARNING, "Max memory exhausted, evicting least recently used data." );
 
-            gbLog( INFO, "Freed %s of expired data ( %lu items ).", freed, items_freed );
-        }
-        else if( items_freed > 0 )
-        {
-            gbLog( INFO, "Freed %lu expired items.", items_freed );
-        }
-        // is this even possible ?
-        else if( mem_freed > 0 )
-        {
-            gbMemFormat( mem_freed, freed, 0xFF );
+            else
+                gbLog( WARNING, "Max memory exhausted, trying to free data that was accessed not in the last %ds.", server->gc_ratio );
 
-            gbLog( INFO, "Freed %s of expired data.", freed );
+            server->gc_pending = 1;
         }
     }
 
-    CRON_EVERY( server->max_mem_cron )
+    // the gc sweep goes on from where the previous cron loop left it
+    if( server->gc_pending )
     {
-        if( server->stats.memused > server->limits.maxmem )
+        mem_before   = server->stats.memused;
+        items_before = server->stats.nitems;
+
+        if( server->evict_policy == GB_EVICT_LRU )
         {
+            gbEvictItems( server, deadline );
 
-            mem_before   = server->stats.memused;
-            items_before = server->stats.nitems;
+            server->gc_pending = server->stats.memused > server->limits.maxmem;
+        }
+        else
+            server->gc_pending = gbCollectItems( server, deadline );
+
+        gbServerLogFreed( server, mem_before, items_before );
+    }
 
-            gbLog( WARNING, "Max memory exhausted, trying to free data that was accessed not in the last %ds.", server->gc_ratio );
+    gbServerUnlock( server );
 
-            tr_recurse( &server->tree, gbMemoryFreeHandler, server, 0 );
+    // the main worker logs the status of the whole process
+    CRON_EVERY( 15000 ) if( server->worker_id == 0 )
+    {
+        unsigned int nclients = 0, nitems = 0, ncompressed = 0;
+        int i;
 
-            mem_freed   = mem_before   - server->stats.memused;
-            items_freed = items_before - server->stats.nitems;
+        for( i = 0; i < server->nworkers; ++i )
+        {
+            gbServer *worker = server->workers[i];
 
-            if( mem_freed > 0 && items_freed > 0 )
-            {
-                gbMemFormat( mem_freed, freed, 0xFF );
+            gbServerLock( worker );
 
-                gbLog( INFO, "Freed %s of expired data ( %lu items ).", freed, items_freed );
-            }
-            else if( items_freed > 0 )
-            {
-                gbLog( INFO, "Freed %lu expired items.", items_freed );
-            }
-            // is this even possible ?
-            else if( mem_freed > 0 )
-            {
-                gbMemFormat( mem_freed, freed, 0xFF );
+            nclients    += worker->stats.nclients;
+            nitems      += worker->stats.nitems;
+            ncompressed += worker->stats.ncompressed;
 
-                gbLog( INFO, "Freed %s of expired data.", freed );
-            }
+            gbServerUnlock( worker );
         }
-    }
 
-    CRON_EVERY( 15000 )
-    {
-        gbMemFormat( server->stats.memused, used, 0xFF );
+        gbMemFormat( zmem_used(), used, 0xFF );
         gbMemFormat( server->limits.maxmem, max,  0xFF );
-        gbMemFormat( server->stats.sizeavg, avgsize, 0xFF );
+        gbMemFormat( nitems ? zmem_used() / nitems : 0, avgsize, 0xFF );
 
         gbServerFormatUptime( server, uptime );
 
@@ -447,9 +641,9 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
              "MEM %s/%s - CLIENTS %d - OBJECTS %d ( %d COMPRESSED ) - AVERAGE SIZE %s - UPTIME %s",
              used,
              max,
-             server->stats.nclients,
-             server->stats.nitems,
-             server->stats.ncompressed,
+             nclients,
+             nitems,
+             ncompressed,
              avgsize,
              uptime
             );
@@ -595,17 +789,9 @@ void gbConfigDestroyHandler( tnode_t *elem, size_t level, void *data )
         zfree( item );
 }
 
-void gbServerDestroy( gbServer *server )
+static void gbServerDestroyClients( gbServer *server )
 {
     assert( server != NULL );
-    assert( server->m_keys != NULL );
-    assert( server->m_values != NULL );
-    assert( server->m_buffer != NULL );
-    assert( server->lzf_buffer != NULL );
-    assert( server->events != NULL );
-
-    tr_recurse( &server->tree, gbObjectDestroyHandler,   server, 0 );
-    tr_recurse( &server->config, gbConfigDestroyHandler, server, 0 );
 
     if( server->clients )
     {
@@ -621,22 +807,216 @@ void gbServerDestroy( gbServer *server )
         }
 
         ll_destroy( server->clients );
+        server->clients = NULL;
     }
+}
+
+// Free the keyspace shard and the resources of a single worker.
+static void gbServerFreeWorker( gbServer *server )
+{
+    assert( server != NULL );
+    assert( server->m_keys != NULL );
+    assert( server->m_values != NULL );
+    assert( server->lzf_buffer != NULL );
+    assert( server->events != NULL );
+
+    tr_recurse( &server->tree, gbObjectDestroyHandler, server, 0 );
+
+    gbExpireDestroy( &server->expire );
 
     ll_destroy( server->m_keys );
     ll_destroy( server->m_values );
 
-    zfree( server->m_buffer );
     zfree( server->lzf_buffer );
+    tr_iter_free( &server->lru_hand );
+    tr_iter_free( &server->gc_hand );
+    zfree( server->latency );
+    zfree( server->handling );
 
     opool_destroy( &server->item_pool );
+    slab_destroy( &server->slab );
+    ht_free( &server->orphans );
 
     tr_free( &server->tree );
-    tr_free( &server->config );
 
     gbDeleteTimeEvent( server->events, server->cron_id );
     gbDeleteEventLoop( server->events );
+
+    if( server->nworkers > 1 )
+    {
+        pthread_mutex_destroy( &server->lock );
+    }
+}
+
+void gbServerDestroy( gbServer *server )
+{
+    assert( server != NULL );
+    assert( server->worker_id == 0 );
+
+    int i;
+
+    // stop the other workers and wait for them to exit their loop
+    for( i = 1; i < server->nworkers; ++i )
+    {
+        server->workers[i]->shutdown = 1;
+
+        pthread_join( server->workers[i]->thread, NULL );
+    }
+
+    // clients go first since they could still hold items pinned on any shard
+    for( i = 0; i < server->nworkers; ++i )
+    {
+        gbServerDestroyClients( server->workers[i] );
+    }
+
+    for( i = server->nworkers - 1; i >= 0; --i )
+    {
+        gbServer *worker = server->workers[i];
+
+        gbServerFreeWorker( worker );
+
+        if( i > 0 )
+        {
+            if( worker->type == TCP )
+                close( worker->fd );
+
+            zfree( worker );
+        }
+    }
+
+    tr_recurse( &server->config, gbConfigDestroyHandler, server, 0 );
+    tr_free( &server->config );
+
+    zfree( server->workers );
+
     gbLogFinalize();
 
     exit( 0 );
 }
+
+static void *gbServerWorkerMain( void *data )
+{
+    gbServer *server = data;
+
+    gbEventLoopMain( server->events );
+
+    return NULL;
+}
+
+/*
+ * Create the worker 'id' as a copy of the main server configuration, with its
+ * own event loop, listening socket, buffers and keyspace shard.
+ */
+static gbServer *gbServerCreateWorker( gbServer *main, int id )
+{
+    assert( main != NULL );
+    assert( id > 0 );
+
+    gbServer *server = zmalloc( sizeof(gbServer) );
+
+    assert( server != NULL );
+
+    memcpy( server, main, sizeof(gbServer) );
+
+    server->worker_id = id;
+
+    // TCP workers get their own socket and the kernel balances connections
+    // across them, unix socket workers race on the main one
+    if( main->type == TCP )
+    {
+        server->fd = gbNetTcpReusePortServer( server->error, server->port, server->address );
+        if( server->fd == GBNET_ERR )
+        {
+            gbLog( ERROR, "Error creating server for worker %d : %s", id, server->error );
+            exit(1);
+        }
+
+        gbNetNonBlock( NULL, server->fd );
+    }
+
+    server->stats.firstin     =
+    server->stats.lastin      =
+    server->stats.crondone    =
+    server->stats.nclients    =
+    server->stats.nitems      =
+    server->stats.ncompressed =
+    server->stats.ninlined    =
+    server->stats.inline_saved =
+    server->stats.nshared     =
+    server->stats.shared_saved =
+    server->stats.requests    =
+    server->stats.connections =
+    server->stats.nevicted    =
+    server->stats.sizeavg     =
+    server->stats.compravg    = 0;
+    server->stats.mempeak     =
+    server->stats.memused     = zmem_used();
+
+    server->expired_pending = 0;
+    server->gc_pending   = 0;
+    server->lru_lap      = 0;
+    server->clients      = ll_prealloc( server->limits.maxclients );
+    server->m_keys       = ll_prealloc( 255 );
+    server->m_values     = ll_prealloc( 255 );
+    server->lzf_buffer   = zcalloc( server->limits.maxrequestsize );
+    server->latency      = zcalloc( sizeof(gbHistogram) * ( OP_LAST + 1 ) );
+    server->handling     = zcalloc( sizeof(gbHistogram) * ( OP_LAST + 1 ) );
+    server->shutdown     = 0;
+
+    opool_create( &server->item_pool, sizeof(gbItem), GB_DEFAULT_OBJ_POOL_INITIAL_CAPACITY, GB_DEFAULT_OBJ_POOL_MAX_BLOCK_SIZE );
+    slab_init( &server->slab, server->slab_rebalance );
+    ht_init( &server->orphans );
+
+    tr_init_tree( server->tree );
+    tr_set_weight( &server->tree, gbItemWeight );
+    tr_set_index( &server->tree, server->hash_index );
+    tr_set_leaf( &server->tree, GB_ITEM_SLOT_SIZE );
+
+    tr_iter_init( &server->lru_hand, server->limits.maxkeysize );
+    tr_iter_init( &server->gc_hand, server->limits.maxkeysize );
+
+    gbExpireInit( &server->expire );
+
+    pthread_mutex_init( &server->lock, NULL );
+
+    server->events  = gbCreateEventLoop( server->limits.maxclients + 1024 );
+    server->cron_id = gbCreateTimeEvent( server->events, 1, gbServerCronHandler, server, NULL );
+
+    gbCreateFileEvent( server->events, server->fd, GB_READABLE, gbAcceptHandler, server );
+
+    return server;
+}
+
+void gbServerStartWorkers( gbServer *server )
+{
+    assert( server != NULL );
+    assert( server->worker_id == 0 );
+
+    int i;
+
+    if( server->nworkers == 1 )
+    {
+        return;
+    }
+
+    zmem_enable_thread_safeness();
+
+    pthread_mutex_init( &server->lock, NULL );
+
+    // the main listening socket is shared with the workers of an unix server
+    gbNetNonBlock( NULL, server->fd );
+
+    for( i = 1; i < server->nworkers; ++i )
+    {
+        server->workers[i] = gbServerCreateWorker( server, i );
+    }
+
+    for( i = 1; i < server->nworkers; ++i )
+    {
+        if( pthread_create( &server->workers[i]->thread, NULL, gbServerWorkerMain, server->workers[i] ) != 0 )
+        {
+            gbLog( ERROR, "Could not start worker %d : %s", i, strerror(errno) );
+            exit(1);
+        }
+    }
+}
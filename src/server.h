@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <getopt.h>
@@ -46,16 +47,17 @@
 #include "query.h"
 #include "config.h"
 #include "default.h"
+#include "endianness.h"
 
 void gbMemFormat( unsigned long used, char *buffer, size_t size );
 void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask);
-void gbMemoryFreeHandler( tnode_t *elem, size_t level, void *data );
 int  gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data);
 void gbDaemonize();
 void gbProcessInit();
 void gbServerDestroy( gbServer *server );
+void gbServerStartWorkers( gbServer *server );
 void gbOOM(size_t size);
 
 #endif
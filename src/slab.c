@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "slab.h"
+#include <string.h>
+#include <assert.h>
+
+// Offset of the first object inside a page.
+#define SLAB_HEADER_SIZE ( ( sizeof(slab_page_t) + 7 ) & ~7 )
+
+// Page an object was carved out of.
+#define slab_page_of( ptr ) ( (slab_page_t *)( (uintptr_t)(ptr) & ~( (uintptr_t)SLAB_PAGE_SIZE - 1 ) ) )
+
+static void slab_link( slab_page_t **list, slab_page_t *page )
+{
+    page->prev = NULL;
+    page->next = *list;
+
+    if( *list )
+        (*list)->prev = page;
+
+    *list = page;
+}
+
+static void slab_unlink( slab_page_t **list, slab_page_t *page )
+{
+    if( page->prev )
+        page->prev->next = page->next;
+    else
+        *list = page->next;
+
+    if( page->next )
+        page->next->prev = page->prev;
+
+    page->prev =
+    page->next = NULL;
+}
+
+static void slab_add_class( slab_t *slab, uint32_t size )
+{
+    slab_class_t *cls = &slab->classes[ slab->nclasses++ ];
+
+    cls->size     = size;
+    cls->per_page = ( SLAB_PAGE_SIZE - SLAB_HEADER_SIZE ) / size;
+}
+
+void slab_init( slab_t *slab, int rebalance )
+{
+    assert( slab != NULL );
+
+    size_t size = SLAB_MIN_SIZE, next = 0, s = 0;
+    uint32_t c = 0;
+
+    memset( slab, 0x00, sizeof(slab_t) );
+
+    slab->rebalance = rebalance;
+
+    // sizes are multiples of 8 so every object is pointer aligned
+    while( size < SLAB_MAX_SIZE && slab->nclasses < SLAB_MAX_CLASSES - 1 )
+    {
+        slab_add_class( slab, size );
+
+        next = ( (size_t)( size * SLAB_GROWTH ) + 7 ) & ~7;
+        size = next > size ? next : size + 8;
+    }
+
+    slab_add_class( slab, SLAB_MAX_SIZE );
+
+    for( s = 0; s <= SLAB_MAX_SIZE / 8; ++s )
+    {
+        while( slab->classes[c].size < s * 8 )
+            ++c;
+
+        slab->index[s] = c;
+    }
+}
+
+// Give a class a page, an empty one left by a class if any.
+static slab_page_t *slab_add_page( slab_t *slab, uint32_t c )
+{
+    slab_class_t *cls = &slab->classes[c];
+    slab_page_t *page = slab->free_pages;
+
+    if( page )
+    {
+        slab_unlink( &slab->free_pages, page );
+        --slab->nfree_pages;
+        ++slab->moved;
+    }
+    else
+    {
+        page = zpages_map( SLAB_PAGE_SIZE );
+
+        assert( page != NULL );
+    }
+
+    page->free   = NULL;
+    page->used   = 0;
+    page->carved = 0;
+    page->cls    = c;
+
+    slab_link( &cls->partial, page );
+
+    ++cls->pages;
+    ++cls->empty;
+
+    return page;
+}
+
+// Take an empty page away from its class.
+static void slab_remove_page( slab_t *slab, slab_class_t *cls, slab_page_t *page )
+{
+    slab_unlink( &cls->partial, page );
+
+    --cls->pages;
+
+    if( slab->nfree_pages < SLAB_MAX_FREE_PAGES )
+    {
+        slab_link( &slab->free_pages, page );
+        ++slab->nfree_pages;
+    }
+    else
+    {
+        zpages_unmap( page, SLAB_PAGE_SIZE );
+    }
+}
+
+void *slab_alloc( slab_t *slab, size_t size )
+{
+    assert( slab != NULL );
+    assert( size > 0 );
+
+    if( size > SLAB_MAX_SIZE )
+        return zmalloc( size );
+
+    uint32_t c = slab->index[ ( size + 7 ) >> 3 ];
+    slab_class_t *cls = &slab->classes[c];
+    slab_page_t *page = cls->partial ? cls->partial : slab_add_page( slab, c );
+    void *obj = page->free;
+
+    if( obj )
+    {
+        page->free = *(void **)obj;
+    }
+    // pages are carved lazily, so their memory is only touched once used
+    else
+    {
+        obj = (unsigned char *)page + SLAB_HEADER_SIZE + (size_t)page->carved * cls->size;
+        ++page->carved;
+    }
+
+    if( page->used++ == 0 )
+        --cls->empty;
+
+    if( page->used == cls->per_page )
+    {
+        slab_unlink( &cls->partial, page );
+        slab_link( &cls->full, page );
+    }
+
+    ++cls->used;
+    cls->requested += size;
+
+    zmem_charge( cls->size );
+
+    return obj;
+}
+
+void slab_free( slab_t *slab, void *ptr, size_t size )
+{
+    assert( slab != NULL );
+    assert( ptr != NULL );
+    assert( size > 0 );
+
+    if( size > SLAB_MAX_SIZE )
+    {
+        zfree( ptr );
+        return;
+    }
+
+    slab_page_t *page = slab_page_of( ptr );
+    slab_class_t *cls = &slab->classes[ page->cls ];
+
+    assert( page->cls == slab->index[ ( size + 7 ) >> 3 ] );
+    assert( page->used > 0 );
+
+    if( page->used == cls->per_page )
+    {
+        slab_unlink( &cls->full, page );
+        slab_link( &cls->partial, page );
+    }
+
+    *(void **)ptr = page->free;
+    page->free    = ptr;
+
+    --page->used;
+    --cls->used;
+    cls->requested -= size;
+
+    zmem_discharge( cls->size );
+
+    if( page->used == 0 )
+    {
+        // keep one empty page per class so a class does not bounce pages
+        if( slab->rebalance && cls->empty > 0 )
+            slab_remove_page( slab, cls, page );
+        else
+            ++cls->empty;
+    }
+}
+
+size_t slab_memory( slab_t *slab )
+{
+    assert( slab != NULL );
+
+    size_t pages = slab->nfree_pages;
+    uint32_t c;
+
+    for( c = 0; c < slab->nclasses; ++c )
+        pages += slab->classes[c].pages;
+
+    return pages * SLAB_PAGE_SIZE;
+}
+
+static void slab_free_list( slab_page_t *page )
+{
+    slab_page_t *next = NULL;
+
+    for( ; page; page = next )
+    {
+        next = page->next;
+        zpages_unmap( page, SLAB_PAGE_SIZE );
+    }
+}
+
+void slab_destroy( slab_t *slab )
+{
+    assert( slab != NULL );
+
+    uint32_t c;
+
+    for( c = 0; c < slab->nclasses; ++c )
+    {
+        zmem_discharge( slab->classes[c].used * slab->classes[c].size );
+
+        slab_free_list( slab->classes[c].partial );
+        slab_free_list( slab->classes[c].full );
+    }
+
+    slab_free_list( slab->free_pages );
+
+    memset( slab, 0x00, sizeof(slab_t) );
+}
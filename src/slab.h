@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "zmem.h"
+#include <stdint.h>
+
+// Size of a page, pages are aligned to it so an object finds its page masking its address.
+#define SLAB_PAGE_SIZE      ( 1024 * 1024 )
+// Size of the smallest and of the biggest class, bigger objects are zmalloc'd.
+#define SLAB_MIN_SIZE       32
+#define SLAB_MAX_SIZE       16384
+// Every class is this much bigger than the previous one.
+#define SLAB_GROWTH         1.125
+#define SLAB_MAX_CLASSES    64
+// Empty pages kept around for any class when rebalancing, the others are released.
+#define SLAB_MAX_FREE_PAGES 4
+
+typedef struct slab_page
+{
+    // previous and next page in the same list of the class
+    struct slab_page *prev;
+    struct slab_page *next;
+    // last freed object of the page, freed objects point to the previous one
+    void             *free;
+    // number of objects allocated from this page
+    uint32_t          used;
+    // number of objects carved out of the page so far
+    uint32_t          carved;
+    // index of the class the page belongs to
+    uint32_t          cls;
+}
+slab_page_t;
+
+typedef struct
+{
+    // size of the class objects
+    uint32_t     size;
+    // number of objects fitting in a page
+    uint32_t     per_page;
+    // pages with at least a free object
+    slab_page_t *partial;
+    // pages with no free objects
+    slab_page_t *full;
+    // number of pages of the class
+    size_t       pages;
+    // number of pages with no allocated objects
+    size_t       empty;
+    // number of allocated objects
+    size_t       used;
+    // bytes asked for by the allocated objects
+    size_t       requested;
+}
+slab_class_t;
+
+/*
+ * Size class allocator for item values. Objects of the same class are
+ * carved out of pages which are never given back to the heap while any
+ * of their objects is used, so a SET churn with a stable size mix keeps
+ * reusing the same memory instead of fragmenting the heap. Only the
+ * allocated objects are counted as used memory, like free chunks inside
+ * the heap are not. When rebalancing, a class giving up an empty page
+ * makes it available to the other classes.
+ */
+typedef struct
+{
+    slab_class_t  classes[SLAB_MAX_CLASSES];
+    // number of classes
+    uint32_t      nclasses;
+    // class of every size up to SLAB_MAX_SIZE, in steps of 8 bytes
+    unsigned char index[SLAB_MAX_SIZE / 8 + 1];
+    // empty pages any class can take
+    slab_page_t  *free_pages;
+    // number of empty pages any class can take
+    size_t        nfree_pages;
+    // number of free pages taken back by a class
+    size_t        moved;
+    // 1 if empty pages are moved between classes
+    int           rebalance;
+}
+slab_t;
+
+void   slab_init( slab_t *slab, int rebalance );
+// Allocate 'size' bytes, from the heap if they exceed SLAB_MAX_SIZE.
+void  *slab_alloc( slab_t *slab, size_t size );
+// Release an object, 'size' must be the one it was allocated with.
+void   slab_free( slab_t *slab, void *ptr, size_t size );
+// Bytes of the pages owned by the allocator.
+size_t slab_memory( slab_t *slab );
+void   slab_destroy( slab_t *slab );
+
+#endif
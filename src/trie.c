@@ -28,31 +28,816 @@
  */
 #include "trie.h"
 
-static size_t tr_node_children( trie_t *trie )
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+typedef struct
 {
-    assert( trie != NULL );
+    unsigned char keys[4];
+    tnode_t      *children[4];
+}
+tr_node4_t;
+
+typedef struct
+{
+    unsigned char keys[16];
+    tnode_t      *children[16];
+}
+tr_node16_t;
+
+typedef struct
+{
+    // index[byte] is the position of the child inside children + 1, or 0.
+    unsigned char index[256];
+    tnode_t      *children[48];
+}
+tr_node48_t;
+
+typedef struct
+{
+    tnode_t *children[256];
+}
+tr_node256_t;
+
+// tnode_t and TR_NODE_4 pools parameters.
+#define TR_POOL_INITIAL_CAPACITY 64
+#define TR_POOL_MAX_BLOCK_SIZE   ( 1024 * 128 )
+
+// Below these sizes a container is shrunk to the previous type, the gap with
+// the grow thresholds avoids reallocating on add/remove oscillations.
+#define TR_NODE_16_SHRINK  3
+#define TR_NODE_48_SHRINK  12
+#define TR_NODE_256_SHRINK 37
+
+static size_t tr_container_size( unsigned char type )
+{
+    switch( type )
+    {
+        case TR_NODE_4   : return sizeof(tr_node4_t);
+        case TR_NODE_16  : return sizeof(tr_node16_t);
+        case TR_NODE_48  : return sizeof(tr_node48_t);
+        case TR_NODE_256 : return sizeof(tr_node256_t);
+    }
 
-    return trie->nodes == NULL ? 0 : ( trie->n_nodes + 1 );
+    return 0;
 }
 
-// This is O(N) since the trie->nodes array is not sorted.
-static tnode_t *tr_find_next_node( trie_t *trie, unsigned char value )
+/*
+ * Replace the span of the node with the given bytes, which are allowed to
+ * point inside the current span itself.
+ */
+static void tr_set_span( trie_t *trie, tnode_t *node, unsigned char *bytes, size_t len )
 {
-	int n = tr_node_children(trie);
-	trie_t *node = NULL;
+    unsigned char *old = node->span_len > TR_SPAN_INLINE ? node->span.ptr : NULL;
+    size_t old_len = node->span_len;
+
+    assert( len <= TR_SPAN_MAX );
+
+    if( len > TR_SPAN_INLINE )
+    {
+        unsigned char *ptr = zmalloc( len );
+
+        assert( ptr != NULL );
 
-    assert( n == 0 || trie->nodes != NULL );
+        memcpy( ptr, bytes, len );
 
-    while( --n >= 0 )
+        node->span.ptr = ptr;
+        trie->mem += len;
+    }
+    else if( len > 0 )
+    {
+        memmove( node->span.bytes, bytes, len );
+    }
+
+    if( old )
     {
-		node = trie->nodes + n;
-		if( node->value == value )
+        zfree( old );
+        trie->mem -= old_len;
+    }
+
+    node->span_len = len;
+}
+
+static tnode_t *tr_create_node( trie_t *trie, unsigned char value, unsigned char *span, size_t span_len )
+{
+    tnode_t *node = opool_alloc_object( &trie->node_pool );
+
+    assert( node != NULL );
+
+    node->data     = NULL;
+    node->nodes    = NULL;
+    node->n_bytes  = 0;
+    node->n_items  = 0;
+    node->span_len = 0;
+    node->n_nodes  = 0;
+    node->value    = value;
+    node->type     = TR_NODE_1;
+    node->leaf     = 0;
+
+    tr_set_span( trie, node, span, span_len );
+
+    ++trie->n_nodes;
+    trie->mem += sizeof(tnode_t);
+
+    return node;
+}
+
+static void tr_destroy_node( trie_t *trie, tnode_t *node )
+{
+    assert( node->nodes == NULL );
+
+    tr_set_span( trie, node, NULL, 0 );
+
+    if( node->leaf )
+    {
+        opool_free_object( &trie->leaf_pool, node );
+        trie->mem -= trie->leaf_size;
+
+        --trie->n_leaves;
+    }
+    else
+    {
+        opool_free_object( &trie->node_pool, node );
+    }
+
+    --trie->n_nodes;
+    trie->mem -= sizeof(tnode_t);
+}
+
+// Return the position of 'value' inside a sorted keys array of a node 4 or 16, or -1.
+static int tr_find_key( unsigned char *keys, int n, unsigned char value )
+{
+    int i;
+
+#if defined(__SSE2__)
+    if( n > 4 )
+    {
+        __m128i cmp  = _mm_cmpeq_epi8( _mm_set1_epi8( value ), _mm_loadu_si128( (__m128i *)keys ) );
+        int     mask = _mm_movemask_epi8( cmp ) & ( ( 1 << n ) - 1 );
+
+        return mask ? __builtin_ctz( mask ) : -1;
+    }
+#endif
+
+    for( i = 0; i < n && keys[i] <= value; ++i )
+    {
+        if( keys[i] == value )
+            return i;
+    }
+
+    return -1;
+}
+
+// Return the address of the container slot pointing to the child with the given value, or NULL.
+static tnode_t **tr_find_slot( tnode_t *node, unsigned char value )
+{
+    int i;
+
+    if( node->nodes == NULL )
+        return NULL;
+
+    switch( node->type )
+    {
+        case TR_NODE_1 :
+
+            return ((tnode_t *)node->nodes)->value == value ? (tnode_t **)&node->nodes : NULL;
+
+        case TR_NODE_4 :
         {
-			return node;
-		}
-	}
+            tr_node4_t *n4 = node->nodes;
+
+            i = tr_find_key( n4->keys, node->n_nodes, value );
+
+            return i >= 0 ? &n4->children[i] : NULL;
+        }
+
+        case TR_NODE_16 :
+        {
+            tr_node16_t *n16 = node->nodes;
+
+            i = tr_find_key( n16->keys, node->n_nodes, value );
+
+            return i >= 0 ? &n16->children[i] : NULL;
+        }
+
+        case TR_NODE_48 :
+        {
+            tr_node48_t *n48 = node->nodes;
+
+            i = n48->index[value];
+
+            return i ? &n48->children[i - 1] : NULL;
+        }
+
+        default :
+        {
+            tr_node256_t *n256 = node->nodes;
+
+            return n256->children[value] ? &n256->children[value] : NULL;
+        }
+    }
+}
+
+static tnode_t *tr_find_next_node( tnode_t *node, unsigned char value )
+{
+    tnode_t **slot = tr_find_slot( node, value );
+
+    return slot ? *slot : NULL;
+}
+
+/*
+ * Return the first child of the node whose byte value is >= from, or NULL.
+ * Since node 4 and 16 keys are kept sorted, children are always visited
+ * in lexicographic order.
+ */
+static tnode_t *tr_next_child( tnode_t *trie, int from )
+{
+    int i, n = trie->n_nodes;
+
+    if( trie->nodes == NULL || from > 0xFF )
+        return NULL;
+
+    switch( trie->type )
+    {
+        case TR_NODE_1 :
+        {
+            tnode_t *child = trie->nodes;
+
+            return child->value >= from ? child : NULL;
+        }
+
+        case TR_NODE_4 :
+        {
+            tr_node4_t *n4 = trie->nodes;
+
+            for( i = 0; i < n; ++i )
+                if( n4->keys[i] >= from )
+                    return n4->children[i];
+
+            return NULL;
+        }
+
+        case TR_NODE_16 :
+        {
+            tr_node16_t *n16 = trie->nodes;
+
+            for( i = 0; i < n; ++i )
+                if( n16->keys[i] >= from )
+                    return n16->children[i];
+
+            return NULL;
+        }
+
+        case TR_NODE_48 :
+        {
+            tr_node48_t *n48 = trie->nodes;
+
+            for( i = from; i <= 0xFF; ++i )
+                if( n48->index[i] )
+                    return n48->children[ n48->index[i] - 1 ];
+
+            return NULL;
+        }
+
+        default :
+        {
+            tr_node256_t *n256 = trie->nodes;
+
+            for( i = from; i <= 0xFF; ++i )
+                if( n256->children[i] )
+                    return n256->children[i];
+
+            return NULL;
+        }
+    }
+}
 
-	return NULL;
+// Insert 'child' into a sorted keys/children pair of arrays with n elements.
+static void tr_insert_sorted( unsigned char *keys, tnode_t **children, int n, tnode_t *child )
+{
+    int i = 0;
+
+    while( i < n && keys[i] < child->value )
+        ++i;
+
+    memmove( keys + i + 1,     keys + i,     n - i );
+    memmove( children + i + 1, children + i, ( n - i ) * sizeof(tnode_t *) );
+
+    keys[i]     = child->value;
+    children[i] = child;
+}
+
+// Remove the i-th element of a sorted keys/children pair of arrays with n elements.
+static void tr_remove_sorted( unsigned char *keys, tnode_t **children, int n, int i )
+{
+    assert( i >= 0 && i < n );
+
+    memmove( keys + i,     keys + i + 1,     n - i - 1 );
+    memmove( children + i, children + i + 1, ( n - i - 1 ) * sizeof(tnode_t *) );
+}
+
+static void *tr_alloc_container( trie_t *trie, unsigned char type )
+{
+    void *container = NULL;
+
+    switch( type )
+    {
+        case TR_NODE_4 :
+
+            container = opool_alloc_object( &trie->node4_pool );
+
+            memset( container, 0x00, sizeof(tr_node4_t) );
+
+        break;
+
+        case TR_NODE_16  : container = zcalloc( sizeof(tr_node16_t) );  break;
+        case TR_NODE_48  : container = zcalloc( sizeof(tr_node48_t) );  break;
+        case TR_NODE_256 : container = zcalloc( sizeof(tr_node256_t) ); break;
+    }
+
+    assert( container != NULL );
+
+    trie->mem += tr_container_size( type );
+
+    return container;
+}
+
+static void tr_free_container( trie_t *trie, tnode_t *node )
+{
+    trie->mem -= tr_container_size( node->type );
+
+    // a TR_NODE_1 container is the child itself
+    if( node->type == TR_NODE_4 )
+        opool_free_object( &trie->node4_pool, node->nodes );
+
+    else if( node->type != TR_NODE_1 )
+        zfree( node->nodes );
+
+    node->nodes = NULL;
+}
+
+// Move every child of the node into a new container of the given type.
+static void tr_set_container( trie_t *trie, tnode_t *node, unsigned char type )
+{
+    void *container = NULL;
+    tnode_t *child = NULL;
+    int n = 0;
+
+    if( type == TR_NODE_1 )
+    {
+        assert( node->n_nodes == 1 );
+
+        container = tr_next_child( node, 0 );
+    }
+    else
+    {
+        container = tr_alloc_container( trie, type );
+
+        for( child = tr_next_child( node, 0 ); child; child = tr_next_child( node, child->value + 1 ), ++n )
+        {
+            switch( type )
+            {
+                case TR_NODE_4 :
+
+                    ((tr_node4_t *)container)->keys[n]     = child->value;
+                    ((tr_node4_t *)container)->children[n] = child;
+
+                break;
+
+                case TR_NODE_16 :
+
+                    ((tr_node16_t *)container)->keys[n]     = child->value;
+                    ((tr_node16_t *)container)->children[n] = child;
+
+                break;
+
+                case TR_NODE_48 :
+
+                    ((tr_node48_t *)container)->index[child->value] = n + 1;
+                    ((tr_node48_t *)container)->children[n]         = child;
+
+                break;
+
+                default :
+
+                    ((tr_node256_t *)container)->children[child->value] = child;
+            }
+        }
+
+        assert( n == node->n_nodes );
+    }
+
+    tr_free_container( trie, node );
+
+    node->nodes = container;
+    node->type  = type;
+}
+
+static void tr_add_child( trie_t *trie, tnode_t *node, tnode_t *child )
+{
+    int i;
+
+    assert( tr_find_next_node( node, child->value ) == NULL );
+
+    // first child, just link it
+    if( node->nodes == NULL )
+    {
+        node->nodes   = child;
+        node->type    = TR_NODE_1;
+        node->n_nodes = 1;
+
+        return;
+    }
+    // grow the container if it's full
+    else if( node->type == TR_NODE_1 )
+    {
+        tr_set_container( trie, node, TR_NODE_4 );
+    }
+    else if( node->type == TR_NODE_4 && node->n_nodes == 4 )
+    {
+        tr_set_container( trie, node, TR_NODE_16 );
+    }
+    else if( node->type == TR_NODE_16 && node->n_nodes == 16 )
+    {
+        tr_set_container( trie, node, TR_NODE_48 );
+    }
+    else if( node->type == TR_NODE_48 && node->n_nodes == 48 )
+    {
+        tr_set_container( trie, node, TR_NODE_256 );
+    }
+
+    switch( node->type )
+    {
+        case TR_NODE_4 :
+        {
+            tr_node4_t *n4 = node->nodes;
+
+            tr_insert_sorted( n4->keys, n4->children, node->n_nodes, child );
+        }
+        break;
+
+        case TR_NODE_16 :
+        {
+            tr_node16_t *n16 = node->nodes;
+
+            tr_insert_sorted( n16->keys, n16->children, node->n_nodes, child );
+        }
+        break;
+
+        case TR_NODE_48 :
+        {
+            tr_node48_t *n48 = node->nodes;
+
+            // children slots are reused, so look for the first free one
+            for( i = 0; n48->children[i] != NULL; ++i );
+
+            n48->children[i]           = child;
+            n48->index[ child->value ] = i + 1;
+        }
+        break;
+
+        default :
+
+            ((tr_node256_t *)node->nodes)->children[ child->value ] = child;
+    }
+
+    ++node->n_nodes;
+}
+
+static void tr_remove_child( trie_t *trie, tnode_t *node, unsigned char value )
+{
+    int n = node->n_nodes;
+
+    assert( node->nodes != NULL );
+    assert( tr_find_next_node( node, value ) != NULL );
+
+    switch( node->type )
+    {
+        case TR_NODE_1 :
+
+            node->nodes = NULL;
+
+        break;
+
+        case TR_NODE_4 :
+        {
+            tr_node4_t *n4 = node->nodes;
+
+            tr_remove_sorted( n4->keys, n4->children, n, tr_find_key( n4->keys, n, value ) );
+        }
+        break;
+
+        case TR_NODE_16 :
+        {
+            tr_node16_t *n16 = node->nodes;
+
+            tr_remove_sorted( n16->keys, n16->children, n, tr_find_key( n16->keys, n, value ) );
+        }
+        break;
+
+        case TR_NODE_48 :
+        {
+            tr_node48_t *n48 = node->nodes;
+
+            n48->children[ n48->index[value] - 1 ] = NULL;
+            n48->index[value] = 0;
+        }
+        break;
+
+        default :
+
+            ((tr_node256_t *)node->nodes)->children[value] = NULL;
+    }
+
+    --node->n_nodes;
+
+    // shrink the container if it's too sparse
+    if( node->n_nodes == 0 )
+    {
+        tr_free_container( trie, node );
+
+        node->type = TR_NODE_1;
+    }
+    else if( node->n_nodes == 1 && node->type == TR_NODE_4 )
+    {
+        tr_set_container( trie, node, TR_NODE_1 );
+    }
+    else if( node->type == TR_NODE_16 && node->n_nodes <= TR_NODE_16_SHRINK )
+    {
+        tr_set_container( trie, node, TR_NODE_4 );
+    }
+    else if( node->type == TR_NODE_48 && node->n_nodes <= TR_NODE_48_SHRINK )
+    {
+        tr_set_container( trie, node, TR_NODE_16 );
+    }
+    else if( node->type == TR_NODE_256 && node->n_nodes <= TR_NODE_256_SHRINK )
+    {
+        tr_set_container( trie, node, TR_NODE_48 );
+    }
+}
+
+/*
+ * Split the node so that only its first 'at' span bytes are left to it, the
+ * remaining ones go to a new child. The node holding the data keeps its
+ * identity, so the new node takes its place in the parent and becomes its
+ * parent instead.
+ */
+static tnode_t *tr_split_node( trie_t *trie, tnode_t *parent, tnode_t *node, size_t at )
+{
+    unsigned char *span = tr_span( node );
+    tnode_t **slot = tr_find_slot( parent, node->value ),
+             *head = NULL;
+
+    assert( slot != NULL );
+    assert( at < node->span_len );
+
+    head = tr_create_node( trie, node->value, span, at );
+
+    // the new node has the same subtree
+    head->n_items = node->n_items;
+    head->n_bytes = node->n_bytes;
+
+    *slot = head;
+
+    node->value = span[at];
+
+    tr_set_span( trie, node, span + at + 1, node->span_len - at - 1 );
+
+    tr_add_child( trie, head, node );
+
+    return head;
+}
+
+/*
+ * Merge the node with its only child, the child absorbs the node bytes and
+ * takes its place in the parent. Return 0 if the resulting span would be
+ * too long.
+ */
+static int tr_merge_node( trie_t *trie, tnode_t *parent, tnode_t *node )
+{
+    tnode_t *child = tr_next_child( node, 0 ),
+           **slot = tr_find_slot( parent, node->value );
+    size_t len = node->span_len + 1 + child->span_len;
+    unsigned char small[TR_SPAN_INLINE], *buffer = NULL;
+
+    assert( node->n_nodes == 1 );
+    assert( slot != NULL );
+
+    if( len > TR_SPAN_MAX )
+        return 0;
+
+    buffer = len > TR_SPAN_INLINE ? zmalloc( len ) : small;
+
+    memcpy( buffer, tr_span( node ), node->span_len );
+    buffer[ node->span_len ] = child->value;
+    memcpy( buffer + node->span_len + 1, tr_span( child ), child->span_len );
+
+    tr_set_span( trie, child, buffer, len );
+
+    if( buffer != small )
+        zfree( buffer );
+
+    child->value = node->value;
+    *slot = child;
+
+    tr_free_container( trie, node );
+
+    node->n_nodes = 0;
+
+    tr_destroy_node( trie, node );
+
+    return 1;
+}
+
+/*
+ * Unlink a node without data and children, or merge a node without data
+ * with its only child. Return 1 if the node was destroyed.
+ */
+static int tr_compact_node( trie_t *trie, tnode_t *parent, tnode_t *node )
+{
+    if( node->data != NULL || node->n_nodes > 1 || node == &trie->root )
+    {
+        return 0;
+    }
+    else if( node->n_nodes == 0 )
+    {
+        tr_remove_child( trie, parent, node->value );
+        tr_destroy_node( trie, node );
+
+        return 1;
+    }
+    else
+    {
+        return tr_merge_node( trie, parent, node );
+    }
+}
+
+/*
+ * Compact every node on the path of the given key, bottom up, so that
+ * chains left without data by removals are unlinked back to the first
+ * node still needed.
+ */
+static void tr_prune( trie_t *trie, tnode_t *node, unsigned char *key, int len )
+{
+    tnode_t *child = tr_find_next_node( node, key[0] );
+    int left = len - 1;
+
+    if( child == NULL || memcmp( tr_span( child ), key + 1, child->span_len < left ? child->span_len : left ) != 0 )
+        return;
+
+    if( left > child->span_len )
+        tr_prune( trie, child, key + 1 + child->span_len, left - child->span_len );
+
+    tr_compact_node( trie, node, child );
+}
+
+static size_t tr_weight( trie_t *trie, void *data )
+{
+    return trie->weight ? trie->weight( data ) : 0;
+}
+
+/*
+ * Add the given deltas to the counters of every node on the path of the
+ * key, which must exist.
+ */
+static void tr_update_path( trie_t *trie, unsigned char *key, int len, int items, long bytes )
+{
+    tnode_t *node = &trie->root;
+    size_t i = 0;
+
+    node->n_items += items;
+    node->n_bytes += bytes;
+
+    while( i < len )
+    {
+        node = tr_find_next_node( node, key[i] );
+
+        assert( node != NULL );
+
+        node->n_items += items;
+        node->n_bytes += bytes;
+
+        i += 1 + node->span_len;
+    }
+}
+
+// Record the next node of the path of a slot, or forget the path if it's too deep.
+static void tr_slot_push( tr_slot_t *slot, tnode_t *node )
+{
+    if( slot->depth >= 0 && slot->depth < TR_PATH_MAX )
+        slot->path[ slot->depth++ ] = node;
+    else
+        slot->depth = -1;
+}
+
+// Same as tr_update_path using the recorded path of the slot when known.
+static void tr_update_slot( trie_t *trie, tr_slot_t *slot, int items, long bytes )
+{
+    int i;
+
+    if( slot->depth < 0 )
+    {
+        tr_update_path( trie, slot->key, slot->len, items, bytes );
+        return;
+    }
+
+    for( i = 0; i < slot->depth; ++i )
+    {
+        slot->path[i]->n_items += items;
+        slot->path[i]->n_bytes += bytes;
+    }
+}
+
+/*
+ * Move a node without data to a leaf object, which takes the place of the
+ * node in the parent along with its span and children.
+ */
+static tnode_t *tr_make_leaf( trie_t *trie, tnode_t *parent, tnode_t *node )
+{
+    tnode_t **slot = tr_find_slot( parent, node->value ),
+             *leaf = opool_alloc_object( &trie->leaf_pool );
+
+    assert( slot != NULL );
+    assert( leaf != NULL );
+    assert( node->data == NULL );
+    // a traversal could be holding the node
+    assert( trie->walking == 0 );
+
+    *leaf = *node;
+    leaf->leaf = 1;
+    *slot = leaf;
+
+    opool_free_object( &trie->node_pool, node );
+
+    trie->mem += trie->leaf_size;
+
+    ++trie->n_leaves;
+
+    return leaf;
+}
+
+/*
+ * Return the node the key ends at, creating or splitting the nodes on its
+ * path as needed, and record the path into the slot. With leaf_size set the
+ * node is a leaf one.
+ */
+static tnode_t *tr_insert_node( trie_t *trie, unsigned char *key, int len, tr_slot_t *slot )
+{
+    tnode_t *parent = &trie->root, *node = NULL, *prev = NULL;
+    unsigned char *span = NULL;
+    size_t i = 0, j, left;
+
+    slot->depth = 0;
+    slot->key   = key;
+    slot->len   = len;
+
+    tr_slot_push( slot, parent );
+
+    while( i < len )
+    {
+        node = tr_find_next_node( parent, key[i] );
+        left = len - i - 1;
+
+        if( node == NULL )
+        {
+            node = tr_create_node( trie, key[i], key + i + 1, left > TR_SPAN_MAX ? TR_SPAN_MAX : left );
+
+            tr_add_child( trie, parent, node );
+        }
+        else
+        {
+            span = tr_span( node );
+
+            for( j = 0; j < node->span_len && j < left && span[j] == key[i + 1 + j]; ++j );
+
+            // the key ends or diverges inside the span
+            if( j < node->span_len )
+            {
+                node = tr_split_node( trie, parent, node, j );
+            }
+        }
+
+        assert( node != NULL );
+
+        tr_slot_push( slot, node );
+
+        i += 1 + node->span_len;
+        prev   = parent;
+        parent = node;
+    }
+
+    if( trie->leaf_size && !node->leaf )
+    {
+        node = tr_make_leaf( trie, prev, node );
+
+        if( slot->depth > 0 )
+            slot->path[ slot->depth - 1 ] = node;
+    }
+
+    slot->node = node;
+
+    return node;
 }
 
 void *tr_insert( trie_t *trie, unsigned char *key, int len, void *value )
@@ -60,82 +845,337 @@ void *tr_insert( trie_t *trie, unsigned char *key, int len, void *value )
     assert( trie != NULL );
     assert( key != NULL );
     assert( len > 0 );
+    assert( trie->leaf_size == 0 );
 
-	tnode_t *parent = trie, *node = NULL;
-	size_t i;
-	char v;
-	unsigned short current_size;
+    tnode_t *node = NULL;
+    tr_slot_t slot;
+    void *old = NULL;
 
-	for( i = 0; i < len; ++i )
+    // the key is already there, only the weight could need the path
+    if( trie->index && ( node = ht_find( trie->index, key, len ) ) != NULL )
     {
-		v = key[i];
-		node  = tr_find_next_node( parent, v );
+        old = node->data;
+        node->data = value;
 
-		if( node == NULL )
-        {
-			/*
-			 * Allocate, initialize and append a new node.
-			 *
-			 * NOTE: As a future optimization, the parent->nodes new array
-			 * will be quick-sorted on every reallocation, so the search with
-			 * tr_find_next_node would be O(log N) instead of O(N).
-			 */
-			current_size  = tr_node_children( parent );
-			parent->nodes = zrealloc( parent->nodes, sizeof(tnode_t) * ( current_size + 1 ) );
-
-            assert( parent->nodes != NULL );
-
-			parent->n_nodes = current_size;
-            node		    = parent->nodes + current_size;
-
-			node->value   = v;
-			node->data    =
-			node->nodes   = NULL;
-			node->n_nodes = 0;
-		}
+        if( trie->weight )
+            tr_update_path( trie, key, len, 0, (long)tr_weight( trie, value ) - (long)tr_weight( trie, old ) );
 
-        assert( node != NULL );
+        return old;
+    }
 
-		parent = node;
-	}
+    node = tr_insert_node( trie, key, len, &slot );
 
-	void *old = node->data;
+    old = node->data;
     node->data = value;
 
-	return old;
+    if( old == NULL )
+    {
+        tr_update_slot( trie, &slot, 1, tr_weight( trie, value ) );
+
+        if( trie->index )
+            ht_add( trie->index, key, len, node );
+    }
+    else if( trie->weight )
+        tr_update_slot( trie, &slot, 0, (long)tr_weight( trie, value ) - (long)tr_weight( trie, old ) );
+
+    return old;
+}
+
+void *tr_insert_leaf( trie_t *trie, unsigned char *key, int len, size_t weight, int *created )
+{
+    assert( trie != NULL );
+    assert( key != NULL );
+    assert( len > 0 );
+    assert( trie->leaf_size > 0 );
+    assert( created != NULL );
+
+    tr_slot_t slot;
+    void *data = tr_upsert( trie, key, len, &slot, created );
+
+    if( *created )
+        tr_update_slot( trie, &slot, 0, weight );
+
+    else if( trie->weight )
+        tr_update_slot( trie, &slot, 0, (long)weight - (long)tr_weight( trie, data ) );
+
+    return data;
 }
 
-trie_t *tr_find_node( trie_t *trie, unsigned char *key, int len )
+/*
+ * The new leaf of a created key counts as an item of no weight, its data is
+ * up to the caller which then sets the weight with tr_resize_slot.
+ */
+void *tr_upsert( trie_t *trie, unsigned char *key, int len, tr_slot_t *slot, int *created )
 {
     assert( trie != NULL );
     assert( key != NULL );
     assert( len > 0 );
+    assert( trie->leaf_size > 0 );
+    assert( slot != NULL );
+    assert( created != NULL );
 
-	tnode_t *node = trie;
-	int i = 0;
+    tnode_t *node = trie->index ? ht_find( trie->index, key, len ) : NULL;
 
-	do
+    // indexed keys skip the descent, their path is walked only if needed
+    if( node != NULL )
     {
-		// Find next node ad continue.
-		node = tr_find_next_node( node, key[i++] );
-	}
-	while( --len && node );
+        slot->node  = node;
+        slot->depth = -1;
+        slot->key   = key;
+        slot->len   = len;
+
+        *created = 0;
+
+        return node->data;
+    }
+
+    node = tr_insert_node( trie, key, len, slot );
+
+    if( node->data == NULL )
+    {
+        node->data = tr_leaf_data( node );
+        *created = 1;
+
+        tr_update_slot( trie, slot, 1, 0 );
+
+        if( trie->index )
+            ht_add( trie->index, key, len, node );
+    }
+    else
+        *created = 0;
+
+    return node->data;
+}
+
+/*
+ * Find the node whose path covers the first 'len' bytes of the key, if
+ * 'exact' is set the path must end right there. The offset of the node
+ * value inside the key is stored in 'offset' if not NULL.
+ */
+static tnode_t *tr_descend( trie_t *trie, unsigned char *key, int len, int exact, size_t *offset )
+{
+    tnode_t *node = &trie->root;
+    size_t i = 0, left, n;
+
+    while( i < len )
+    {
+        // Find next node ad continue.
+        node = tr_find_next_node( node, key[i] );
+        if( node == NULL )
+            return NULL;
+
+        left = len - i - 1;
+        n    = node->span_len < left ? node->span_len : left;
+
+        if( ( exact && node->span_len > left ) || memcmp( tr_span( node ), key + i + 1, n ) != 0 )
+            return NULL;
+
+        if( offset )
+            *offset = i;
+
+        i += 1 + node->span_len;
+    }
+
+    return node;
+}
+
+tnode_t *tr_find_node( trie_t *trie, unsigned char *key, int len )
+{
+    assert( trie != NULL );
+    assert( key != NULL );
+    assert( len > 0 );
+
+    // the index only knows the nodes with data, the others are of no use anyway
+    if( trie->index )
+        return ht_find( trie->index, key, len );
+
+    return tr_descend( trie, key, len, 1, NULL );
+}
+
+void *tr_find( trie_t *trie, unsigned char *key, int len )
+{
+    assert( trie != NULL );
+    assert( key != NULL );
+    assert( len > 0 );
+
+	tnode_t *node = tr_find_node( trie, key, len );
+	/*
+	 * End of the chain, if data is NULL this chain is not complete,
+	 * therefore 'key' does not map any alive object.
+	 */
+	return ( node ? node->data : NULL );
+}
 
-	return node;
+/*
+ * Walk engine: the subtree is visited depth first with an explicit stack, so
+ * that key length doesn't bound on the C stack, and the walk ends as soon as
+ * the handler says so instead of unwinding through every pending sibling.
+ */
+
+// Visit a node after its children instead of before them.
+#define TR_WALK_POST    0x01
+// Compact the visited nodes, handlers can clear their data.
+#define TR_WALK_COMPACT 0x02
+
+// Handler results.
+#define TR_WALK_CONTINUE 0
+// End the walk.
+#define TR_WALK_STOP     1
+// Don't visit the children of the node, for pre-order walks only.
+#define TR_WALK_SKIP     2
+
+// Frames living on the C stack, deeper walks move them to the heap.
+#define TR_WALK_INLINE   64
+
+typedef int (*tr_walk_handler)(tnode_t *, size_t, void *);
+
+typedef struct
+{
+    tnode_t *node;
+    // Offset of the children values inside the key.
+    size_t   level;
+    // Value of the next child to visit, > 0xFF once they all were.
+    int      next;
+}
+tr_frame_t;
+
+typedef struct
+{
+    tr_frame_t *frames;
+    int         depth;
+    int         size;
+    tr_frame_t  small[TR_WALK_INLINE];
+}
+tr_stack_t;
+
+#if defined(__GNUC__)
+#	define tr_prefetch( p ) __builtin_prefetch( p )
+#else
+#	define tr_prefetch( p )
+#endif
+
+static void tr_stack_init( tr_stack_t *stack )
+{
+    stack->frames = stack->small;
+    stack->depth  = 0;
+    stack->size   = TR_WALK_INLINE;
+}
+
+static void tr_stack_push( tr_stack_t *stack, tnode_t *node, size_t level, int next )
+{
+    if( stack->depth == stack->size )
+    {
+        stack->size *= 2;
+
+        if( stack->frames == stack->small )
+            stack->frames = memcpy( zmalloc( stack->size * sizeof(tr_frame_t) ), stack->small, sizeof(stack->small) );
+        else
+            stack->frames = zrealloc( stack->frames, stack->size * sizeof(tr_frame_t) );
+    }
+
+    stack->frames[ stack->depth ].node  = node;
+    stack->frames[ stack->depth ].level = level;
+    stack->frames[ stack->depth ].next  = next;
+
+    ++stack->depth;
+
+    // the container is what the next step reads, and a long span is what a
+    // handler building the key reads
+    tr_prefetch( node->nodes );
+
+    if( node->span_len > TR_SPAN_INLINE )
+        tr_prefetch( node->span.ptr );
+}
+
+static void tr_stack_free( tr_stack_t *stack )
+{
+    if( stack->frames != stack->small )
+        zfree( stack->frames );
+}
+
+/*
+ * Run the walk from the frames on the stack, the nodes they hold were
+ * already visited if the walk is a pre-order one. Return 1 if the handler
+ * ended the walk.
+ */
+static int tr_walk_stack( trie_t *trie, tr_stack_t *stack, int flags, tr_walk_handler handler, void *data )
+{
+    tr_frame_t *frame = NULL;
+    tnode_t *child = NULL;
+    int ret = TR_WALK_CONTINUE;
+
+    while( stack->depth > 0 && ret != TR_WALK_STOP )
+    {
+        frame = &stack->frames[ stack->depth - 1 ];
+
+        /*
+         * Children are fetched by byte value instead of by position, this way
+         * a child can be unlinked or merged without making us skip a sibling.
+         */
+        if( ( child = tr_next_child( frame->node, frame->next ) ) != NULL )
+        {
+            frame->next = child->value + 1;
+
+            if( flags & TR_WALK_POST )
+            {
+                tr_stack_push( stack, child, frame->level + 1 + child->span_len, 0 );
+                continue;
+            }
+
+            tr_prefetch( child->nodes );
+
+            ret = handler( child, frame->level, data );
+
+            if( ret == TR_WALK_CONTINUE )
+                tr_stack_push( stack, child, frame->level + 1 + child->span_len, 0 );
+
+            else if( flags & TR_WALK_COMPACT )
+                tr_compact_node( trie, frame->node, child );
+
+            continue;
+        }
+
+        --stack->depth;
+
+        if( flags & TR_WALK_POST )
+            ret = handler( frame->node, frame->level - ( frame->node == &trie->root ? 0 : 1 + frame->node->span_len ), data );
+
+        // the subtree was visited, unless the walk was ended
+        if( ( flags & TR_WALK_COMPACT ) && stack->depth > 0 )
+            tr_compact_node( trie, stack->frames[ stack->depth - 1 ].node, frame->node );
+    }
+
+    // the nodes still on the stack are compacted as well
+    while( ( flags & TR_WALK_COMPACT ) && stack->depth > 1 )
+    {
+        --stack->depth;
+
+        tr_compact_node( trie, stack->frames[ stack->depth - 1 ].node, stack->frames[ stack->depth ].node );
+    }
+
+    return ret == TR_WALK_STOP;
 }
 
-void *tr_find( trie_t *trie, unsigned char *key, int len )
-{
-    assert( trie != NULL );
-    assert( key != NULL );
-    assert( len > 0 );
+/*
+ * Visit the subtree of 'node', whose value is at the given offset of the key
+ * ( its children start right after it, or right there for the root ).
+ */
+static int tr_walk( trie_t *trie, tnode_t *node, size_t level, int flags, tr_walk_handler handler, void *data )
+{
+    tr_stack_t stack;
+    int stopped = 0, ret = TR_WALK_CONTINUE;
+
+    if( ( flags & TR_WALK_POST ) == 0 && ( ret = handler( node, level, data ) ) != TR_WALK_CONTINUE )
+        return ret == TR_WALK_STOP;
+
+    tr_stack_init( &stack );
+    tr_stack_push( &stack, node, node == &trie->root ? level : level + 1 + node->span_len, 0 );
+
+    stopped = tr_walk_stack( trie, &stack, flags, handler, data );
+
+    tr_stack_free( &stack );
 
-	tnode_t *node = tr_find_node( trie, key, len );
-	/*
-	 * End of the chain, if data is NULL this chain is not complete,
-	 * therefore 'key' does not map any alive object.
-	 */
-	return ( node ? node->data : NULL );
+    return stopped;
 }
 
 struct tr_search_data
@@ -143,6 +1183,10 @@ struct tr_search_data
     llist_t **keys;
     llist_t **values;
     char    *current;
+    int      maxkeylen;
+    // Last key of a range search.
+    unsigned char *end;
+    int      endlen;
     size_t   total;
     long     limit;
     tr_count_handler  count_callback;
@@ -151,51 +1195,64 @@ struct tr_search_data
     void    *ctx;
 };
 
+struct tr_recurse_data
+{
+    tr_recurse_handler handler;
+    void *data;
+};
+
+static int tr_recurse_walk_handler( tnode_t *node, size_t level, void *data )
+{
+    struct tr_recurse_data *recurse = data;
+
+    recurse->handler( node, level, recurse->data );
+
+    return TR_WALK_CONTINUE;
+}
+
 void tr_recurse( trie_t *trie, tr_recurse_handler handler, void *data, size_t level )
 {
     assert( trie != NULL );
     assert( handler != NULL );
 
-    struct tr_search_data *search = data;
-
-    // we've reached the limit
-    if( search && search->limit > 0 && search->total == search->limit ){
-        return;
-    }
-
-	size_t i, nnodes = tr_node_children(trie);
+    struct tr_recurse_data recurse = { handler, data };
 
-    assert( nnodes == 0 || trie->nodes != NULL );
+    ++trie->walking;
 
-	handler( trie, level, data );
+    tr_walk( trie, &trie->root, level, TR_WALK_COMPACT, tr_recurse_walk_handler, &recurse );
 
-	for( i = 0; i < nnodes; ++i )
-    {
-		tr_recurse( trie->nodes + i, handler, data, level + 1 );
-	}
+    --trie->walking;
 }
 
-static void tr_search_recursive_handler(tnode_t *node, size_t level, void *data)
+// The walk ends once the limit of matches is reached.
+#define tr_search_result( search ) ( (search)->limit > 0 && (search)->total >= (size_t)(search)->limit ? TR_WALK_STOP : TR_WALK_CONTINUE )
+
+static int tr_search_recursive_handler(tnode_t *node, size_t level, void *data)
 {
     assert( node != NULL );
     assert( data != NULL );
 
-	struct tr_search_data *search = data;
+    struct tr_search_data *search = data;
+
+    // there can't be any stored key that long below
+    if( level + 1 + node->span_len >= search->maxkeylen )
+        return TR_WALK_SKIP;
 
-	search->current[ level ] = node->value;
+    search->current[ level ] = node->value;
+    memcpy( search->current + level + 1, tr_span( node ), node->span_len );
 
-	// found a value
-	if( node->data != NULL )
+    // found a value
+    if( node->data != NULL )
     {
-		search->current[ level + 1 ] = '\0';
+        search->current[ level + 1 + node->span_len ] = '\0';
 
         // use the count callback
         if( search->count_callback != NULL ) {
-            search->total += search->count_callback( search->ctx, search->current, node->data );
+            search->total += search->count_callback( search->ctx, search->current, level + 1 + node->span_len, node->data );
         }
         // use the search callback
         else if( search->search_callback != NULL ) {
-            search->total += search->search_callback( search->ctx, search->current, node->data );
+            search->total += search->search_callback( search->ctx, search->current, level + 1 + node->span_len, node->data );
         }
         // append items to provided lists
         else {
@@ -210,6 +1267,33 @@ static void tr_search_recursive_handler(tnode_t *node, size_t level, void *data)
                 ll_append( *search->values, node->data );
             }
         }
+    }
+
+    return tr_search_result( search );
+}
+
+/*
+ * Visit every node whose key starts with the given prefix, the prefix can
+ * end in the middle of the span of the first node.
+ */
+static void tr_search_prefix( trie_t *trie, unsigned char *prefix, int len, tr_walk_handler handler, struct tr_search_data *search )
+{
+    size_t offset = 0;
+	tnode_t *start = tr_descend( trie, prefix, len, 0, &offset );
+
+	if( start )
+    {
+		memcpy( search->current, prefix, offset );
+
+		++trie->walking;
+
+		tr_walk( trie, start, offset, TR_WALK_COMPACT, handler, search );
+
+		--trie->walking;
+
+		// the walk can't compact the first node and the ones above it
+		if( trie->walking == 0 )
+		    tr_prune( trie, &trie->root, prefix, len );
 	}
 }
 
@@ -226,17 +1310,11 @@ size_t tr_search( trie_t *trie, unsigned char *prefix, int len, long limit, int
 	searchdata.keys    = keys;
 	searchdata.values  = values;
 	searchdata.current = alloca( maxkeylen );
+	searchdata.maxkeylen = maxkeylen;
 	searchdata.total   = 0;
     searchdata.limit   = limit;
 
-	tnode_t *start = tr_find_node( trie, prefix, len );
-
-	if( start )
-    {
-		strncpy( searchdata.current, (char *)prefix, len );
-
-		tr_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
-	}
+	tr_search_prefix( trie, prefix, len, tr_search_recursive_handler, &searchdata );
 
 	return searchdata.total;
 }
@@ -250,23 +1328,54 @@ size_t tr_search_callback( trie_t *trie, unsigned char *prefix, int len, long li
     struct tr_search_data searchdata = {0};
 
 	searchdata.current = alloca( maxkeylen );
+
+	searchdata.maxkeylen = maxkeylen;
 	searchdata.total   = 0;
     searchdata.search_callback = callback;
     searchdata.ctx     = ctx;
     searchdata.limit   = limit;
 
-	tnode_t *start = tr_find_node( trie, prefix, len );
+	tr_search_prefix( trie, prefix, len, tr_search_recursive_handler, &searchdata );
 
-	if( start )
-    {
-		strncpy( searchdata.current, (char *)prefix, len );
+	return searchdata.total;
+}
 
-		tr_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
-	}
 
-	return searchdata.total;
+size_t tr_count_prefix( trie_t *trie, unsigned char *prefix, int len, size_t *bytes )
+{
+    assert( trie != NULL );
+    assert( prefix != NULL );
+    assert( len > 0 );
+
+    // every key below the node covering the prefix starts with it
+    tnode_t *node = tr_descend( trie, prefix, len, 0, NULL );
+
+    if( bytes )
+        *bytes = node ? node->n_bytes : 0;
+
+    return node ? node->n_items : 0;
+}
+
+void tr_resize( trie_t *trie, unsigned char *key, int len, long delta )
+{
+    assert( trie != NULL );
+    assert( key != NULL );
+    assert( len > 0 );
+    assert( tr_find( trie, key, len ) != NULL );
+
+    if( delta )
+        tr_update_path( trie, key, len, 0, delta );
 }
 
+void tr_resize_slot( trie_t *trie, tr_slot_t *slot, long delta )
+{
+    assert( trie != NULL );
+    assert( slot != NULL );
+    assert( slot->node != NULL && slot->node->data != NULL );
+
+    if( delta )
+        tr_update_slot( trie, slot, 0, delta );
+}
 
 size_t tr_count( trie_t *trie, unsigned char *prefix, int len, long limit, int maxkeylen, tr_count_handler callback, void *ctx ) {
     assert( trie != NULL );
@@ -279,40 +1388,38 @@ size_t tr_count( trie_t *trie, unsigned char *prefix, int len, long limit, int m
     searchdata.keys    = NULL;
     searchdata.values  = NULL;
     searchdata.current = alloca( maxkeylen );
+    searchdata.maxkeylen = maxkeylen;
     searchdata.total   = 0;
     searchdata.limit   = limit;
     searchdata.count_callback = callback;
     searchdata.ctx     = ctx;
 
-    tnode_t *start = tr_find_node( trie, prefix, len );
-
-    if( start )
-    {
-        strncpy( searchdata.current, (char *)prefix, len );
-
-        tr_recurse( start, tr_search_recursive_handler, &searchdata, len - 1 );
-    }
+    tr_search_prefix( trie, prefix, len, tr_search_recursive_handler, &searchdata );
 
     return searchdata.total;
 }
 
-static void tr_search_nodes_recursive_handler(tnode_t *node, size_t level, void *data)
+static int tr_search_nodes_recursive_handler(tnode_t *node, size_t level, void *data)
 {
     assert( node != NULL );
     assert( data != NULL );
 
-	struct tr_search_data *search = data;
+    struct tr_search_data *search = data;
+
+    if( level + 1 + node->span_len >= search->maxkeylen )
+        return TR_WALK_SKIP;
 
-	search->current[ level ] = node->value;
+    search->current[ level ] = node->value;
+    memcpy( search->current + level + 1, tr_span( node ), node->span_len );
 
-	// found a value
-	if( node->data != NULL )
+    // found a value
+    if( node->data != NULL )
     {
-		search->current[ level + 1 ] = '\0';
+        search->current[ level + 1 + node->span_len ] = '\0';
 
         // use the search nodes callback
         if( search->search_nodes_callback != NULL ) {
-            search->total += search->search_nodes_callback( search->ctx, search->current, node );
+            search->total += search->search_nodes_callback( search->ctx, search->current, level + 1 + node->span_len, node );
         }
         else {
             ++search->total;
@@ -322,10 +1429,12 @@ static void tr_search_nodes_recursive_handler(tnode_t *node, size_t level, void
             assert( *search->keys != NULL );
             assert( *search->values != NULL );
 
-    		ll_append( *search->keys,   zstrdup( search->current ) );
-    		ll_append( *search->values, node );
+            ll_append( *search->keys,   zstrdup( search->current ) );
+            ll_append( *search->values, node );
         }
-	}
+    }
+
+    return TR_WALK_CONTINUE;
 }
 
 size_t tr_search_nodes( trie_t *trie, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **nodes )
@@ -340,16 +1449,10 @@ size_t tr_search_nodes( trie_t *trie, unsigned char *prefix, int len, int maxkey
 	searchdata.keys    = keys;
 	searchdata.values  = nodes;
 	searchdata.current = alloca( maxkeylen );
+	searchdata.maxkeylen = maxkeylen;
 	searchdata.total   = 0;
 
-	tnode_t *start = tr_find_node( trie, prefix, len );
-
-	if( start )
-    {
-		strncpy( searchdata.current, (char *)prefix, len );
-
-		tr_recurse( start, tr_search_nodes_recursive_handler, &searchdata, len - 1 );
-	}
+	tr_search_prefix( trie, prefix, len, tr_search_nodes_recursive_handler, &searchdata );
 
 	return searchdata.total;
 }
@@ -365,16 +1468,10 @@ size_t tr_search_nodes_callback( trie_t *trie, unsigned char *prefix, int len, i
 	searchdata.search_nodes_callback = callback;
     searchdata.ctx     = ctx;
 	searchdata.current = alloca( maxkeylen );
+	searchdata.maxkeylen = maxkeylen;
 	searchdata.total   = 0;
 
-	tnode_t *start = tr_find_node( trie, prefix, len );
-
-	if( start )
-    {
-		strncpy( searchdata.current, (char *)prefix, len );
-
-		tr_recurse( start, tr_search_nodes_recursive_handler, &searchdata, len - 1 );
-	}
+	tr_search_prefix( trie, prefix, len, tr_search_nodes_recursive_handler, &searchdata );
 
 	return searchdata.total;
 }
@@ -385,15 +1482,7 @@ void *tr_remove( trie_t *trie, unsigned char *key, int len )
     assert( key != NULL );
     assert( len > 0 );
 
-	tnode_t *node = trie;
-	int i = 0;
-
-	do
-    {
-		// Find next link ad continue.
-		node = tr_find_next_node( node, key[i++] );
-	}
-	while( --len && node );
+	tnode_t *node = tr_find_node( trie, key, len );
 
 	/*
 	 * End of the chain, if e_data is NULL this chain is not complete,
@@ -405,6 +1494,20 @@ void *tr_remove( trie_t *trie, unsigned char *key, int len )
 
 		node->data = NULL;
 
+        if( trie->index )
+            ht_remove( trie->index, key, len );
+
+        tr_update_path( trie, key, len, -1, -(long)tr_weight( trie, retn ) );
+
+        /*
+         * A traversal could be visiting this node right now, in that case
+         * the node is compacted by the traversal itself once it's done.
+         */
+        if( trie->walking == 0 )
+        {
+            tr_prune( trie, &trie->root, key, len );
+        }
+
 		return retn;
 	}
 	else
@@ -413,26 +1516,389 @@ void *tr_remove( trie_t *trie, unsigned char *key, int len )
     }
 }
 
+// Append the bytes of the node to the key buffer, return the new length or -1 if it doesn't fit.
+static int tr_append_key( tnode_t *node, unsigned char *key, int level, int maxkeylen )
+{
+    if( level + 1 + node->span_len > maxkeylen )
+        return -1;
+
+    key[ level ] = node->value;
+    memcpy( key + level + 1, tr_span( node ), node->span_len );
+
+    return level + 1 + node->span_len;
+}
+
+struct tr_next_data
+{
+    unsigned char *next;
+    int            maxkeylen;
+    int           *nextlen;
+    tnode_t       *found;
+};
+
+// End the walk at the first node with data, building its key.
+static int tr_next_handler( tnode_t *node, size_t level, void *data )
+{
+    struct tr_next_data *search = data;
+    int len = tr_append_key( node, search->next, level, search->maxkeylen );
+
+    if( len < 0 )
+        return TR_WALK_SKIP;
+
+    else if( node->data == NULL )
+        return TR_WALK_CONTINUE;
+
+    *search->nextlen = len;
+    search->found    = node;
+
+    return TR_WALK_STOP;
+}
+
+/*
+ * Push the nodes on the path of the key, each one resuming the walk past
+ * the child the key goes on with, so that only what comes after the key is
+ * visited, or the key itself as well if 'inclusive' is set. The bytes of
+ * the path are built in 'buffer'. Whatever is left of the walk then yields
+ * keys in order.
+ */
+static void tr_seek( trie_t *trie, tr_stack_t *stack, unsigned char *key, int len, int inclusive, unsigned char *buffer, int maxkeylen )
+{
+    tr_frame_t *frame = NULL;
+    tnode_t *child = NULL;
+    int i = 0, l, n, left, cmp;
+
+    tr_stack_push( stack, &trie->root, 0, 0 );
+
+    while( i < len )
+    {
+        frame = &stack->frames[ stack->depth - 1 ];
+        frame->next = key[i] + 1;
+
+        if( ( child = tr_find_next_node( frame->node, key[i] ) ) == NULL )
+            break;
+
+        left = len - i - 1;
+        n    = child->span_len < left ? child->span_len : left;
+        cmp  = memcmp( tr_span( child ), key + i + 1, n );
+
+        // the whole child subtree comes after the key, or the key ends
+        // right there and the child has to be visited too
+        if( cmp > 0 || ( cmp == 0 && ( child->span_len > left || ( inclusive && child->span_len == left ) ) ) )
+        {
+            frame->next = key[i];
+            break;
+        }
+        // it comes before, or its keys don't fit
+        else if( cmp < 0 || ( l = tr_append_key( child, buffer, i, maxkeylen ) ) < 0 )
+            break;
+
+        // the key goes on below this child, or ends right there
+        tr_stack_push( stack, child, l, 0 );
+
+        i = l;
+    }
+}
+
+tnode_t *tr_next( trie_t *trie, unsigned char *key, int len, unsigned char *next, int maxkeylen, int *nextlen )
+{
+    assert( trie != NULL );
+    assert( key != NULL || len == 0 );
+    assert( next != NULL );
+    assert( nextlen != NULL );
+
+    struct tr_next_data search = { next, maxkeylen, nextlen, NULL };
+    tr_stack_t stack;
+
+    tr_stack_init( &stack );
+    tr_seek( trie, &stack, key, len, 0, next, maxkeylen );
+
+    tr_walk_stack( trie, &stack, 0, tr_next_handler, &search );
+    tr_stack_free( &stack );
+
+    return search.found;
+}
+
+// Keys come in order, the walk ends at the first one past the end of the range.
+static int tr_search_range_handler( tnode_t *node, size_t level, void *data )
+{
+    assert( node != NULL );
+    assert( data != NULL );
+
+    struct tr_search_data *search = data;
+    unsigned char *current = (unsigned char *)search->current;
+    int len = tr_append_key( node, current, level, search->maxkeylen ), cmp;
+
+    if( len < 0 )
+        return TR_WALK_SKIP;
+
+    cmp = memcmp( current, search->end, len < search->endlen ? len : search->endlen );
+    if( cmp > 0 || ( cmp == 0 && len > search->endlen ) )
+        return TR_WALK_STOP;
+
+    if( node->data != NULL )
+    {
+        current[ len ] = '\0';
+
+        search->total += search->search_callback( search->ctx, current, len, node->data );
+    }
+
+    return tr_search_result( search );
+}
+
+size_t tr_search_range( trie_t *trie, unsigned char *start, int slen, unsigned char *end, int elen, long limit, int maxkeylen, tr_search_handler callback, void *ctx )
+{
+    assert( trie != NULL );
+    assert( start != NULL );
+    assert( end != NULL );
+    assert( slen > 0 && slen < maxkeylen );
+    assert( elen > 0 && elen < maxkeylen );
+    assert( callback != NULL );
+
+    struct tr_search_data searchdata = {0};
+    tr_stack_t stack;
+
+    // keys are bound at 'maxkeylen' like tr_seek does, plus their terminator
+    searchdata.current   = alloca( maxkeylen + 1 );
+    searchdata.maxkeylen = maxkeylen;
+    searchdata.end       = end;
+    searchdata.endlen    = elen;
+    searchdata.limit     = limit;
+    searchdata.search_callback = callback;
+    searchdata.ctx       = ctx;
+
+    ++trie->walking;
+
+    // the nodes on the path of the start key are compacted as the walk unwinds
+    tr_stack_init( &stack );
+    tr_seek( trie, &stack, start, slen, 1, (unsigned char *)searchdata.current, maxkeylen );
+    tr_walk_stack( trie, &stack, TR_WALK_COMPACT, tr_search_range_handler, &searchdata );
+    tr_stack_free( &stack );
+
+    --trie->walking;
+
+    return searchdata.total;
+}
+
+/*
+ * Return the number of keys before the given one in lexicographic order, the
+ * key itself included if 'inclusive' is set. Only the path of the key is
+ * descended, the subtrees on its left are counted by their counters.
+ */
+static size_t tr_rank( trie_t *trie, unsigned char *key, int len, int inclusive )
+{
+    tnode_t *node = &trie->root, *child = NULL;
+    size_t rank = 0;
+    int i = 0, left, n, cmp;
+
+    while( i < len )
+    {
+        // the key of this node is a prefix of the given one
+        if( node->data )
+            ++rank;
+
+        for( child = tr_next_child( node, 0 ); child && child->value < key[i]; child = tr_next_child( node, child->value + 1 ) )
+            rank += child->n_items;
+
+        if( child == NULL || child->value != key[i] )
+            return rank;
+
+        left = len - i - 1;
+        n    = child->span_len < left ? child->span_len : left;
+        cmp  = memcmp( tr_span( child ), key + i + 1, n );
+
+        if( cmp < 0 )
+            return rank + child->n_items;
+
+        else if( cmp > 0 || child->span_len > left )
+            return rank;
+
+        node = child;
+        i   += 1 + child->span_len;
+    }
+
+    // the keys below this node come after the given one
+    return rank + ( inclusive && node->data ? 1 : 0 );
+}
+
+size_t tr_count_range( trie_t *trie, unsigned char *start, int slen, unsigned char *end, int elen )
+{
+    assert( trie != NULL );
+    assert( start != NULL );
+    assert( end != NULL );
+    assert( slen > 0 );
+    assert( elen > 0 );
+
+    size_t before = tr_rank( trie, start, slen, 0 ),
+           upto   = tr_rank( trie, end, elen, 1 );
+
+    return upto > before ? upto - before : 0;
+}
+
+void tr_iter_init( tr_iter_t *it, int maxkeylen )
+{
+    assert( it != NULL );
+    assert( maxkeylen > 0 );
+
+    it->key       = zcalloc( maxkeylen );
+    it->next      = zcalloc( maxkeylen );
+    it->len       = 0;
+    it->maxkeylen = maxkeylen;
+}
+
+void tr_iter_rewind( tr_iter_t *it )
+{
+    assert( it != NULL );
+
+    it->len = 0;
+}
+
+tnode_t *tr_iter_next( trie_t *trie, tr_iter_t *it )
+{
+    assert( trie != NULL );
+    assert( it != NULL );
+
+    unsigned char *swap = NULL;
+    tnode_t *node = tr_next( trie, it->key, it->len, it->next, it->maxkeylen, &it->len );
+
+    if( node == NULL )
+    {
+        it->len = 0;
+        return NULL;
+    }
+
+    swap     = it->key;
+    it->key  = it->next;
+    it->next = swap;
+
+    return node;
+}
+
+void tr_iter_free( tr_iter_t *it )
+{
+    assert( it != NULL );
+
+    zfree( it->key );
+    zfree( it->next );
+
+    it->key = it->next = NULL;
+}
+
+// Release the container and the span of a node, its children go first.
+static int tr_free_handler( tnode_t *node, size_t level, void *data )
+{
+    trie_t *trie = data;
+
+    if( node->nodes )
+    {
+        tr_free_container( trie, node );
+    }
+
+    // spans are the only node memory not living inside the pools
+    tr_set_span( trie, node, NULL, 0 );
+
+    node->n_nodes = 0;
+    node->type    = TR_NODE_1;
+
+    return TR_WALK_CONTINUE;
+}
+
+void tr_init( trie_t *trie )
+{
+    assert( trie != NULL );
+
+    trie->root.data     = NULL;
+    trie->root.nodes    = NULL;
+    trie->root.n_bytes  = 0;
+    trie->root.n_items  = 0;
+    trie->root.span_len = 0;
+    trie->root.n_nodes  = 0;
+    trie->root.value    = 0;
+    trie->root.type     = TR_NODE_1;
+    trie->root.leaf     = 0;
+
+    trie->n_nodes   = 0;
+    trie->n_leaves  = 0;
+    trie->mem       = 0;
+    trie->walking   = 0;
+    trie->weight    = NULL;
+    trie->index     = NULL;
+    trie->leaf_size = 0;
+
+    opool_create( &trie->node_pool,  sizeof(tnode_t),    TR_POOL_INITIAL_CAPACITY, TR_POOL_MAX_BLOCK_SIZE );
+    opool_create( &trie->node4_pool, sizeof(tr_node4_t), TR_POOL_INITIAL_CAPACITY, TR_POOL_MAX_BLOCK_SIZE );
+}
+
 void tr_free( trie_t *trie )
 {
     assert( trie != NULL );
 
-	int i, nnodes = tr_node_children(trie);
+    // every node lives inside the pools, so there's no need to free them one by one.
+    tr_walk( trie, &trie->root, 0, TR_WALK_POST, tr_free_handler, trie );
 
-    assert( nnodes == 0 || trie->nodes != NULL );
+    opool_destroy( &trie->node_pool );
+    opool_destroy( &trie->node4_pool );
 
-	// Better be safe than sorry ;)
-	if( nnodes )
+    if( trie->leaf_size )
     {
-		// First of all, loop all the sub links.
-		for( i = 0; i < nnodes; ++i )
-        {
-			// Free this node children.
-			tr_free( trie->nodes + i );
-		}
+        opool_destroy( &trie->leaf_pool );
 
-	    // Free the node itself.
-		zfree( trie->nodes );
-		trie->nodes = NULL;
-	}
+        trie->leaf_size = 0;
+    }
+
+    trie->root.n_bytes = 0;
+    trie->root.n_items = 0;
+
+    trie->n_nodes  = 0;
+    trie->n_leaves = 0;
+    trie->mem      = 0;
+
+    if( trie->index )
+    {
+        ht_free( trie->index );
+        zfree( trie->index );
+
+        trie->index = NULL;
+    }
+}
+
+void tr_set_weight( trie_t *trie, tr_weight_handler weight )
+{
+    assert( trie != NULL );
+    assert( trie->root.n_items == 0 );
+
+    trie->weight = weight;
+}
+
+void tr_set_index( trie_t *trie, int enabled )
+{
+    assert( trie != NULL );
+    assert( trie->root.n_items == 0 );
+
+    if( enabled && trie->index == NULL )
+    {
+        trie->index = zmalloc( sizeof(htable_t) );
+
+        assert( trie->index != NULL );
+
+        ht_init( trie->index );
+    }
+    else if( !enabled && trie->index != NULL )
+    {
+        ht_free( trie->index );
+        zfree( trie->index );
+
+        trie->index = NULL;
+    }
+}
+
+void tr_set_leaf( trie_t *trie, size_t size )
+{
+    assert( trie != NULL );
+    assert( trie->root.n_items == 0 );
+    assert( trie->leaf_size == 0 );
+    assert( size > 0 );
+
+    trie->leaf_size = size;
+
+    opool_create( &trie->leaf_pool, sizeof(tnode_t) + size, TR_POOL_INITIAL_CAPACITY, TR_POOL_MAX_BLOCK_SIZE );
 }
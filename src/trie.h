@@ -32,45 +32,214 @@
 #include <stdlib.h>
 #include <string.h>
 #include "llist.h"
+#include "obpool.h"
+#include "htable.h"
 
-typedef struct _trie
+/*
+ * Child containers are adaptive radix tree nodes, the container type grows
+ * ( and shrinks ) with the number of children of the node:
+ *
+ *  TR_NODE_1   : no container, 'nodes' points directly to the only child.
+ *  TR_NODE_4   : up to 4 sorted keys and children.
+ *  TR_NODE_16  : up to 16 sorted keys and children.
+ *  TR_NODE_48  : 256 bytes index into up to 48 children.
+ *  TR_NODE_256 : 256 children directly indexed by byte value.
+ */
+#define TR_NODE_1   0x00
+#define TR_NODE_4   0x01
+#define TR_NODE_16  0x02
+#define TR_NODE_48  0x03
+#define TR_NODE_256 0x04
+
+/*
+ * Runs of single child nodes are collapsed into one node, so a node stands
+ * for its 'value' byte followed by 'span_len' bytes of span, the latter are
+ * stored inline when they fit, otherwise in a heap buffer.
+ */
+#define TR_SPAN_INLINE 8
+#define TR_SPAN_MAX    0xFFFF
+
+// Deepest path a tr_slot_t records.
+#define TR_PATH_MAX    64
+
+#define tr_span( n ) ( (n)->span_len > TR_SPAN_INLINE ? (n)->span.ptr : (n)->span.bytes )
+
+typedef struct _tnode
 {
-	// The byte value of this node.
-	unsigned char value;
 	// Data of the node (end marker of a chain).
-	void*   	  data;
-	// Number of children ( base 0 ).
-	unsigned char n_nodes;
-	// Child nodes dynamic array.
-	struct _trie *nodes;
+	void   *data;
+	// Child nodes container, its layout depends on the node type.
+	void   *nodes;
+	// Bytes following 'value' on the path of this node.
+	union
+	{
+		unsigned char  bytes[TR_SPAN_INLINE];
+		unsigned char *ptr;
+	}
+	span;
+	// Total weight of the data in the subtree of this node, the node included.
+	size_t         n_bytes;
+	// Number of nodes with data in the subtree of this node, the node included.
+	unsigned int   n_items;
+	// Number of bytes in the span.
+	unsigned short span_len;
+	// Number of children.
+	unsigned short n_nodes;
+	// The first byte value of this node.
+	unsigned char  value;
+	// Type of the child nodes container, one of TR_NODE_*.
+	unsigned char  type;
+	// 1 if the node has room for the data right after it, see tr_set_leaf.
+	unsigned char  leaf;
+}
+tnode_t;
+
+// The data slot of a leaf node.
+#define tr_leaf_data( n ) ( (void *)( (tnode_t *)(n) + 1 ) )
+
+// Return the weight of a data object, i.e. its size in bytes.
+typedef size_t (*tr_weight_handler)(void *);
+
+typedef struct
+{
+	// Root node of the tree, it never holds data.
+	tnode_t root;
+	// tnode_t objects allocator.
+	opool_t node_pool;
+	// TR_NODE_4 containers allocator, by far the most common ones.
+	opool_t node4_pool;
+	// Number of nodes in the tree, root excluded.
+	size_t  n_nodes;
+	// Memory used by nodes, containers and spans in bytes.
+	size_t  mem;
+	// Number of traversals in progress, nodes are not unlinked while > 0.
+	int     walking;
+	// Weight of a data object, summed up into the n_bytes of its ancestors.
+	tr_weight_handler weight;
+	// Optional index of the nodes with data by their whole key, NULL if disabled.
+	htable_t *index;
+	// Size of the data slot of the leaf nodes, 0 if the data is not stored in the tree.
+	size_t    leaf_size;
+	// Leaf nodes allocator, used only when leaf_size > 0.
+	opool_t   leaf_pool;
+	// Number of leaf nodes in the tree, they are counted in n_nodes too.
+	size_t    n_leaves;
+}
+trie_t;
+
+/*
+ * Resumable iterator over the keys of the tree in lexicographic order. Its
+ * position is the last visited key rather than a node, so the tree can be
+ * freely modified between two steps, the current key included.
+ */
+typedef struct
+{
+	// Key of the last visited node, an empty key is the tree start.
+	unsigned char *key;
+	int            len;
+	// Buffer for the next key, so that tr_next never reads what it writes.
+	unsigned char *next;
+	// Size of both buffers.
+	int            maxkeylen;
 }
-__attribute__((packed)) trie_t;
+tr_iter_t;
 
-typedef trie_t tnode_t;
+// Handle on the node of a key, valid until the structure of the tree changes.
+typedef struct
+{
+	// Node the key ends at.
+	tnode_t       *node;
+	// Nodes from the root to 'node', so that their counters are updated
+	// without descending the tree again.
+	tnode_t       *path[TR_PATH_MAX];
+	// Number of nodes in the path, -1 if it's not known.
+	int            depth;
+	// The key, to walk the path again when it's not known.
+	unsigned char *key;
+	int            len;
+}
+tr_slot_t;
 
 typedef void (*tr_recurse_handler)(tnode_t *, size_t, void *);
-typedef int  (*tr_count_handler)(void *,unsigned char *, void *);
-typedef int  (*tr_search_handler)(void *,unsigned char *, void *);
+// Called with the key of every match, NUL terminated and 'len' bytes long.
+typedef int  (*tr_count_handler)(void *,unsigned char *, int, void *);
+typedef int  (*tr_search_handler)(void *,unsigned char *, int, void *);
 
-#define tr_init_tree( t ) \
-    (t).n_nodes = 0; \
-    (t).data    = 0; \
-	(t).nodes   = NULL
+#define tr_init_tree( t ) tr_init( &(t) )
 
+void    tr_init( trie_t *at );
+// Set the handler giving the weight of the data, before any insertion.
+void    tr_set_weight( trie_t *at, tr_weight_handler weight );
+/*
+ * Enable or disable the hash index of the keys, before any insertion. With
+ * the index exact key lookups don't descend the tree anymore, and neither
+ * does the replacement of the data of an existing key.
+ */
+void    tr_set_index( trie_t *at, int enabled );
+/*
+ * Store the data of every key inside its node, in a slot of 'size' bytes
+ * right after it, before any insertion. This saves a pointer hop on every
+ * lookup, and since a node keeps its address as long as it has data, so
+ * does the slot. Keys are then added with tr_insert_leaf only, and the data
+ * tr_remove returns is no longer valid once it's back, so release it first.
+ */
+void    tr_set_leaf( trie_t *at, size_t size );
 void   *tr_insert( trie_t *at, unsigned char *key, int len, void *value );
-trie_t *tr_find_node( trie_t *at, unsigned char *key, int len );
+/*
+ * Return the data slot of the key, creating the key if needed, in that case
+ * 'created' is set and the slot must be initialized by the caller. 'weight'
+ * is the weight the slot data will have once the caller is done with it.
+ */
+void   *tr_insert_leaf( trie_t *at, unsigned char *key, int len, size_t weight, int *created );
+// Find or create the leaf of the key in a single descent and return its data slot.
+void   *tr_upsert( trie_t *at, unsigned char *key, int len, tr_slot_t *slot, int *created );
+tnode_t *tr_find_node( trie_t *at, unsigned char *key, int len );
 void   *tr_find( trie_t *at, unsigned char *key, int len );
 void    tr_recurse( trie_t *at, tr_recurse_handler handler, void *data, size_t level );
 
 size_t  tr_count( trie_t *at, unsigned char *prefix, int len, long limit, int maxkeylen, tr_count_handler callback, void *ctx );
+/*
+ * Return the number of keys starting with the given prefix without visiting
+ * them, their total weight is stored in 'bytes' if not NULL.
+ */
+size_t  tr_count_prefix( trie_t *at, unsigned char *prefix, int len, size_t *bytes );
+// Add 'delta' to the weight of the data of the key, after it was resized in place.
+void    tr_resize( trie_t *at, unsigned char *key, int len, long delta );
+// Same as tr_resize for the key of a tr_upsert handle.
+void    tr_resize_slot( trie_t *at, tr_slot_t *slot, long delta );
 
 size_t  tr_search( trie_t *at, unsigned char *prefix, int len, long limit, int maxkeylen, llist_t **keys, llist_t **values );
 size_t  tr_search_callback( trie_t *at, unsigned char *prefix, int len, long limit, int maxkeylen, tr_search_handler callback, void *ctx );
 
+/*
+ * Call 'callback' for every key between 'start' and 'end', both included,
+ * in lexicographic order and up to 'limit' matches. The walk starts right
+ * at 'start' and ends at the first key past 'end', so the subtrees out of
+ * the range are never visited. Keys up to 'maxkeylen' bytes are emitted,
+ * the same ones tr_count_range counts.
+ */
+size_t  tr_search_range( trie_t *at, unsigned char *start, int slen, unsigned char *end, int elen, long limit, int maxkeylen, tr_search_handler callback, void *ctx );
+// Return the number of keys between 'start' and 'end', both included, without visiting them.
+size_t  tr_count_range( trie_t *at, unsigned char *start, int slen, unsigned char *end, int elen );
+
 size_t  tr_search_nodes( trie_t *at, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **nodes );
 size_t  tr_search_nodes_callback( trie_t *at, unsigned char *prefix, int len, int maxkeylen, tr_search_handler callback, void *ctx );
 
 
+/*
+ * Return the node with data whose key is the first one following 'key' in
+ * lexicographic order, or NULL. Its key is stored in 'next' and its length
+ * in 'nextlen'. Use a zero 'len' to get the first key of the tree.
+ */
+tnode_t *tr_next( trie_t *at, unsigned char *key, int len, unsigned char *next, int maxkeylen, int *nextlen );
+
+void     tr_iter_init( tr_iter_t *it, int maxkeylen );
+// Go back to the start of the tree.
+void     tr_iter_rewind( tr_iter_t *it );
+// Step to the next node with data and return it, NULL once the whole tree was visited.
+tnode_t *tr_iter_next( trie_t *at, tr_iter_t *it );
+void     tr_iter_free( tr_iter_t *it );
+
 void   *tr_remove( trie_t *at, unsigned char *key, int len );
 void    tr_free( trie_t *at );
 
@@ -44,6 +44,8 @@
 	#include <unistd.h>
 	#include <sys/types.h>
 	#include <sys/param.h>
+	#include <sys/mman.h>
+	#include <stdint.h>
 #endif
 #if defined(BSD)
 	#include <sys/sysctl.h>
@@ -64,13 +66,15 @@
 #define zmem_incr_mem(__n) do { \
     size_t _n = (__n); \
     if( _n & SIZE_OF_LONG_MASK ) _n += sizeof(long) - ( _n & SIZE_OF_LONG_MASK ); \
-    used_memory += _n; \
+    if( zmem_thread_safe ) __sync_add_and_fetch( &used_memory, _n ); \
+    else used_memory += _n; \
 } while(0)
 // decrement used memory statistic by __n padded to sizeof(long)
 #define zmem_decr_mem(__n) do { \
     size_t _n = (__n); \
     if( _n & SIZE_OF_LONG_MASK ) _n += sizeof(long) - ( _n & SIZE_OF_LONG_MASK ); \
-    used_memory -= _n; \
+    if( zmem_thread_safe ) __sync_sub_and_fetch( &used_memory, _n ); \
+    else used_memory -= _n; \
 } while(0)
 // write the size to the first bytes of p internal pointer
 #define zmem_write_prefix(p,size) *((size_t *)(p)) = (size)
@@ -165,6 +169,8 @@ unsigned long long zmem_available(){
 }
 
 static size_t used_memory = 0;
+// set when more threads are allocating memory
+static int zmem_thread_safe = 0;
 
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",size);
@@ -276,6 +282,42 @@ void *zmemdup(void *ptr, size_t size){
 	return dup;
 }
 
+void *zpages_map(size_t size) {
+    assert( size > 0 );
+    assert( ( size & ( size - 1 ) ) == 0 );
+
+    // map twice the size and cut the misaligned head and tail away
+    char *map = mmap( NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if (map == MAP_FAILED) {
+        zmalloc_oom_handler(size);
+        return NULL;
+    }
+
+    char *ptr = (char *)( ( (uintptr_t)map + size - 1 ) & ~( (uintptr_t)size - 1 ) );
+    size_t head = ptr - map;
+
+    if( head )
+        munmap( map, head );
+
+    munmap( ptr + size, size - head );
+
+    return ptr;
+}
+
+void zpages_unmap(void *ptr, size_t size) {
+    assert( ptr != NULL );
+
+    munmap( ptr, size );
+}
+
+void zmem_charge(size_t size) {
+    zmem_incr_mem(size);
+}
+
+void zmem_discharge(size_t size) {
+    zmem_decr_mem(size);
+}
+
 void zfree(void *ptr) {
 #ifndef HAVE_MALLOC_SIZE
     void *realptr;
@@ -304,9 +346,16 @@ char *zstrdup(const char *s) {
 }
 
 size_t zmem_used(void) {
+    if( zmem_thread_safe )
+        return __sync_add_and_fetch( &used_memory, 0 );
+
     return used_memory;
 }
 
+void zmem_enable_thread_safeness(void) {
+    zmem_thread_safe = 1;
+}
+
 void zmem_set_oom_handler(void (*oom_handler)(size_t)) {
     zmalloc_oom_handler = oom_handler;
 }
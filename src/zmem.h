@@ -55,6 +55,8 @@ void   zmem_allocator( char *buffer, size_t size );
 unsigned long long zmem_available();
 // get memory used by the process
 size_t zmem_used(void);
+// keep the used memory counter consistent across threads
+void   zmem_enable_thread_safeness(void);
 // set a custom out of memory handler
 void   zmem_set_oom_handler(void (*oom_handler)(size_t));
 // get RSS / used ratio
@@ -70,5 +72,12 @@ void *zrealloc(void *ptr, size_t size);
 void  zfree(void *ptr);
 void *zmemdup(void *ptr, size_t size);
 char *zstrdup(const char *s);
+// map pages for custom allocators, aligned to 'size' and given back to the
+// system once unmapped, they're not counted as used memory until charged
+void *zpages_map(size_t size);
+void  zpages_unmap(void *ptr, size_t size);
+// count memory handed out by a custom allocator as used or released
+void  zmem_charge(size_t size);
+void  zmem_discharge(size_t size);
 
 #endif